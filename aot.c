@@ -0,0 +1,349 @@
+#include <math.h>
+#include <stdio.h>
+
+#include "aot.h"
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// Ahead-of-time compilation to C.
+//
+// A chunk is straight-line code: there are no jumps, so every instruction
+// always runs with the same number of values on the stack. That lets us give
+// each stack slot a fixed name, stack[0], stack[1], ..., and turn every
+// instruction into a statement on those names. The C compiler then sees
+// nothing but constant array indices, keeps the slots in registers, and the
+// dispatch loop disappears entirely.
+//
+// The generated program has a single isolate of its own for object.c and
+// memory.c to allocate through, and re-implements the handful of things it needs from
+// vm.c (string concatenation, runtime errors) so it doesn’t drag in the
+// compiler and interpreter.
+
+// Everything the generated code needs besides the statements themselves.
+// The macros mirror the handlers in run(), error messages included.
+static const char* prelude[] = {
+  "#include <math.h>",
+  "#include <stdio.h>",
+  "#include <string.h>",
+  "",
+  "#include \"memory.h\"",
+  "#include \"object.h\"",
+  "#include \"table.h\"",
+  "#include \"value.h\"",
+  "#include \"vm.h\"",
+  "",
+  "static VM vm;",
+  "",
+  "static inline int fail(const char* message, int line) {",
+  "  fprintf(stderr, \"%s\\n[line %d] in script\\n\", message, line);",
+  "  return 70;",
+  "}",
+  "",
+  "static inline bool falsey(Value value) {",
+  "  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));",
+  "}",
+  "",
+  "#define NUMBERS(a, b) (IS_NUMBER(a) && IS_NUMBER(b))",
+  "#define NOT_BOOL_VAL(b) BOOL_VAL(!(b))",
+  "",
+  "#define NUMBER_OP(a, b, value_type, op, line)                                  \\",
+  "  do {                                                                         \\",
+  "    if (!NUMBERS(a, b)) return fail(\"Operands must be numbers.\", line);       \\",
+  "    a = value_type(AS_NUMBER(a) op AS_NUMBER(b));                              \\",
+  "  } while (false)",
+  "",
+  "#define ADD(a, b, line)                                                        \\",
+  "  do {                                                                         \\",
+  "    if (NUMBERS(a, b)) {                                                       \\",
+  "      a = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));                             \\",
+  "    } else if (IS_ANY_STRING(a) && IS_ANY_STRING(b)) {                         \\",
+  "      a = OBJECT_VAL(concatenate_strings(&vm, AS_OBJECT(a), AS_OBJECT(b)));    \\",
+  "    } else {                                                                   \\",
+  "      return fail(\"Operands must be two numbers or two strings.\", line);      \\",
+  "    }                                                                          \\",
+  "  } while (false)",
+  "",
+  "#define NEGATE(a, line)                                                        \\",
+  "  do {                                                                         \\",
+  "    if (!IS_NUMBER(a)) return fail(\"Operand must be a number\", line);         \\",
+  "    a = NUMBER_VAL(-AS_NUMBER(a));                                             \\",
+  "  } while (false)",
+  "",
+  "#define CHECK_DEFINED(slot, line)                                              \\",
+  "  do {                                                                         \\",
+  "    if (IS_UNDEFINED(globals[slot])) {                                         \\",
+  "      fprintf(stderr, \"Undefined variable '%s'.\\n[line %d] in script\\n\",     \\",
+  "              global_names[slot], line);                                     \\",
+  "      return 70;                                                               \\",
+  "    }                                                                          \\",
+  "  } while (false)",
+  "",
+  "#define PRINT(a) (print_value(a), printf(\"\\n\"))",
+  NULL,
+};
+
+// How many bytes the instruction at offset takes up, operands included.
+static int instruction_length(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+      return 2;
+    case OP_GET_LOCAL_ADD_CONST:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+      return 3;
+    default:
+      return 1;
+  }
+}
+
+// How many values the instruction leaves on the stack compared to before.
+static int stack_effect(uint8_t instruction) {
+  switch (instruction) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_ADD_CONST:
+      return 1;
+    case OP_SET_GLOBAL:
+    case OP_SET_LOCAL:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_RETURN:
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+// Writes a C string literal that spells out the given bytes exactly. Anything
+// that isn’t plain printable ASCII becomes a three-digit octal escape, which
+// can’t run into the character that follows it the way a hex escape can. ? is
+// escaped too so no trigraph can sneak in.
+static void emit_string_literal(FILE* out, const char* chars, int length) {
+  fputc('"', out);
+  for (int i = 0; i < length; i++) {
+    unsigned char c = (unsigned char)chars[i];
+    if (c == '"' || c == '\\' || c == '?') {
+      fprintf(out, "\\%c", c);
+    } else if (c < ' ' || c > '~') {
+      fprintf(out, "\\%03o", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+// %a prints the exact bits of a double as a hexadecimal floating constant,
+// so numbers survive the trip through C source without rounding.
+static void emit_number(FILE* out, double number) {
+  if (isnan(number)) {
+    fprintf(out, "NUMBER_VAL(NAN)");
+  } else if (isinf(number)) {
+    fprintf(out, "NUMBER_VAL(%sHUGE_VAL)", number < 0 ? "-" : "");
+  } else {
+    fprintf(out, "NUMBER_VAL(%a)", number);
+  }
+}
+
+// Numbers, Booleans and nil are written inline where the C compiler can see
+// them. Strings have to be allocated (and interned) at startup, so they are
+// loaded from the constants array filled in by main().
+static void emit_constant(FILE* out, Chunk* chunk, int index) {
+  Value value = chunk->constants.values[index];
+  if (IS_NUMBER(value)) {
+    emit_number(out, AS_NUMBER(value));
+  } else if (IS_BOOL(value)) {
+    fputs(AS_BOOL(value) ? "BOOL_VAL(true)" : "BOOL_VAL(false)", out);
+  } else if (IS_NIL(value)) {
+    fprintf(out, "NIL_VAL");
+  } else {
+    fprintf(out, "constants[%d]", index);
+  }
+}
+
+// Writes the statement for the instruction at offset. depth is the number of
+// values on the stack before it runs. Runtime errors report the line of the
+// instruction’s last byte, which is what runtime_error() reads from ip - 1.
+static void emit_instruction(FILE* out, Chunk* chunk, int offset, int depth) {
+  uint8_t instruction = chunk->code[offset];
+  uint8_t operand = offset + 1 < chunk->count ? chunk->code[offset + 1] : 0;
+  // For the global instructions, whose operand is a two-byte slot.
+  int global = offset + 2 < chunk->count
+                   ? GLOBAL_SLOT(&chunk->code[offset + 1]) : 0;
+  int line = chunk->lines[offset + instruction_length(chunk, offset) - 1];
+  int top = depth - 1;
+  int second = depth - 2;
+
+  switch (instruction) {
+    case OP_CONSTANT:
+      fprintf(out, "  stack[%d] = ", depth);
+      emit_constant(out, chunk, operand);
+      fprintf(out, ";\n");
+      break;
+    case OP_NIL:
+      fprintf(out, "  stack[%d] = NIL_VAL;\n", depth);
+      break;
+    case OP_TRUE:
+      fprintf(out, "  stack[%d] = BOOL_VAL(true);\n", depth);
+      break;
+    case OP_FALSE:
+      fprintf(out, "  stack[%d] = BOOL_VAL(false);\n", depth);
+      break;
+    case OP_POP:
+      break;
+    case OP_GET_GLOBAL:
+      fprintf(out, "  CHECK_DEFINED(%d, %d);\n", global, line);
+      fprintf(out, "  stack[%d] = globals[%d];\n", depth, global);
+      break;
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+      fprintf(out, "  CHECK_DEFINED(%d, %d);\n", global, line);
+      fprintf(out, "  globals[%d] = stack[%d];\n", global, top);
+      break;
+    case OP_DEFINE_GLOBAL:
+      fprintf(out, "  globals[%d] = stack[%d];\n", global, top);
+      break;
+    case OP_GET_LOCAL:
+      fprintf(out, "  stack[%d] = stack[%d];\n", depth, operand);
+      break;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+      fprintf(out, "  stack[%d] = stack[%d];\n", operand, top);
+      break;
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+      fprintf(out, "  stack[%d] = BOOL_VAL(%svalues_equal(stack[%d], stack[%d]));\n",
+              second, instruction == OP_NOT_EQUAL ? "!" : "", second, top);
+      break;
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+      fprintf(out, "  ADD(stack[%d], stack[%d], %d);\n", second, top, line);
+      break;
+    case OP_GET_LOCAL_ADD_CONST:
+      fprintf(out, "  stack[%d] = stack[%d];\n", depth, operand);
+      fprintf(out, "  ADD(stack[%d], ", depth);
+      emit_constant(out, chunk, chunk->code[offset + 2]);
+      fprintf(out, ", %d);\n", line);
+      break;
+    case OP_NOT:
+      fprintf(out, "  stack[%d] = BOOL_VAL(falsey(stack[%d]));\n", top, top);
+      break;
+    case OP_NEGATE:
+      fprintf(out, "  NEGATE(stack[%d], %d);\n", top, line);
+      break;
+    case OP_PRINT:
+      fprintf(out, "  PRINT(stack[%d]);\n", top);
+      break;
+    case OP_RETURN:
+      // Always the last instruction. run() returns right after it.
+      break;
+    default: {
+      const char* value_type = "NUMBER_VAL";
+      const char* op;
+      switch (instruction) {
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:  op = "-"; break;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:  op = "*"; break;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM:    op = "/"; break;
+        case OP_GREATER:
+        case OP_GREATER_NUM:   value_type = "BOOL_VAL"; op = ">"; break;
+        case OP_LESS:
+        case OP_LESS_NUM:      value_type = "BOOL_VAL"; op = "<"; break;
+        // a >= b is !(a < b) and a <= b is !(a > b), as in the interpreter.
+        case OP_GREATER_EQUAL: value_type = "NOT_BOOL_VAL"; op = "<"; break;
+        case OP_LESS_EQUAL:    value_type = "NOT_BOOL_VAL"; op = ">"; break;
+        default:               return; // Unknown opcode.
+      }
+      fprintf(out, "  NUMBER_OP(stack[%d], stack[%d], %s, %s, %d);\n",
+              second, top, value_type, op, line);
+      break;
+    }
+  }
+}
+
+void aot_emit(VM* vm, Chunk* chunk, FILE* out) {
+  // Size the stack and the globals. Every slot the chunk refers to was
+  // handed out by global_slot() while compiling it.
+  int max_depth = 0;
+  int depth = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instruction_length(chunk, offset)) {
+    depth += stack_effect(chunk->code[offset]);
+    if (depth > max_depth) max_depth = depth;
+  }
+  int global_count = vm->global_values.count;
+  int constant_count = chunk->constants.count;
+
+  fprintf(out, "// Generated by clox --emit-c.\n");
+  for (const char** line = prelude; *line != NULL; line++) {
+    fprintf(out, "%s\n", *line);
+  }
+
+  // C has no zero-length arrays, so there is always at least one of each.
+  fprintf(out, "\nstatic Value constants[%d];\n",
+          constant_count > 0 ? constant_count : 1);
+  fprintf(out, "static Value globals[%d];\n",
+          global_count > 0 ? global_count : 1);
+  fprintf(out, "static const char* global_names[%d] = {\n",
+          global_count > 0 ? global_count : 1);
+  for (int i = 0; i < global_count; i++) {
+    Object_String* name = AS_STRING(vm->global_names.values[i]);
+    fprintf(out, "  ");
+    emit_string_literal(out, name->chars, name->length);
+    fprintf(out, ",\n");
+  }
+  fprintf(out, "};\n");
+
+  fprintf(out, "\nstatic int run() {\n");
+  fprintf(out, "  Value stack[%d];\n", max_depth > 0 ? max_depth : 1);
+  fprintf(out, "  (void)stack;\n");
+  fprintf(out, "  (void)constants;\n");
+  fprintf(out, "  (void)global_names;\n");
+
+  depth = 0;
+  int line = -1;
+  for (int offset = 0; offset < chunk->count;
+       offset += instruction_length(chunk, offset)) {
+    if (chunk->lines[offset] != line) {
+      line = chunk->lines[offset];
+      fprintf(out, "\n  // line %d\n", line);
+    }
+    emit_instruction(out, chunk, offset, depth);
+    depth += stack_effect(chunk->code[offset]);
+  }
+  fprintf(out, "  return 0;\n}\n");
+
+  fprintf(out, "\nint main() {\n");
+  // run() keeps its Values in C locals the collector can’t see, so it
+  // must never run. Without loops a script can only allocate so much.
+  fprintf(out, "  vm.gc_enabled = false;\n");
+  fprintf(out, "  init_intern_set(&vm.strings);\n");
+  for (int i = 0; i < constant_count; i++) {
+    Value value = chunk->constants.values[i];
+    if (!IS_STRING(value)) continue;
+    fprintf(out, "  constants[%d] = OBJECT_VAL(copy_string(&vm, ", i);
+    emit_string_literal(out, AS_CSTRING(value), AS_STRING(value)->length);
+    fprintf(out, ", %d));\n", AS_STRING(value)->length);
+  }
+  fprintf(out, "  for (int i = 0; i < %d; i++) globals[i] = UNDEFINED_VAL;\n",
+          global_count);
+  fprintf(out, "\n  int status = run();\n");
+  fprintf(out, "  free_intern_set(&vm.strings);\n");
+  fprintf(out, "  free_objects(&vm);\n");
+  fprintf(out, "  return status;\n}\n");
+}
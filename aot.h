@@ -0,0 +1,20 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "vm.h"
+
+// Writes a finished chunk out as a standalone C program that does what
+// interpreting the chunk would do. The program only needs the object, table,
+// intern, memory, heap and value modules at link time:
+//
+//   cc -std=c99 -O2 -pthread -I<clox> script.c object.c table.c intern.c
+//      memory.c heap.c value.c
+//
+// Global variable names are read from the isolate the chunk was compiled in,
+// so this must run before that isolate is freed.
+void aot_emit(VM* vm, Chunk* chunk, FILE* out);
+
+#endif
@@ -0,0 +1,85 @@
+#include <string.h>
+
+#include "arena.h"
+#include "memory.h"
+
+// The first block is this big, and each block after it twice as big as the
+// one before, unless a request needs more than that. A small arena never
+// costs more than one modest allocation, and a big one only a few.
+#define ARENA_FIRST_BLOCK_SIZE 4096
+
+// Every allocation is rounded up to a whole number of these, which keeps
+// everything the arena hands out aligned for a double, a pointer or a Value.
+typedef union {
+  double number;
+  void* pointer;
+  uint64_t bits;
+} ArenaUnit;
+
+struct ArenaBlock {
+  ArenaBlock* next;
+  // In bytes.
+  size_t size;
+  size_t used;
+  ArenaUnit data[];
+};
+
+#define BLOCK_BYTES(block) ((uint8_t*)(block)->data)
+
+static size_t align(size_t size) {
+  return (size + sizeof(ArenaUnit) - 1) / sizeof(ArenaUnit) *
+         sizeof(ArenaUnit);
+}
+
+void init_arena(Arena* arena) {
+  arena->blocks = NULL;
+  arena->last = NULL;
+}
+
+void* arena_allocate(Arena* arena, size_t size) {
+  size = align(size);
+  ArenaBlock* block = arena->blocks;
+  if (block == NULL || block->size - block->used < size) {
+    size_t block_size = block == NULL ? ARENA_FIRST_BLOCK_SIZE
+                                      : block->size * 2;
+    if (block_size < size) block_size = size;
+    block = (ArenaBlock*)reallocate(NULL, 0,
+                                    sizeof(ArenaBlock) + block_size);
+    block->size = block_size;
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+
+  void* result = BLOCK_BYTES(block) + block->used;
+  block->used += size;
+  arena->last = result;
+  return result;
+}
+
+void* arena_grow(Arena* arena, void* pointer, size_t old_size,
+                 size_t new_size) {
+  // The last allocation can just take more of its block if there is room.
+  ArenaBlock* block = arena->blocks;
+  if (pointer != NULL && pointer == arena->last) {
+    size_t start = (size_t)((uint8_t*)pointer - BLOCK_BYTES(block));
+    if (start + align(new_size) <= block->size) {
+      block->used = start + align(new_size);
+      return pointer;
+    }
+  }
+
+  void* result = arena_allocate(arena, new_size);
+  if (pointer != NULL) memcpy(result, pointer, old_size);
+  return result;
+}
+
+void free_arena(Arena* arena) {
+  ArenaBlock* block = arena->blocks;
+  while (block != NULL) {
+    ArenaBlock* next = block->next;
+    reallocate(block, sizeof(ArenaBlock) + block->size, 0);
+    block = next;
+  }
+  init_arena(arena);
+}
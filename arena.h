@@ -0,0 +1,26 @@
+#ifndef clox_arena_h
+#define clox_arena_h
+
+#include "common.h"
+
+// A bump-pointer allocator for data that all dies at the same moment, like
+// the compiler’s working copy of a chunk. Allocating is usually just moving
+// a pointer forward, nothing is ever freed on its own, and free_arena()
+// gives back everything at once.
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+  ArenaBlock* blocks;
+  // The most recent allocation, which arena_grow() can extend in place.
+  void* last;
+} Arena;
+
+void init_arena(Arena* arena);
+void* arena_allocate(Arena* arena, size_t size);
+// Works like reallocate() for memory from the arena: returns a block of
+// new_size bytes that starts with the first old_size bytes of pointer.
+void* arena_grow(Arena* arena, void* pointer, size_t old_size,
+                 size_t new_size);
+void free_arena(Arena* arena);
+
+#endif
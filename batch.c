@@ -0,0 +1,146 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "batch.h"
+#include "memory.h"
+#include "vm.h"
+
+// A work-stealing pool.
+//
+// The scripts are dealt out round-robin into one queue per worker up front.
+// A worker takes scripts from the front of its own queue, and once that runs
+// dry it steals from the back of the other workers’ queues. Scripts can take
+// wildly different amounts of time, so a worker that drew a few slow ones
+// ends up with its remaining scripts taken by idle workers, while workers
+// that are busy only ever touch their own queue.
+//
+// No new work appears once the pool starts, so a worker that finds every
+// queue empty is done for good.
+
+typedef struct {
+  pthread_mutex_t lock;
+  int* scripts;
+  int head;
+  int tail;
+} WorkQueue;
+
+typedef struct {
+  int* statuses;
+  BatchJob job;
+  WorkQueue* queues;
+  int worker_count;
+} Batch;
+
+typedef struct {
+  Batch* batch;
+  int id;
+  pthread_t thread;
+} Worker;
+
+// Returns the next script index from the front of the queue, or -1.
+static int take_front(WorkQueue* queue) {
+  int script = -1;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail) script = queue->scripts[queue->head++];
+  pthread_mutex_unlock(&queue->lock);
+  return script;
+}
+
+// Returns the last script index from the back of the queue, or -1.
+static int take_back(WorkQueue* queue) {
+  int script = -1;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail) script = queue->scripts[--queue->tail];
+  pthread_mutex_unlock(&queue->lock);
+  return script;
+}
+
+static int next_script(Worker* worker) {
+  Batch* batch = worker->batch;
+  int script = take_front(&batch->queues[worker->id]);
+  if (script != -1) return script;
+
+  // Start with the neighbor, so idle workers spread out over the victims
+  // instead of all piling onto queue 0.
+  for (int i = 1; i < batch->worker_count; i++) {
+    int victim = (worker->id + i) % batch->worker_count;
+    script = take_back(&batch->queues[victim]);
+    if (script != -1) return script;
+  }
+  return -1;
+}
+
+static void* run_worker(void* argument) {
+  Worker* worker = (Worker*)argument;
+  Batch* batch = worker->batch;
+
+  int script;
+  while ((script = next_script(worker)) != -1) {
+    VM vm;
+    init_vm(&vm);
+    batch->statuses[script] = batch->job(&vm, script);
+    free_vm(&vm);
+  }
+  return NULL;
+}
+
+int run_batch(int count, int jobs, BatchJob job) {
+  if (jobs > count) jobs = count;
+  if (jobs < 1) jobs = 1;
+
+  Batch batch;
+  batch.job = job;
+  batch.worker_count = jobs;
+  batch.statuses = ALLOCATE(int, count);
+  batch.queues = ALLOCATE(WorkQueue, jobs);
+  Worker* workers = ALLOCATE(Worker, jobs);
+
+  for (int i = 0; i < jobs; i++) {
+    WorkQueue* queue = &batch.queues[i];
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->scripts = ALLOCATE(int, count / jobs + 1);
+    queue->head = 0;
+    queue->tail = 0;
+  }
+  for (int script = 0; script < count; script++) {
+    WorkQueue* queue = &batch.queues[script % jobs];
+    queue->scripts[queue->tail++] = script;
+    batch.statuses[script] = 0;
+  }
+
+  // The calling thread is the first worker.
+  for (int i = 0; i < jobs; i++) {
+    workers[i].batch = &batch;
+    workers[i].id = i;
+  }
+  int started = 1;
+  for (; started < jobs; started++) {
+    if (pthread_create(&workers[started].thread, NULL, run_worker,
+                       &workers[started]) != 0) {
+      // The workers we did get will steal the rest.
+      break;
+    }
+  }
+  run_worker(&workers[0]);
+  for (int i = 1; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  int status = 0;
+  for (int script = 0; script < count; script++) {
+    if (batch.statuses[script] != 0) {
+      status = batch.statuses[script];
+      break;
+    }
+  }
+
+  for (int i = 0; i < jobs; i++) {
+    pthread_mutex_destroy(&batch.queues[i].lock);
+    FREE_ARRAY(int, batch.queues[i].scripts, count / jobs + 1);
+  }
+  FREE_ARRAY(Worker, workers, jobs);
+  FREE_ARRAY(WorkQueue, batch.queues, jobs);
+  FREE_ARRAY(int, batch.statuses, count);
+  return status;
+}
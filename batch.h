@@ -0,0 +1,18 @@
+#ifndef clox_batch_h
+#define clox_batch_h
+
+#include "vm.h"
+
+// Runs script number `script` in a freshly initialized isolate and returns
+// the process exit status it calls for (0, 65 or 70).
+typedef int (*BatchJob)(VM* vm, int script);
+
+// Runs scripts 0 through count - 1 on a pool of `jobs` threads. Each script
+// gets its own isolate, so scripts never see each other’s globals or strings.
+// Output from scripts running at the same time interleaves on stdout.
+//
+// Returns the exit status of the first script, in argument order, that
+// failed, or 0 if they all succeeded.
+int run_batch(int count, int jobs, BatchJob job);
+
+#endif
@@ -0,0 +1,41 @@
+#!/bin/bash
+
+# Builds the benchmarks in bench/ against the interpreter’s own sources,
+# with the disassembly and tracing left out. Run it from the repository
+# root; the programs end up next to their sources.
+
+set -e
+
+CC=${CC:-clang}
+
+CFLAGS="-std=c99 -Wall -Wextra -O2 -DNO_DEBUG -I."
+
+LIBS="-pthread"
+
+# Everything but main.c, which each benchmark replaces.
+SOURCES=($(ls *.c | grep -v '^main\.c$'))
+
+echo "Compiling..."
+
+# The two Value representations.
+$CC $CFLAGS "${SOURCES[@]}" bench/value_bench.c -o bench/value_bench $LIBS
+$CC $CFLAGS -DNO_NAN_BOXING "${SOURCES[@]}" bench/value_bench.c \
+  -o bench/value_bench_tagged $LIBS
+
+# Table throughput.
+$CC $CFLAGS "${SOURCES[@]}" bench/table_bench.c -o bench/table_bench $LIBS
+
+# Probing close to the maximum load, with each table engine.
+$CC $CFLAGS "${SOURCES[@]}" bench/probe_bench.c -o bench/probe_bench $LIBS
+$CC $CFLAGS -DNO_SSE2 "${SOURCES[@]}" bench/probe_bench.c \
+  -o bench/probe_bench_swar $LIBS
+$CC $CFLAGS -DNO_SWISS_TABLE "${SOURCES[@]}" bench/probe_bench.c \
+  -o bench/probe_bench_linear $LIBS
+
+# String hashing.
+$CC $CFLAGS "${SOURCES[@]}" bench/hash_bench.c -o bench/hash_bench $LIBS
+
+# Interning latency while the string set grows.
+$CC $CFLAGS "${SOURCES[@]}" bench/intern_bench.c -o bench/intern_bench $LIBS
+
+echo "Build complete: bench/"
@@ -0,0 +1,93 @@
+// Times hash_string() (see object.c) on strings from one byte to four
+// kilobytes, next to the FNV-1a hash it replaced.
+//
+//   bench/hash_bench [length ...]
+//
+// Each string is hashed at eight alignments in turn, since the hash reads
+// whole words and a string can start anywhere in a larger one. The best of
+// three rounds is reported, in nanoseconds per hash.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "object.h"
+
+#define ROUNDS 3
+#define ALIGNMENTS 8
+#define LONGEST 4096
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// The string hash before wyhash, one multiply per byte.
+static uint32_t hash_fnv(const char* key, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static char text[LONGEST + ALIGNMENTS];
+
+static double time_hash(uint32_t (*hash)(const char*, int), int length) {
+  // Enough hashes to read about 64 MB, but at least a million.
+  int count = (64 << 20) / length;
+  if (count < 1000000) count = 1000000;
+
+  volatile uint32_t sink = 0;
+  double best = 1e9;
+  for (int round = 0; round < ROUNDS; round++) {
+    uint32_t sum = 0;
+    double start = now();
+    for (int i = 0; i < count; i++) {
+      sum += hash(text + i % ALIGNMENTS, length);
+    }
+    double elapsed = now() - start;
+    if (elapsed < best) best = elapsed;
+    sink += sum;
+  }
+  return best / count * 1e9;
+}
+
+static void run(int length) {
+  if (length < 1 || length > LONGEST) {
+    fprintf(stderr, "Lengths go from 1 to %d.\n", LONGEST);
+    exit(64);
+  }
+  double fnv = time_hash(hash_fnv, length);
+  double wyhash = time_hash(hash_string, length);
+  printf("%-6d  fnv %7.1f  wyhash %7.1f  %5.1f GB/s\n", length, fnv, wyhash,
+         length / wyhash);
+}
+
+int main(int argc, const char** argv) {
+  // Same text every run.
+  uint32_t state = 12345;
+  for (int i = 0; i < (int)sizeof(text); i++) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    text[i] = (char)('a' + state % 26);
+  }
+  set_hash_seed(0);
+
+  printf("bytes   ns per hash, best of %d\n", ROUNDS);
+  if (argc == 1) {
+    static const int lengths[] = {
+      1, 3, 4, 8, 16, 32, 64, 128, 256, 1024, 4096,
+    };
+    for (int i = 0; i < (int)(sizeof(lengths) / sizeof(lengths[0])); i++) {
+      run(lengths[i]);
+    }
+  }
+  for (int i = 1; i < argc; i++) run(atoi(argv[i]));
+  return 0;
+}
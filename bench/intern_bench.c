@@ -0,0 +1,99 @@
+// Times every call that interns a new string, to show how long the worst
+// ones take while the string set grows (see intern.c).
+//
+//   bench/intern_bench [names]
+//
+// Each of `names` distinct names, four million by default, goes through
+// intern_find() and intern_insert(), as copy_string() does it. This is done
+// twice: growing the set a little at a time, as it does, and then moving
+// every string over as soon as the set starts to grow, the way it grew
+// before. Each prints a histogram of the call times, then the mean and the
+// worst call.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "intern.h"
+#include "object.h"
+
+// Call times are bucketed by powers of two, from under 64 ns up.
+#define BUCKETS 24
+#define FIRST_BUCKET 64
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static Object_String* make_name(int i) {
+  char chars[32];
+  int length = snprintf(chars, sizeof(chars), "name%d", i);
+  Object_String* string = malloc(offsetof(Object_String, chars) + length + 1);
+  string->length = length;
+  string->interned = true;
+  memcpy(string->chars, chars, length + 1);
+  string->hash = hash_string(chars, length);
+  return string;
+}
+
+static void run(Object_String** names, int count, bool all_at_once) {
+  long histogram[BUCKETS] = {0};
+  double total = 0;
+  double worst = 0;
+
+  InternSet set;
+  init_intern_set(&set);
+  for (int i = 0; i < count; i++) {
+    Object_String* name = names[i];
+    int slot;
+    double start = now();
+    intern_find(&set, name->chars, name->length, name->hash, &slot);
+    intern_insert(&set, slot, name);
+    if (all_at_once) intern_finish_growing(&set);
+    double elapsed = (now() - start) * 1e9;
+
+    total += elapsed;
+    if (elapsed > worst) worst = elapsed;
+    int bucket = 0;
+    for (double limit = FIRST_BUCKET; elapsed >= limit && bucket < BUCKETS - 1;
+         limit *= 2) {
+      bucket++;
+    }
+    histogram[bucket]++;
+  }
+  free_intern_set(&set);
+
+  printf("%s:\n", all_at_once ? "all at once" : "a little at a time");
+  double limit = FIRST_BUCKET;
+  for (int i = 0; i < BUCKETS; i++, limit *= 2) {
+    if (histogram[i] == 0) continue;
+    if (i == BUCKETS - 1) {
+      printf("           >= %9.0f ns  %8ld\n", limit / 2, histogram[i]);
+    } else {
+      printf("  %9.0f - %9.0f ns  %8ld\n", i == 0 ? 0 : limit / 2, limit,
+             histogram[i]);
+    }
+  }
+  printf("  mean %.0f ns, worst %.3f ms\n", total / count, worst / 1e6);
+}
+
+int main(int argc, const char** argv) {
+  int count = argc > 1 ? atoi(argv[1]) : 4000000;
+  set_hash_seed(0);
+
+  Object_String** names = malloc(sizeof(Object_String*) * count);
+  for (int i = 0; i < count; i++) names[i] = make_name(i);
+
+  run(names, count, false);
+  run(names, count, true);
+
+  for (int i = 0; i < count; i++) free(names[i]);
+  free(names);
+  return 0;
+}
@@ -0,0 +1,186 @@
+// Compares the table engines (see table.c) close to their maximum load,
+// where probes get long. bench/build.sh builds it for each engine:
+// probe_bench as a Swiss table, probe_bench_swar as one without SSE2, and
+// probe_bench_linear with plain linear probing.
+//
+//   bench/probe_bench [capacity ...]
+//
+// For each capacity, a table is filled to several fractions of the most
+// keys that fit before it grows. That point differs between the engines,
+// and is found by filling a table until it does. Then it times lookups
+// that hit and that miss, and misses again after every key has been
+// replaced, which leaves deleted entries behind. Keys are bare string
+// objects with random hashes, as in table_bench.c.
+//
+// Probes are the mean number of probe steps per lookup, worked out from
+// the buckets in TableStats (see stats.h), so they are estimates above
+// two. A Swiss table counts a step per group of sixteen entries. They need
+// the stats, so a NO_STATS build leaves them out.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "object.h"
+#include "table.h"
+
+#define ROUNDS 5
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static uint32_t random_state = 12345;
+
+static uint32_t next_random(void) {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state;
+}
+
+static Object_String* make_key(void) {
+  Object_String* key = calloc(1, sizeof(Object_String) + 16 +
+                                 next_random() % 64);
+  key->hash = next_random();
+  return key;
+}
+
+#ifdef STATS
+static TableStats stats;
+
+// The middle of each bucket, and a guess for the open-ended last one.
+static double mean_probes(void) {
+  static const double middles[PROBE_BUCKETS] = {
+    1, 2, 3.5, 6.5, 12.5, 24.5, 48.5, 80,
+  };
+  double sum = 0;
+  for (int i = 0; i < PROBE_BUCKETS; i++) sum += middles[i] * stats.probes[i];
+  return stats.lookups == 0 ? 0 : sum / stats.lookups;
+}
+
+static void watch(Table* table) {
+  table->stats = &stats;
+  stats = (TableStats){0};
+}
+#else
+static double mean_probes(void) { return 0; }
+static void watch(Table* table) { (void)table; }
+#endif
+
+// The most keys a table of `capacity` holds before it grows.
+static int most_keys(int capacity) {
+  Table table;
+  init_table(&table);
+  Object_String** keys = malloc(sizeof(Object_String*) * (capacity + 1));
+  int count = 0;
+  for (;;) {
+    keys[count] = make_key();
+    table_set(&table, keys[count], NIL_VAL);
+    if (table.capacity > capacity) break;
+    count++;
+  }
+
+  free_table(&table);
+  for (int i = 0; i <= count; i++) free(keys[i]);
+  free(keys);
+  return count;
+}
+
+static double time_lookups(Table* table, Object_String** keys, int count,
+                           bool scatter, double* probes) {
+  volatile double sink = 0;
+  double best = 1e9;
+  for (int round = 0; round < ROUNDS; round++) {
+    watch(table);
+    double start = now();
+    uint32_t index = 7;
+    for (int i = 0; i < count; i++) {
+      int key = i;
+      if (scatter) {
+        index = index * 1103515245u + 12345u;
+        key = (int)(index % count);
+      }
+      Value value;
+      if (table_get(table, keys[key], &value)) sink += 1;
+    }
+    double elapsed = now() - start;
+    if (elapsed < best) best = elapsed;
+  }
+  *probes = mean_probes();
+  return best / count * 1e9;
+}
+
+static void run(int capacity, double fill) {
+  int count = (int)(most_keys(capacity) * fill);
+  Object_String** keys = malloc(sizeof(Object_String*) * count);
+  Object_String** misses = malloc(sizeof(Object_String*) * count);
+  for (int i = 0; i < count; i++) {
+    keys[i] = make_key();
+    misses[i] = make_key();
+  }
+
+  Table table;
+  init_table(&table);
+  double start = now();
+  for (int i = 0; i < count; i++) table_set(&table, keys[i], NUMBER_VAL(i));
+  double set_time = (now() - start) / count * 1e9;
+  double load = (double)count / table.capacity;
+
+  double hit_probes, miss_probes, churn_probes;
+  double hit_time = time_lookups(&table, keys, count, true, &hit_probes);
+  double miss_time = time_lookups(&table, misses, count, false, &miss_probes);
+
+  // Replacing the keys one at a time keeps the table just as full.
+  for (int i = 0; i < count; i++) {
+    table_delete(&table, keys[i]);
+    free(keys[i]);
+    keys[i] = make_key();
+    table_set(&table, keys[i], NUMBER_VAL(i));
+  }
+  double churn_time = time_lookups(&table, misses, count, false,
+                                   &churn_probes);
+
+  printf("%-8d %4.2f  set %6.1f  hit %6.1f %5.2f  miss %6.1f %5.2f"
+         "  churned miss %6.1f %5.2f\n",
+         table.capacity, load, set_time, hit_time, hit_probes, miss_time,
+         miss_probes, churn_time, churn_probes);
+
+  free_table(&table);
+  for (int i = 0; i < count; i++) {
+    free(keys[i]);
+    free(misses[i]);
+  }
+  free(keys);
+  free(misses);
+}
+
+static void run_fills(int capacity) {
+  static const double fills[] = {0.6, 0.8, 0.9, 1.0};
+  for (int i = 0; i < (int)(sizeof(fills) / sizeof(fills[0])); i++) {
+    run(capacity, fills[i]);
+  }
+}
+
+int main(int argc, const char** argv) {
+#ifndef SWISS_TABLE
+  const char* engine = "linear probing";
+#elif defined(SWISS_TABLE_SSE2)
+  const char* engine = "Swiss table, SSE2";
+#else
+  const char* engine = "Swiss table, portable";
+#endif
+  printf("%s: ns per operation and mean probes, best of %d\n", engine,
+         ROUNDS);
+  printf("capacity load\n");
+  if (argc == 1) {
+    run_fills(1024);
+    run_fills(131072);
+  }
+  for (int i = 1; i < argc; i++) run_fills(atoi(argv[i]));
+  return 0;
+}
@@ -0,0 +1,126 @@
+// Times the Table operations (see table.h) at a few sizes: inserting keys,
+// looking up keys that are there and keys that aren’t, and deleting half
+// the keys and adding them back, which leaves tombstones behind.
+//
+//   bench/table_bench [keys ...]
+//
+// A table only ever looks at a key’s address and hash, so the keys are bare
+// string objects with random hashes, scattered through memory like the
+// VM’s are. The benchmark only uses the public Table API, so it builds the
+// same against older versions of table.c to compare them.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "object.h"
+#include "table.h"
+
+#define ROUNDS 5
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// xorshift32, so every run uses the same keys.
+static uint32_t random_state = 12345;
+
+static uint32_t next_random(void) {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state;
+}
+
+static Object_String* make_key(void) {
+  // Uneven sizes keep the keys from lining up in memory.
+  Object_String* key = calloc(1, sizeof(Object_String) + 16 +
+                                 next_random() % 64);
+  key->hash = next_random();
+  return key;
+}
+
+static void run(int count) {
+  Object_String** keys = malloc(sizeof(Object_String*) * count);
+  Object_String** misses = malloc(sizeof(Object_String*) * count);
+  for (int i = 0; i < count; i++) {
+    keys[i] = make_key();
+    misses[i] = make_key();
+  }
+
+  double set_time = 1e9;
+  double get_time = 1e9;
+  double miss_time = 1e9;
+  double churn_time = 1e9;
+  volatile double sink = 0;
+  for (int round = 0; round < ROUNDS; round++) {
+    Table table;
+    init_table(&table);
+
+    double start = now();
+    for (int i = 0; i < count; i++) {
+      table_set(&table, keys[i], NUMBER_VAL(i));
+    }
+    double elapsed = now() - start;
+    if (elapsed < set_time) set_time = elapsed;
+
+    // Hits in a scattered order, so each one is a fresh cache miss once
+    // the table is bigger than the cache.
+    start = now();
+    uint32_t index = 7;
+    for (int i = 0; i < count; i++) {
+      index = index * 1103515245u + 12345u;
+      Value value;
+      if (table_get(&table, keys[index % count], &value)) {
+        sink += AS_NUMBER(value);
+      }
+    }
+    elapsed = now() - start;
+    if (elapsed < get_time) get_time = elapsed;
+
+    start = now();
+    for (int i = 0; i < count; i++) {
+      Value value;
+      if (table_get(&table, misses[i], &value)) sink += 1;
+    }
+    elapsed = now() - start;
+    if (elapsed < miss_time) miss_time = elapsed;
+
+    start = now();
+    for (int i = 0; i < count; i += 2) table_delete(&table, keys[i]);
+    for (int i = 0; i < count; i += 2) {
+      table_set(&table, keys[i], NUMBER_VAL(i));
+    }
+    elapsed = now() - start;
+    if (elapsed < churn_time) churn_time = elapsed;
+
+    free_table(&table);
+  }
+
+  int churned = (count + 1) / 2;
+  printf("%-9d  set %6.1f  get %6.1f  miss %6.1f  delete+set %6.1f\n", count,
+         set_time / count * 1e9, get_time / count * 1e9,
+         miss_time / count * 1e9, churn_time / churned * 1e9);
+
+  for (int i = 0; i < count; i++) {
+    free(keys[i]);
+    free(misses[i]);
+  }
+  free(keys);
+  free(misses);
+}
+
+int main(int argc, const char** argv) {
+  printf("keys       ns per operation, best of %d\n", ROUNDS);
+  if (argc == 1) {
+    run(1000);
+    run(100000);
+    run(1000000);
+  }
+  for (int i = 1; i < argc; i++) run(atoi(argv[i]));
+  return 0;
+}
@@ -0,0 +1,87 @@
+// Times a script run over and over on one isolate, to compare the two Value
+// representations (see value.h). bench/build.sh builds it twice, as
+// value_bench with NaN boxing and value_bench_tagged with the tagged union:
+//
+//   bench/value_bench bench/arith.lox
+//   bench/value_bench_tagged bench/arith.lox
+//
+// Lox has no loops, so a script can’t repeat its own work. Instead it is
+// compiled once and run `runs` times a round. The best round of seven is
+// reported, per run of the script.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "object.h"
+#include "program.h"
+#include "vm.h"
+
+#define ROUNDS 7
+
+static double now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static char* read_file(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return NULL;
+
+  fseek(file, 0L, SEEK_END);
+  size_t size = ftell(file);
+  rewind(file);
+
+  char* buffer = malloc(size + 1);
+  size_t bytes_read = fread(buffer, sizeof(char), size, file);
+  buffer[bytes_read] = '\0';
+  fclose(file);
+  return buffer;
+}
+
+int main(int argc, const char** argv) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: value_bench script.lox [runs]\n");
+    return 64;
+  }
+  int runs = argc == 3 ? atoi(argv[2]) : 100000;
+
+  char* source = read_file(argv[1]);
+  if (source == NULL) {
+    fprintf(stderr, "Could not open file <%s>\n", argv[1]);
+    return 74;
+  }
+
+  set_hash_seed(0);
+  Program* program = compile_program(source, false, 0);
+  free(source);
+  if (program == NULL) return 65;
+
+  VM vm;
+  init_vm(&vm);
+
+  double best = 1e9;
+  for (int round = 0; round < ROUNDS; round++) {
+    double start = now();
+    for (int run = 0; run < runs; run++) {
+      if (run_program(&vm, program) != INTERPRET_OK) return 70;
+    }
+    double elapsed = now() - start;
+    if (elapsed < best) best = elapsed;
+  }
+
+#ifdef NAN_BOXING
+  const char* representation = "nan-boxed";
+#else
+  const char* representation = "tagged union";
+#endif
+  printf("%-12s  Value %2zu bytes  %8.0f ns per run  (%d runs)\n",
+         representation, sizeof(Value), best / runs * 1e9, runs);
+
+  free_vm(&vm);
+  free_program(program);
+  return 0;
+}
@@ -11,15 +11,29 @@ CC=clang
 # Compiler flags
 CFLAGS="-std=c99 -Wall -Wextra -O2"
 
+# Libraries. --jobs runs scripts on POSIX threads.
+LIBS="-pthread"
+
 # Source files (order doesn't matter here, but can help readability)
 SOURCES=(
+  aot.c
+  arena.c
+  batch.c
   chunk.c
   compiler.c
   debug.c
+  heap.c
+  intern.c
+  jit.c
   main.c
   memory.c
   object.c
+  optimize.c
+  program.c
   scanner.c
+  snapshot.c
+  ssa.c
+  stats.c
   table.c
   value.c
   vm.c
@@ -27,6 +41,6 @@ SOURCES=(
 
 # Build command
 echo "Compiling..."
-$CC $CFLAGS "${SOURCES[@]}" -o $OUTPUT
+$CC $CFLAGS "${SOURCES[@]}" -o $OUTPUT $LIBS
 
 echo "Build complete: ./$OUTPUT"
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "chunk.h"
 #include "memory.h"
 #include "value.h"
@@ -10,14 +11,26 @@ void init_chunk(Chunk* chunk) {
   chunk->code = NULL;
   chunk->lines = NULL;
   init_value_array(&chunk->constants);
+  chunk->arena = NULL;
 }
 
+// Like GROW_ARRAY(), but takes the memory from the chunk’s arena if it has
+// one.
+#define GROW_CHUNK_ARRAY(chunk, type, pointer, old_count, new_count)           \
+  ((chunk)->arena == NULL                                                      \
+       ? GROW_ARRAY(type, pointer, old_count, new_count)                       \
+       : (type*)arena_grow((chunk)->arena, pointer,                            \
+                           sizeof(type) * (old_count),                         \
+                           sizeof(type) * (new_count)))
+
 void write_chunk(Chunk* chunk, uint8_t byte, int line) {
   if (chunk->capacity < chunk->count + 1) {
     int old_capacity = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(old_capacity);
-    chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, old_capacity, chunk->capacity);
+    chunk->code = GROW_CHUNK_ARRAY(chunk, uint8_t, chunk->code, old_capacity,
+                                   chunk->capacity);
+    chunk->lines = GROW_CHUNK_ARRAY(chunk, int, chunk->lines, old_capacity,
+                                    chunk->capacity);
   }
   chunk->code[chunk->count] = byte;
   chunk->lines[chunk->count] = line;
@@ -27,13 +40,41 @@ void write_chunk(Chunk* chunk, uint8_t byte, int line) {
 // After we add the constant, we return the index where the constant was appended
 // so that we can locate that same constant later.
 int add_constant(Chunk* chunk, Value value) {
-  write_value_array(&chunk->constants, value);
-  return chunk->constants.count - 1;
+  ValueArray* constants = &chunk->constants;
+  if (chunk->arena != NULL && constants->capacity < constants->count + 1) {
+    int old_capacity = constants->capacity;
+    constants->capacity = GROW_CAPACITY(old_capacity);
+    constants->values = GROW_CHUNK_ARRAY(chunk, Value, constants->values,
+                                         old_capacity, constants->capacity);
+  }
+  write_value_array(constants, value);
+  return constants->count - 1;
+}
+
+void copy_chunk(Chunk* from, Chunk* to) {
+  to->count = from->count;
+  to->capacity = from->count;
+  to->code = ALLOCATE(uint8_t, from->count);
+  to->lines = ALLOCATE(int, from->count);
+  memcpy(to->code, from->code, from->count);
+  memcpy(to->lines, from->lines, sizeof(int) * from->count);
+
+  ValueArray* constants = &to->constants;
+  constants->count = from->constants.count;
+  constants->capacity = from->constants.count;
+  constants->values = ALLOCATE(Value, constants->count);
+  if (constants->count > 0) {
+    memcpy(constants->values, from->constants.values,
+           sizeof(Value) * constants->count);
+  }
 }
 
 void free_chunk(Chunk* chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
-  free_value_array(&chunk->constants);
+  // Arena memory goes back all at once, with the arena.
+  if (chunk->arena == NULL) {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    free_value_array(&chunk->constants);
+  }
   init_chunk(chunk);
 }
@@ -1,6 +1,7 @@
 #ifndef clox_chunk_h
 #define clox_chunk_h
 
+#include "arena.h"
 #include "common.h"
 #include "value.h"
 
@@ -29,6 +30,28 @@ typedef enum {
   OP_NEGATE,
   OP_PRINT,
   OP_RETURN,
+
+  // Superinstructions. Each one does the work of a short sequence of the
+  // instructions above in a single dispatch (see the fusions in compiler.c).
+  OP_NOT_EQUAL,        // OP_EQUAL, OP_NOT
+  OP_GREATER_EQUAL,    // OP_LESS, OP_NOT
+  OP_LESS_EQUAL,       // OP_GREATER, OP_NOT
+  OP_GET_LOCAL_ADD_CONST, // OP_GET_LOCAL, OP_CONSTANT, OP_ADD
+  OP_SET_LOCAL_POP,    // OP_SET_LOCAL, OP_POP
+  OP_SET_GLOBAL_POP,   // OP_SET_GLOBAL, OP_POP
+
+  // Quickened instructions. The compiler never emits these. The VM rewrites a
+  // generic arithmetic instruction into one of them in place the first time
+  // it runs, based on the operand types it sees, and rewrites it back if a
+  // later execution sees different types. Builds without QUICKENING (see
+  // common.h) never do.
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
 } OpCode;
 
 // Bytecode is a series of instructions.
@@ -77,13 +100,24 @@ typedef struct {
   uint8_t* code;
 
   ValueArray constants;
+
+  // The arena the arrays above live in, or NULL if they are on the heap.
+  Arena* arena;
 } Chunk;
 
+// The global variable instructions take a two-byte operand, high byte first:
+// the variable’s slot in the isolate’s globals (see compiler.c). One byte
+// would cap a REPL session at 256 names. `bytes` points at the first one.
+#define GLOBAL_SLOT(bytes) ((uint16_t)((bytes)[0] << 8 | (bytes)[1]))
+
 void init_chunk(Chunk* chunk);
 // This function can write opcodes or operands as well.
 // It’s all raw bytes as far as that function is concerned.
 void write_chunk(Chunk* chunk, uint8_t byte, int line);
 void free_chunk(Chunk* chunk);
 int add_constant(Chunk* chunk, Value value);
+// Copies a finished chunk into heap arrays of exactly the right size. `to`
+// must be empty. This is how a chunk built in an arena outlives it.
+void copy_chunk(Chunk* from, Chunk* to);
 
 #endif
@@ -5,8 +5,63 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Disassemble every chunk the compiler finishes, and trace every
+// instruction the VM runs. Define NO_DEBUG to leave both out, as the
+// benchmarks in bench/ do.
+#ifndef NO_DEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#endif
+
+// Define DEBUG_PRINT_QUICKENING to have free_vm() report on stderr how often
+// each instruction was quickened and deoptimized (see vm.c). --stats=json
+// reports the same counts without it.
+
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+
+// One isolated instance of the interpreter (see vm.h). Nearly everything takes
+// the VM it works on as an explicit argument, so the type is declared here,
+// ahead of all the modules that pass it around.
+typedef struct VM VM;
+
+// Pack every Value into a single 64-bit word using quiet NaN bit patterns
+// (see value.h). Define NO_NAN_BOXING to get the tagged-union representation,
+// which is easier to inspect in a debugger.
+#ifndef NO_NAN_BOXING
+#define NAN_BOXING
+#endif
+
+// The VM rewrites arithmetic instructions into forms specialized for the
+// operand types it sees (see vm.c). That only pays with NaN boxing. With
+// the tagged union, GCC merges the tails of the specialized handlers, and
+// arithmetic came out 20-40% slower than without them.
+#ifdef NAN_BOXING
+#define QUICKENING
+#endif
+
+// The interpreter loop in vm.c dispatches through a jump table of label
+// addresses when the compiler supports GCC’s labels-as-values extension.
+// Define NO_THREADED_DISPATCH to force the portable switch instead.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_THREADED_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+// Tables find keys by matching a byte of their hash against sixteen entries
+// at once (see table.c), using SSE2 where the target has it and 64-bit words
+// otherwise. Define NO_SWISS_TABLE to get plain linear probing, or NO_SSE2 to
+// use the portable matching on x86 too.
+#ifndef NO_SWISS_TABLE
+#define SWISS_TABLE
+#if defined(__SSE2__) && !defined(NO_SSE2)
+#define SWISS_TABLE_SSE2
+#endif
+#endif
+
+// Keep the runtime counters behind --stats=json and the stats API (see
+// stats.h). Define NO_STATS to compile every one of them out.
+#ifndef NO_STATS
+#define STATS
+#endif
 
 #endif
@@ -8,18 +8,14 @@
 #include "compiler.h"
 #include "scanner.h"
 #include "object.h"
+#include "optimize.h"
+#include "ssa.h"
 #include "value.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
-typedef struct {
-  Token current;
-  Token previous;
-  bool had_error;
-  bool panic_mode;
-} Parser;
 
 typedef enum {
   // LOWEST PRECENDENCE
@@ -37,7 +33,26 @@ typedef enum {
   // HIGHEST PRECENDENCE
 } Precendence;
 
-typedef void (*ParseFn)(bool can_assign);
+typedef struct Compiler Compiler;
+
+// Everything one compile() call works on. It lives on compile()’s stack and
+// is passed to every function below, so separate threads can compile
+// separate scripts at the same time.
+typedef struct {
+  Scanner scanner;
+  Token current;
+  Token previous;
+  bool had_error;
+  bool panic_mode;
+
+  Compiler* compiler;
+  Chunk* chunk;
+  // The isolate the chunk is compiled for. String constants are interned in
+  // its string table and globals get slots in its global array.
+  VM* vm;
+} Parser;
+
+typedef void (*ParseFn)(Parser* parser, bool can_assign);
 
 typedef struct {
   ParseFn prefix;
@@ -50,41 +65,48 @@ typedef struct {
   int depth;
 } Local;
 
-typedef struct {
+struct Compiler {
   Local locals[UINT8_COUNT];
   int local_count;
   int scope_depth;
-} Compiler;
-
-static void advance();
-static void error_at_current(const char* message);
-static void error_at(Token* token, const char* message);
-static void error(const char* message);
-static void consume(TokenType type, const char* message);
-static void literal(bool can_assign);
-
-static void emit_byte(uint8_t byte);
-static void emit_bytes(uint8_t byte_1, uint8_t byte_2);
-static void end_compiler();
-
-static void define_variable(uint8_t global);
-static uint8_t parse_variable(const char* error_message);
-static uint8_t identifier_constant(Token* name);
-
-static void expression();
-static void statement();
-static void declaration();
-static void grouping(bool can_assign);
-static void unary(bool can_assign);
-static void binary(bool can_assign);
-static void number(bool can_assign);
-static void string(bool can_assign);
-static void variable(bool can_assign);
-static void emit_constant(Value value);
-static uint8_t make_constant(Value value);
-static void parse_precendence(Precendence precendence);
+
+  // Offsets of the last two instructions emitted, or -1. The peephole fusions
+  // below use these to tell opcodes apart from operand bytes that happen to
+  // hold the same value.
+  int last_instruction;
+  int previous_instruction;
+};
+
+static void advance(Parser* parser);
+static void error_at_current(Parser* parser, const char* message);
+static void error_at(Parser* parser, Token* token, const char* message);
+static void error(Parser* parser, const char* message);
+static void consume(Parser* parser, TokenType type, const char* message);
+static void literal(Parser* parser, bool can_assign);
+
+static void emit_byte(Parser* parser, uint8_t byte);
+static void emit_op(Parser* parser, uint8_t op);
+static void emit_bytes(Parser* parser, uint8_t op, uint8_t operand);
+static void end_compiler(Parser* parser);
+
+static void define_variable(Parser* parser, uint16_t global);
+static uint16_t parse_variable(Parser* parser, const char* error_message);
+static uint16_t identifier_global(Parser* parser, Token* name);
+
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
+static void grouping(Parser* parser, bool can_assign);
+static void unary(Parser* parser, bool can_assign);
+static void binary(Parser* parser, bool can_assign);
+static void number(Parser* parser, bool can_assign);
+static void string(Parser* parser, bool can_assign);
+static void variable(Parser* parser, bool can_assign);
+static void emit_constant(Parser* parser, Value value);
+static uint8_t make_constant(Parser* parser, Value value);
+static void parse_precendence(Parser* parser, Precendence precendence);
 static ParseRule* get_rule(TokenType type);
-static Chunk* current_chunk();
+static Chunk* current_chunk(Parser* parser);
 
 ParseRule rules[] = {
   // If you haven’t seen the [TOKEN_DOT] = syntax in a C array literal, that is
@@ -132,16 +154,11 @@ ParseRule rules[] = {
   [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
 };
 
-Parser parser;
-Compiler* current = NULL;
-Chunk* compiling_chunk;
 
-bool compile(const char* source, Chunk* chunk);
-
-static void error_at(Token* token, const char* message) {
-  if (parser.panic_mode)
+static void error_at(Parser* parser, Token* token, const char* message) {
+  if (parser->panic_mode)
     return;
-  parser.panic_mode = true;
+  parser->panic_mode = true;
   fprintf(stderr, "[line %d] Error", token->line);
 
   if (token->type == TOKEN_EOF) {
@@ -153,31 +170,33 @@ static void error_at(Token* token, const char* message) {
   }
 
   fprintf(stderr, ": %s\n", message);
-  parser.had_error = true;
+  parser->had_error = true;
 }
 
-static void error(const char* message) { error_at(&parser.previous, message); }
+static void error(Parser* parser, const char* message) {
+  error_at(parser, &parser->previous, message);
+}
 
-static void error_at_current(const char* message) {
-  error_at(&parser.current, message);
+static void error_at_current(Parser* parser, const char* message) {
+  error_at(parser, &parser->current, message);
 }
 
-static void consume(TokenType type, const char* message) {
-  if (parser.current.type == type) {
-    advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+  if (parser->current.type == type) {
+    advance(parser);
     return;
   }
 
-  error_at_current(message);
+  error_at_current(parser, message);
 }
 
-static bool check(TokenType type) {
-  return parser.current.type == type;
+static bool check(Parser* parser, TokenType type) {
+  return parser->current.type == type;
 }
 
-static bool match(TokenType type) {
-  if (!check(type)) return false;
-  advance();
+static bool match(Parser* parser, TokenType type) {
+  if (!check(parser, type)) return false;
+  advance(parser);
   return true;
 }
 
@@ -185,23 +204,23 @@ static bool match(TokenType type) {
 //  It asks the scanner for the next token and stores it for later use.
 //  Before doing that, it takes the old current token and stashes that
 //  in a previous field.
-static void advance() {
-  parser.previous = parser.current;
+static void advance(Parser* parser) {
+  parser->previous = parser->current;
 
   for (;;) {
-    parser.current = scan_token();
-    if (parser.current.type != TOKEN_ERROR)
+    parser->current = scan_token(&parser->scanner);
+    if (parser->current.type != TOKEN_ERROR)
       break;
 
-    error_at_current(parser.current.start);
+    error_at_current(parser, parser->current.start);
   }
 }
 
-static void literal(bool can_assign) {
-  switch (parser.previous.type) {
-    case TOKEN_FALSE: emit_byte(OP_FALSE); break;
-    case TOKEN_NIL:   emit_byte(OP_NIL); break;
-    case TOKEN_TRUE:  emit_byte(OP_TRUE); break;
+static void literal(Parser* parser, bool can_assign) {
+  switch (parser->previous.type) {
+    case TOKEN_FALSE: emit_op(parser, OP_FALSE); break;
+    case TOKEN_NIL:   emit_op(parser, OP_NIL); break;
+    case TOKEN_TRUE:  emit_op(parser, OP_TRUE); break;
     default: return; // Unreachable
   }
 }
@@ -209,63 +228,153 @@ static void literal(bool can_assign) {
 // It writes the given byte, which may be an opcode or an operand to an
 // instruction. It sends in the previous token’s line information so that
 // runtime errors are associated with that line.
-static void emit_byte(uint8_t byte) {
-  write_chunk(current_chunk(), byte, parser.previous.line);
+static void emit_byte(Parser* parser, uint8_t byte) {
+  write_chunk(current_chunk(parser), byte, parser->previous.line);
+}
+
+// Starts a new instruction. Every opcode goes through here so the compiler
+// knows where instructions begin.
+static void emit_op(Parser* parser, uint8_t op) {
+  Compiler* current = parser->compiler;
+  current->previous_instruction = current->last_instruction;
+  current->last_instruction = current_chunk(parser)->count;
+  emit_byte(parser, op);
+}
+
+// Emits an instruction with a single-byte operand.
+static void emit_bytes(Parser* parser, uint8_t op, uint8_t operand) {
+  emit_op(parser, op);
+  emit_byte(parser, operand);
 }
 
-static void emit_bytes(uint8_t byte_1, uint8_t byte_2) {
-  emit_byte(byte_1);
-  emit_byte(byte_2);
+// Emits a global variable instruction with its two-byte slot.
+static void emit_global(Parser* parser, uint8_t op, uint16_t slot) {
+  emit_op(parser, op);
+  emit_byte(parser, (uint8_t)(slot >> 8));
+  emit_byte(parser, (uint8_t)(slot & 0xff));
 }
 
-static Chunk* current_chunk() { return compiling_chunk; }
+// Returns true if the most recently emitted instruction is `op`.
+static bool last_instruction_is(Parser* parser, uint8_t op) {
+  Compiler* current = parser->compiler;
+  return current->last_instruction != -1 &&
+         current_chunk(parser)->code[current->last_instruction] == op;
+}
+
+// SUPERINSTRUCTIONS
+//
+// Some opcode sequences are so common that we fuse them into a single
+// instruction, so the VM pays for one dispatch instead of two or three. The
+// fusions only ever look at instructions emitted for the expression or
+// statement being compiled right now, so no earlier code can jump into the
+// middle of a fused sequence.
+
+// local + constant is the shape of every counter bump:
+//
+// OP_GET_LOCAL <slot>, OP_CONSTANT <index>, OP_ADD
+//   -> OP_GET_LOCAL_ADD_CONST <slot> <index>
+//
+// Since the right operand of a binary operator is compiled right before the
+// operator, a lone OP_CONSTANT as the last instruction means the right operand
+// was a literal, and the instruction before it is the end of the left operand.
+static bool fuse_local_add_constant(Parser* parser) {
+  Compiler* current = parser->compiler;
+  Chunk* chunk = current_chunk(parser);
+  int local = current->previous_instruction;
+  int constant = current->last_instruction;
+  if (local == -1 || constant == -1) return false;
+  if (chunk->code[local] != OP_GET_LOCAL) return false;
+  if (chunk->code[constant] != OP_CONSTANT) return false;
+
+  // The fused instruction is one byte shorter, so it fits in place. Runtime
+  // errors report the line of the instruction’s last byte, which is the line
+  // of the + we are replacing.
+  chunk->code[local] = OP_GET_LOCAL_ADD_CONST;
+  chunk->code[local + 2] = chunk->code[constant + 1];
+  chunk->lines[local + 2] = parser->previous.line;
+  chunk->count = local + 3;
+
+  current->last_instruction = local;
+  current->previous_instruction = -1;
+  return true;
+}
+
+// An assignment used as a statement leaves the assigned value on the stack
+// only for the statement to pop it right away:
+//
+// OP_SET_LOCAL <slot>, OP_POP   -> OP_SET_LOCAL_POP <slot>
+// OP_SET_GLOBAL <slot>, OP_POP  -> OP_SET_GLOBAL_POP <slot>
+static bool fuse_set_pop(Parser* parser) {
+  Compiler* current = parser->compiler;
+  Chunk* chunk = current_chunk(parser);
+  if (last_instruction_is(parser, OP_SET_LOCAL)) {
+    chunk->code[current->last_instruction] = OP_SET_LOCAL_POP;
+    return true;
+  }
+  if (last_instruction_is(parser, OP_SET_GLOBAL)) {
+    chunk->code[current->last_instruction] = OP_SET_GLOBAL_POP;
+    return true;
+  }
+  return false;
+}
 
-static void end_compiler() {
-  emit_byte(OP_RETURN);
+static Chunk* current_chunk(Parser* parser) { return parser->chunk; }
+
+static void end_compiler(Parser* parser) {
+  emit_op(parser, OP_RETURN);
+  if (!parser->had_error) {
+    if (parser->vm->optimize >= 2) {
+      ssa_optimize_chunk(parser->vm, current_chunk(parser));
+    }
+    if (parser->vm->optimize >= 1) {
+      optimize_chunk(parser->vm, current_chunk(parser));
+    }
+  }
 
 #ifdef DEBUG_PRINT_CODE
-  if (!parser.had_error) {
-    disassemble_chunk(current_chunk(), "code");
+  if (!parser->had_error) {
+    disassemble_chunk(parser->vm, current_chunk(parser),
+                      parser->vm->optimize ? "optimized code" : "code");
   }
 #endif
 }
 
-static void expression() {
-  parse_precendence(PREC_ASSIGNMENT);
+static void expression(Parser* parser) {
+  parse_precendence(parser, PREC_ASSIGNMENT);
 }
 
-static void var_declaration() {
-  uint8_t global = parse_variable("Expect variable name.");
+static void var_declaration(Parser* parser) {
+  uint16_t global = parse_variable(parser, "Expect variable name.");
 
-  if (match(TOKEN_EQUAL)) {
-      expression();
+  if (match(parser, TOKEN_EQUAL)) {
+      expression(parser);
   } else {
-    emit_byte(OP_NIL);
+    emit_op(parser, OP_NIL);
   }
 
-  consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-  define_variable(global);
+  define_variable(parser, global);
 }
 
-static void expression_statement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after expression");
-  emit_byte(OP_POP);
+static void expression_statement(Parser* parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression");
+  if (!fuse_set_pop(parser)) emit_op(parser, OP_POP);
 }
 
-static void print_statement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-  emit_byte(OP_PRINT);
+static void print_statement(Parser* parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+  emit_op(parser, OP_PRINT);
 }
 
-static void synchronize() {
-  parser.panic_mode = false;
+static void synchronize(Parser* parser) {
+  parser->panic_mode = false;
 
-  while (parser.current.type != TOKEN_EOF) {
-    if (parser.previous.type == TOKEN_SEMICOLON) return;
-    switch (parser.current.type) {
+  while (parser->current.type != TOKEN_EOF) {
+    if (parser->previous.type == TOKEN_SEMICOLON) return;
+    switch (parser->current.type) {
       case TOKEN_CLASS:
       case TOKEN_FUN:
       case TOKEN_VAR:
@@ -279,13 +388,13 @@ static void synchronize() {
         ;
     
     }
-    advance();
+    advance(parser);
   }
 }
 
-static void number(bool can_assign) {
-  double value = strtod(parser.previous.start, NULL);
-  emit_constant(NUMBER_VAL(value));
+static void number(Parser* parser, bool can_assign) {
+  double value = strtod(parser->previous.start, NULL);
+  emit_constant(parser, NUMBER_VAL(value));
 }
 
 // This takes the string’s characters directly from the
@@ -296,10 +405,11 @@ static void number(bool can_assign) {
 // NOTE:
 // If Lox supported string escape sequences like \n, we’d translate those here.
 // Since it doesn’t, we can take the characters as they are.
-static void string(bool can_assign) {
-  emit_constant(
+static void string(Parser* parser, bool can_assign) {
+  emit_constant(parser,
       OBJECT_VAL(
-        copy_string(parser.previous.start + 1, parser.previous.length - 2)));
+        copy_string(parser->vm, parser->previous.start + 1,
+                    parser->previous.length - 2)));
 }
 
 static bool identifiers_equal(Token* a, Token* b) {
@@ -310,12 +420,12 @@ static bool identifiers_equal(Token* a, Token* b) {
   return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolve_local(Compiler* compiler, Token* name) {
+static int resolve_local(Parser* parser, Compiler* compiler, Token* name) {
   for (int i = compiler->local_count - 1; i >= 0; i--) {
     Local* local = &compiler->locals[i];
     if (identifiers_equal(name, &local->name)) {
       if (local->depth == -1) {
-        error("Can't read local variable in its own initializer");
+        error(parser, "Can't read local variable in its own initializer");
       }
       return i;
     }
@@ -325,84 +435,97 @@ static int resolve_local(Compiler* compiler, Token* name) {
 
 }
 
-static void named_variable(Token name, bool can_assign) {
+// Locals’ slots are a byte; globals’ take two.
+static void emit_variable(Parser* parser, uint8_t op, int slot) {
+  if (op == OP_GET_LOCAL || op == OP_SET_LOCAL) {
+    emit_bytes(parser, op, (uint8_t)slot);
+  } else {
+    emit_global(parser, op, (uint16_t)slot);
+  }
+}
+
+static void named_variable(Parser* parser, Token name, bool can_assign) {
   uint8_t get_op, set_op;
-  int arg = resolve_local(current, &name);
+  int arg = resolve_local(parser, parser->compiler, &name);
 
   if (arg != -1) {
     get_op = OP_GET_LOCAL;
     set_op = OP_SET_LOCAL;
   } else {
-    arg = identifier_constant(&name);
+    arg = identifier_global(parser, &name);
     get_op = OP_GET_GLOBAL;
     set_op = OP_SET_GLOBAL;
   }
 
-  if (can_assign && match(TOKEN_EQUAL)) {
-    expression();
-    emit_bytes(OP_SET_GLOBAL, (uint8_t) arg);
+  if (can_assign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emit_variable(parser, set_op, arg);
   } else {
-    emit_bytes(OP_GET_GLOBAL, (uint8_t) arg);
+    emit_variable(parser, get_op, arg);
   }
 }
 
-static void variable(bool can_assign) {
-  named_variable(parser.previous, can_assign);
+static void variable(Parser* parser, bool can_assign) {
+  named_variable(parser, parser->previous, can_assign);
 }
 
-static void unary(bool can_assign) {
-  TokenType operator_type = parser.previous.type;
+static void unary(Parser* parser, bool can_assign) {
+  TokenType operator_type = parser->previous.type;
 
   // *Compile the operand*
   // We use the unary operator’s own PREC_UNARY precedence to permit nested
   // unary expressions like !!doubleNegative. Since unary operators have pretty
   // high precedence, that correctly excludes things like binary operators.
-  parse_precendence(PREC_UNARY);
+  parse_precendence(parser, PREC_UNARY);
 
   // Emit the operator instruction
   switch (operator_type) {
-    case TOKEN_MINUS: emit_byte(OP_NEGATE); break;
-    case TOKEN_BANG:  emit_byte(OP_NOT); break;
+    case TOKEN_MINUS: emit_op(parser, OP_NEGATE); break;
+    case TOKEN_BANG:  emit_op(parser, OP_NOT); break;
     default: return;
   }
 }
 
-static void binary(bool can_assign) {
-  TokenType operator_type = parser.previous.type;
+static void binary(Parser* parser, bool can_assign) {
+  TokenType operator_type = parser->previous.type;
   ParseRule* rule = get_rule(operator_type);
   // We use one higher level of precedence for the right operand because the binary
   // operators are left-associative.
-  parse_precendence((Precendence)(rule->precendence + 1));
+  parse_precendence(parser, (Precendence)(rule->precendence + 1));
 
   switch (operator_type) {
-  case TOKEN_PLUS:          emit_byte(OP_ADD); break;
-  case TOKEN_MINUS:         emit_byte(OP_SUBTRACT); break;
-  case TOKEN_STAR:          emit_byte(OP_MULTIPLY); break;
-  case TOKEN_SLASH:         emit_byte(OP_DIVIDE); break;
-  case TOKEN_BANG_EQUAL:    emit_bytes(OP_EQUAL, OP_NOT); break;
-  case TOKEN_EQUAL_EQUAL:   emit_byte(OP_EQUAL); break;
-  case TOKEN_GREATER:       emit_byte(OP_GREATER); break;
-  case TOKEN_GREATER_EQUAL: emit_byte(OP_GREATER); break;
-  case TOKEN_LESS:          emit_byte(OP_LESS); break;
-  case TOKEN_LESS_EQUAL:    emit_bytes(OP_GREATER, OP_NOT); break;
+  case TOKEN_PLUS:
+    if (!fuse_local_add_constant(parser)) emit_op(parser, OP_ADD);
+    break;
+  case TOKEN_MINUS:         emit_op(parser, OP_SUBTRACT); break;
+  case TOKEN_STAR:          emit_op(parser, OP_MULTIPLY); break;
+  case TOKEN_SLASH:         emit_op(parser, OP_DIVIDE); break;
+  case TOKEN_BANG_EQUAL:    emit_op(parser, OP_NOT_EQUAL); break;
+  case TOKEN_EQUAL_EQUAL:   emit_op(parser, OP_EQUAL); break;
+  case TOKEN_GREATER:       emit_op(parser, OP_GREATER); break;
+  case TOKEN_GREATER_EQUAL: emit_op(parser, OP_GREATER_EQUAL); break;
+  case TOKEN_LESS:          emit_op(parser, OP_LESS); break;
+  case TOKEN_LESS_EQUAL:    emit_op(parser, OP_LESS_EQUAL); break;
   default: return; // Unreachable
   }
 }
 
-static void emit_constant(Value value) {
-  emit_bytes(OP_CONSTANT, make_constant(value));
+static void emit_constant(Parser* parser, Value value) {
+  emit_bytes(parser, OP_CONSTANT, make_constant(parser, value));
 }
 
-static void init_compiler(Compiler* compiler) {
+static void init_compiler(Parser* parser, Compiler* compiler) {
   compiler->local_count = 0;
   compiler->scope_depth = 0;
-  current = compiler;
+  compiler->last_instruction = -1;
+  compiler->previous_instruction = -1;
+  parser->compiler = compiler;
 }
 
-static uint8_t make_constant(Value value) {
-  int constant = add_constant(current_chunk(), value);
+static uint8_t make_constant(Parser* parser, Value value) {
+  int constant = add_constant(current_chunk(parser), value);
   if (constant > UINT8_MAX) {
-    error("Too Many constants in one chunk.");
+    error(parser, "Too Many constants in one chunk.");
     return 0;
   }
 
@@ -412,9 +535,9 @@ static uint8_t make_constant(Value value) {
 // we assume the initial ( has already been consumed. We recursively call back
 // into expression() to compile the expression between the parentheses, then
 // parse the closing ) at the end.
-static void grouping(bool can_assign) {
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression");
+static void grouping(Parser* parser, bool can_assign) {
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression");
 }
 
 // Starts at the current token and parses any expression at the given precedence
@@ -440,35 +563,48 @@ static void grouping(bool can_assign) {
 // parsePrecedence(). Then we loop back around and see if the next token is
 // also a valid infix operator that can take the entire preceding expression as its
 // operand.
-static void parse_precendence(Precendence precendence) {
-  advance();
-  ParseFn prefix_rule = get_rule(parser.previous.type)->prefix;
+static void parse_precendence(Parser* parser, Precendence precendence) {
+  advance(parser);
+  ParseFn prefix_rule = get_rule(parser->previous.type)->prefix;
   if (prefix_rule == NULL) {
-    error("Expect expression.");
+    error(parser, "Expect expression.");
     return;
   }
 
   bool can_assign = precendence <= PREC_ASSIGNMENT;
-  prefix_rule(can_assign);
+  prefix_rule(parser, can_assign);
 
-  while (precendence <= get_rule(parser.current.type)->precendence) {
-    advance();
-    ParseFn infix_rule = get_rule(parser.previous.type)->infix;
-    infix_rule(can_assign);
+  while (precendence <= get_rule(parser->current.type)->precendence) {
+    advance(parser);
+    ParseFn infix_rule = get_rule(parser->previous.type)->infix;
+    infix_rule(parser, can_assign);
   }
 
-  if (can_assign && match(TOKEN_EQUAL)) {
-    error("Invalid assignment target.");
+  if (can_assign && match(parser, TOKEN_EQUAL)) {
+    error(parser, "Invalid assignment target.");
   }
 }
 
-static uint8_t identifier_constant(Token* name) {
-  return make_constant(OBJECT_VAL(copy_string(name->start, name->length)));
+// Globals are not looked up by name at runtime. Instead the VM keeps every
+// global in a flat array, and the instruction operand is the variable’s index
+// in that array. The same name always maps to the same slot, even across
+// separate calls to compile(), which is what keeps late binding working in the
+// REPL: using a global before any line has defined it just reserves its slot.
+static uint16_t identifier_global(Parser* parser, Token* name) {
+  int slot = global_slot(parser->vm,
+                         copy_string(parser->vm, name->start, name->length));
+  if (slot > UINT16_MAX) {
+    error(parser, "Too many global variables.");
+    return 0;
+  }
+
+  return (uint16_t)slot;
 }
 
-static void add_local(Token name) {
+static void add_local(Parser* parser, Token name) {
+  Compiler* current = parser->compiler;
   if (current->local_count == UINT8_COUNT) {
-    error("Too manu local variables in function.");
+    error(parser, "Too manu local variables in function.");
     return;
   }
   Local* local = &current->locals[current->local_count++];
@@ -481,12 +617,13 @@ static void add_local(Token name) {
 // only do this for locals, so if we’re in the top-level global scope, we just bail
 // out. Because global variables are late bound, the compiler doesn’t keep track of
 // which declarations for them it has seen.
-static void declare_variable() {
+static void declare_variable(Parser* parser) {
+  Compiler* current = parser->compiler;
   if (current->scope_depth == 0) {
     return;
   }
 
-  Token* name = &parser.previous;
+  Token* name = &parser->previous;
   for (int i = current->local_count - 1; i >= 0; i--) {
     Local* local = &current->locals[i];
     if (local->depth != -1 && local->depth < current->scope_depth) {
@@ -494,47 +631,70 @@ static void declare_variable() {
     }
 
     if (identifiers_equal(name, &local->name)) {
-      error("Already a variable with this name is this scope.");
+      error(parser, "Already a variable with this name is this scope.");
     }
   }
-  add_local(*name);
+  add_local(parser, *name);
 }
 
-static uint8_t parse_variable(const char* error_message) {
-  consume(TOKEN_IDENTIFIER, error_message);
-  declare_variable();
+static uint16_t parse_variable(Parser* parser, const char* error_message) {
+  consume(parser, TOKEN_IDENTIFIER, error_message);
+  declare_variable(parser);
   // At runtime, locals aren’t
-  // looked up by name. There’s no need to stuff the variable’s name into the
-  // constant table, so if the declaration is inside a local scope, we return a dummy
-  // table index instead
-  if (current->scope_depth > 0) {
+  // looked up by name. There’s no need to reserve a global slot for the
+  // variable’s name, so if the declaration is inside a local scope, we return a
+  // dummy slot index instead
+  if (parser->compiler->scope_depth > 0) {
     return 0;
   }
-  return identifier_constant(&parser.previous);
+  return identifier_global(parser, &parser->previous);
 }
 
-static void mark_initialized() {
+static void mark_initialized(Parser* parser) {
+  Compiler* current = parser->compiler;
   current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
-static void define_variable(uint8_t global) {
-  if (current->scope_depth > 0) {
-    mark_initialized();
+static void define_variable(Parser* parser, uint16_t global) {
+  if (parser->compiler->scope_depth > 0) {
+    mark_initialized(parser);
     return;
   }
 
-  emit_bytes(OP_DEFINE_GLOBAL, global);
+  emit_global(parser, OP_DEFINE_GLOBAL, global);
 }
 
 static ParseRule* get_rule(TokenType type) {
   return &rules[type];
 }
 
-bool compile(const char* source, Chunk* chunk) {
-  init_scanner(source);
+bool compile(VM* vm, const char* source, Chunk* chunk) {
+  Parser state;
+  Parser* parser = &state;
+  init_scanner(&parser->scanner, source);
+  parser->vm = vm;
+  // The chunk grows a byte at a time while we compile, so it is built in an
+  // arena and only the finished code, lines and constants are copied out to
+  // the heap, at their exact sizes.
+  Arena arena;
+  init_arena(&arena);
+  Chunk working;
+  init_chunk(&working);
+  working.arena = &arena;
+
+  // Reserving a byte of code per character of source means the code and
+  // lines hardly ever need to grow and be copied. That leaves the constants
+  // as the arena’s last allocation, so they can usually grow in place. Room
+  // that is reserved but never written to costs next to nothing.
+  int reserved = (int)strlen(source) + 1;
+  working.code = (uint8_t*)arena_allocate(&arena, reserved);
+  working.lines = (int*)arena_allocate(&arena, sizeof(int) * reserved);
+  working.capacity = reserved;
+
+  parser->chunk = &working;
+  vm->compiling_chunk = &working;
   Compiler compiler;
-  init_compiler(&compiler);
-  compiling_chunk = chunk;
+  init_compiler(parser, &compiler);
 
   // SYNCHRONIZATION POINT
 
@@ -557,57 +717,62 @@ bool compile(const char* source, Chunk* chunk) {
 
   // Panic mode ends when the parser reaches a synchronization point. (where the
   // flags get reset)
-  parser.had_error = false;
-  parser.panic_mode = false;
+  parser->had_error = false;
+  parser->panic_mode = false;
 
-  advance();
-  while (!match(TOKEN_EOF)) {
-    declaration();
+  advance(parser);
+  while (!match(parser, TOKEN_EOF)) {
+    declaration(parser);
   }
 
-  end_compiler();
-  return !parser.had_error;
+  end_compiler(parser);
+  vm->compiling_chunk = NULL;
+
+  if (!parser->had_error) copy_chunk(&working, chunk);
+  free_arena(&arena);
+  return !parser->had_error;
 }
 
-static void begin_scope() {
-  current->scope_depth++;
+static void begin_scope(Parser* parser) {
+  parser->compiler->scope_depth++;
 }
 
-static void end_scope() {
+static void end_scope(Parser* parser) {
+  Compiler* current = parser->compiler;
   current->scope_depth--;
   while (current->local_count > 0 && 
       current->locals[current->local_count - 1].depth > current->scope_depth) {
-    emit_byte(OP_POP);
+    emit_op(parser, OP_POP);
     current->local_count--;
   }
 }
 
-static void block() {
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    declaration();
+static void block(Parser* parser) {
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    declaration(parser);
   }
 
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void declaration() {
-  if (match(TOKEN_VAR)) {
-    var_declaration();
+static void declaration(Parser* parser) {
+  if (match(parser, TOKEN_VAR)) {
+    var_declaration(parser);
   } else {
-    statement();
+    statement(parser);
   }
-  if (parser.panic_mode) synchronize();
+  if (parser->panic_mode) synchronize(parser);
 }
 
-static void statement() {
-  if (match(TOKEN_PRINT)) {
-    print_statement();
-  } else if (match(TOKEN_LEFT_BRACE)) {
-    begin_scope();
-    block();
-    end_scope();
+static void statement(Parser* parser) {
+  if (match(parser, TOKEN_PRINT)) {
+    print_statement(parser);
+  } else if (match(parser, TOKEN_LEFT_BRACE)) {
+    begin_scope(parser);
+    block(parser);
+    end_scope(parser);
   } else {
-    expression_statement();
+    expression_statement(parser);
   }
 }
 
@@ -4,7 +4,8 @@
 #include "vm.h"
 
 // We pass in the chunk where the compiler will write the code, and then
-// compile() returns whether or not compilation succeeded.
-bool compile(const char* source, Chunk* chunk);
+// compile() returns whether or not compilation succeeded. String constants and
+// global variable slots are created in the given isolate.
+bool compile(VM* vm, const char* source, Chunk* chunk);
 
 #endif
@@ -2,7 +2,9 @@
 #include <stdio.h>
 #include "debug.h"
 #include "chunk.h"
+#include "object.h"
 #include "value.h"
+#include "vm.h"
 
 static int simple_instruction(const char* name, int offset) {
   printf("%s\n", name);
@@ -17,13 +19,32 @@ static int constant_instruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2;
 }
 
+static int global_instruction(VM* vm, const char* name, Chunk* chunk,
+                              int offset) {
+  uint16_t slot = GLOBAL_SLOT(&chunk->code[offset + 1]);
+  printf("%-16s %4d '", name, slot);
+  print_value(vm->global_names.values[slot]);
+  printf("'\n");
+  return offset + 3;
+}
+
+static int local_constant_instruction(const char* name, Chunk* chunk,
+                                      int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  print_value(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
 static int byte_instruction(const char* name, Chunk* chunk, int offset) {
   uint8_t slot = chunk->code[offset + 1];
   printf("%-16s %4d\n", name, slot);
   return offset + 2;
 }
 
-int disassemble_instruction(Chunk* chunk, int offset) {
+int disassemble_instruction(VM* vm, Chunk* chunk, int offset) {
   printf("%04d ", offset);
 
   if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
@@ -36,15 +57,15 @@ int disassemble_instruction(Chunk* chunk, int offset) {
 
   switch (instruction) {
   case OP_GET_LOCAL:
-    return byte_instruction("OP_GET_GLOBAL", chunk, offset);
+    return byte_instruction("OP_GET_LOCAL", chunk, offset);
   case OP_SET_LOCAL:
-    return byte_instruction("OP_SET_GLOBAL", chunk, offset);
+    return byte_instruction("OP_SET_LOCAL", chunk, offset);
   case OP_SET_GLOBAL:
-    return constant_instruction("OP_SET_GLOBAL", chunk,offset);
+    return global_instruction(vm, "OP_SET_GLOBAL", chunk, offset);
   case OP_GET_GLOBAL:
-    return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+    return global_instruction(vm, "OP_GET_GLOBAL", chunk, offset);
   case OP_DEFINE_GLOBAL:
-    return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+    return global_instruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
   case OP_POP:
     return simple_instruction("OP_POP", offset);
   case OP_PRINT:
@@ -77,16 +98,67 @@ int disassemble_instruction(Chunk* chunk, int offset) {
     return simple_instruction("OP_NOT", offset);
   case OP_NEGATE:
     return simple_instruction("OP_NEGATE", offset);
+  case OP_NOT_EQUAL:
+    return simple_instruction("OP_NOT_EQUAL", offset);
+  case OP_GREATER_EQUAL:
+    return simple_instruction("OP_GREATER_EQUAL", offset);
+  case OP_LESS_EQUAL:
+    return simple_instruction("OP_LESS_EQUAL", offset);
+  case OP_GET_LOCAL_ADD_CONST:
+    return local_constant_instruction("OP_GET_LOCAL_ADD_CONST", chunk, offset);
+  case OP_SET_LOCAL_POP:
+    return byte_instruction("OP_SET_LOCAL_POP", chunk, offset);
+  case OP_SET_GLOBAL_POP:
+    return global_instruction(vm, "OP_SET_GLOBAL_POP", chunk, offset);
+  case OP_ADD_NUM:
+    return simple_instruction("OP_ADD_NUM", offset);
+  case OP_ADD_STR:
+    return simple_instruction("OP_ADD_STR", offset);
+  case OP_SUBTRACT_NUM:
+    return simple_instruction("OP_SUBTRACT_NUM", offset);
+  case OP_MULTIPLY_NUM:
+    return simple_instruction("OP_MULTIPLY_NUM", offset);
+  case OP_DIVIDE_NUM:
+    return simple_instruction("OP_DIVIDE_NUM", offset);
+  case OP_GREATER_NUM:
+    return simple_instruction("OP_GREATER_NUM", offset);
+  case OP_LESS_NUM:
+    return simple_instruction("OP_LESS_NUM", offset);
   default:
     printf("Unknown opcode %d\n", instruction);
     return offset + 1;
   }
 }
 
-void disassemble_chunk(Chunk* chunk, const char* name) {
+void disassemble_chunk(VM* vm, Chunk* chunk, const char* name) {
   printf("== %s ==\n", name);
 
   for (int offset = 0; offset < chunk->count;) {
-    offset = disassemble_instruction(chunk, offset);
+    offset = disassemble_instruction(vm, chunk, offset);
+  }
+}
+
+const QuickenedOpcode quickened_opcodes[] = {
+  {OP_ADD_NUM,      "OP_ADD_NUM"},
+  {OP_ADD_STR,      "OP_ADD_STR"},
+  {OP_SUBTRACT_NUM, "OP_SUBTRACT_NUM"},
+  {OP_MULTIPLY_NUM, "OP_MULTIPLY_NUM"},
+  {OP_DIVIDE_NUM,   "OP_DIVIDE_NUM"},
+  {OP_GREATER_NUM,  "OP_GREATER_NUM"},
+  {OP_LESS_NUM,     "OP_LESS_NUM"},
+};
+
+const int quickened_opcode_count =
+    sizeof(quickened_opcodes) / sizeof(quickened_opcodes[0]);
+
+// Reports how often the VM rewrote instructions into each quickened form, and
+// how often those guesses turned out wrong and had to be undone.
+void print_quickening_stats(VM* vm) {
+  fprintf(stderr, "== quickening ==\n");
+  for (int i = 0; i < quickened_opcode_count; i++) {
+    uint8_t opcode = quickened_opcodes[i].opcode;
+    fprintf(stderr, "%-16s %6d quickened %6d deoptimized\n",
+            quickened_opcodes[i].name, vm->quickenings[opcode],
+            vm->deoptimizations[opcode]);
   }
 }
@@ -3,7 +3,19 @@
 
 #include "chunk.h"
 
-void disassemble_chunk(Chunk* chunk, const char* name);
-int disassemble_instruction(Chunk* vhunk, int offset);
+void disassemble_chunk(VM* vm, Chunk* chunk, const char* name);
+int disassemble_instruction(VM* vm, Chunk* vhunk, int offset);
+
+// The opcodes the VM rewrites instructions into (see vm.c), for reporting
+// how often it did.
+typedef struct {
+  uint8_t opcode;
+  const char* name;
+} QuickenedOpcode;
+
+extern const QuickenedOpcode quickened_opcodes[];
+extern const int quickened_opcode_count;
+
+void print_quickening_stats(VM* vm);
 
 #endif
@@ -0,0 +1,167 @@
+// posix_memalign() is POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+
+#include "heap.h"
+
+static const size_t size_classes[SIZE_CLASS_COUNT] = {
+  16, 24, 32, 48, 64, 96, 128, 192, 256, 512, 1024, 2048,
+};
+
+// A free slot keeps the free list’s link right after its header.
+typedef struct {
+  Object object;
+  Object* next;
+} FreeSlot;
+
+static int size_class_for(size_t size) {
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    if (size <= size_classes[i]) return i;
+  }
+  return -1;
+}
+
+void init_heap(Heap* heap) {
+  heap->pages = NULL;
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) heap->available[i] = NULL;
+  heap->young_pages = NULL;
+}
+
+static void make_available(Heap* heap, Page* page) {
+  Page** list = &heap->available[page->size_class];
+  page->previous_available = NULL;
+  page->next_available = *list;
+  if (*list != NULL) (*list)->previous_available = page;
+  *list = page;
+  page->available = true;
+}
+
+static void make_unavailable(Heap* heap, Page* page) {
+  if (page->previous_available != NULL) {
+    page->previous_available->next_available = page->next_available;
+  } else {
+    heap->available[page->size_class] = page->next_available;
+  }
+  if (page->next_available != NULL) {
+    page->next_available->previous_available = page->previous_available;
+  }
+  page->available = false;
+}
+
+static bool is_full(Page* page) {
+  return page->free_slots == NULL && page->bump == page->slot_count;
+}
+
+static Page* new_page(Heap* heap, int size_class, size_t object_size) {
+  size_t size = PAGE_SIZE;
+  size_t slot_size = object_size;
+  if (size_class >= 0) {
+    slot_size = size_classes[size_class];
+  } else {
+    // Round a large object’s page up to a whole number of PAGE_SIZEs.
+    size = (PAGE_HEADER_SIZE + object_size + PAGE_SIZE - 1) /
+           PAGE_SIZE * PAGE_SIZE;
+  }
+
+  void* memory;
+  if (posix_memalign(&memory, PAGE_SIZE, size) != 0) exit(1);
+  Page* page = (Page*)memory;
+  page->size = size;
+  page->size_class = size_class;
+  page->slot_size = slot_size;
+  page->slot_count = (int)((size - PAGE_HEADER_SIZE) / slot_size);
+  page->bump = 0;
+  page->free_slots = NULL;
+  page->live = 0;
+  page->has_young = false;
+  page->next_young = NULL;
+
+  page->previous = NULL;
+  page->next = heap->pages;
+  if (heap->pages != NULL) heap->pages->previous = page;
+  heap->pages = page;
+
+  page->available = false;
+  if (size_class >= 0) make_available(heap, page);
+  return page;
+}
+
+Object* heap_allocate(Heap* heap, size_t size) {
+  int size_class = size_class_for(size);
+  Page* page;
+  if (size_class < 0) {
+    page = new_page(heap, size_class, size);
+  } else {
+    page = heap->available[size_class];
+    if (page == NULL) page = new_page(heap, size_class, size);
+  }
+
+  Object* object;
+  if (page->free_slots != NULL) {
+    object = page->free_slots;
+    page->free_slots = ((FreeSlot*)object)->next;
+  } else {
+    object = (Object*)((uint8_t*)page + PAGE_HEADER_SIZE +
+                       page->slot_size * page->bump++);
+  }
+  page->live++;
+  if (page->available && is_full(page)) make_unavailable(heap, page);
+
+  if (!page->has_young) {
+    page->has_young = true;
+    page->next_young = heap->young_pages;
+    heap->young_pages = page;
+  }
+  return object;
+}
+
+void page_free(Page* page, Object* object) {
+  object->generation = GENERATION_FREE;
+  ((FreeSlot*)object)->next = page->free_slots;
+  page->free_slots = object;
+  page->live--;
+}
+
+void heap_refile_page(Heap* heap, Page* page) {
+  if (!page->available && page->size_class >= 0 && !is_full(page)) {
+    make_available(heap, page);
+  }
+}
+
+void heap_free(Heap* heap, Object* object) {
+  Page* page = page_of(object);
+  page_free(page, object);
+  heap_refile_page(heap, page);
+}
+
+void heap_release_page(Heap* heap, Page* page) {
+  if (page->available) make_unavailable(heap, page);
+
+  if (page->previous != NULL) {
+    page->previous->next = page->next;
+  } else {
+    heap->pages = page->next;
+  }
+  if (page->next != NULL) page->next->previous = page->previous;
+  free(page);
+}
+
+Page* heap_take_young_pages(Heap* heap) {
+  Page* pages = heap->young_pages;
+  for (Page* page = pages; page != NULL; page = page->next_young) {
+    page->has_young = false;
+  }
+  heap->young_pages = NULL;
+  return pages;
+}
+
+void free_heap(Heap* heap) {
+  Page* page = heap->pages;
+  while (page != NULL) {
+    Page* next = page->next;
+    free(page);
+    page = next;
+  }
+  init_heap(heap);
+}
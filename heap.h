@@ -0,0 +1,99 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include "common.h"
+#include "object.h"
+
+// Objects live in pages. Every page is PAGE_SIZE bytes (or a multiple, for a
+// single large object) and starts on a PAGE_SIZE boundary, so the page an
+// object is in can be found by masking its address. A page holds objects of
+// one size class. New objects are bumped off the end of a page’s unused
+// space, or reuse a slot on the page’s free list, so objects allocated
+// around the same time end up next to each other.
+//
+// There is no list threaded through the objects themselves. To visit every
+// object, walk the pages and the slots of each one:
+//
+//   for (Page* page = heap->pages; page != NULL; page = page->next) {
+//     for (int slot = 0; slot < page->bump; slot++) {
+//       Object* object = page_object(page, slot);
+//       if (object == NULL) continue;
+//       ...
+//     }
+//   }
+#define PAGE_SIZE (16 * 1024)
+#define SIZE_CLASS_COUNT 12
+
+typedef struct Page Page;
+
+struct Page {
+  // All of the heap’s pages.
+  Page* previous;
+  Page* next;
+  // The pages of this size class with a free slot, which allocation draws
+  // from. Pages for a single large object are never on it.
+  Page* previous_available;
+  Page* next_available;
+  bool available;
+  // The pages objects have been allocated in since the last time the
+  // collector looked (see heap_take_young_pages()).
+  Page* next_young;
+  bool has_young;
+
+  // -1 for a page that holds a single large object.
+  int size_class;
+  size_t slot_size;
+  int slot_count;
+  // Slots from bump on have never been used. Freed slots below it are on
+  // the free list.
+  int bump;
+  Object* free_slots;
+  // How many slots hold objects.
+  int live;
+  // The size of the whole page, header included.
+  size_t size;
+};
+
+typedef struct {
+  Page* pages;
+  Page* available[SIZE_CLASS_COUNT];
+  Page* young_pages;
+} Heap;
+
+// The header takes up the start of every page. It is padded to keep the
+// slots after it aligned for anything an object can contain.
+#define PAGE_HEADER_SIZE ((sizeof(Page) + 15) & ~(size_t)15)
+
+static inline Page* page_of(Object* object) {
+  return (Page*)((uintptr_t)object & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+// Returns the object in a slot, or NULL if the slot is free.
+static inline Object* page_object(Page* page, int slot) {
+  Object* object =
+      (Object*)((uint8_t*)page + PAGE_HEADER_SIZE + page->slot_size * slot);
+  return object->generation == GENERATION_FREE ? NULL : object;
+}
+
+void init_heap(Heap* heap);
+// Returns an uninitialized slot of at least `size` bytes, and puts its page
+// on the young page list.
+Object* heap_allocate(Heap* heap, size_t size);
+// Gives an object’s slot back to its page. Whatever the object owns outside
+// its slot must already have been freed.
+void heap_free(Heap* heap, Object* object);
+// The half of heap_free() that only touches the object’s own page, so
+// threads can free objects in different pages at the same time. Call
+// heap_refile_page() on the page afterwards.
+void page_free(Page* page, Object* object);
+void heap_refile_page(Heap* heap, Page* page);
+// Frees a page with no objects left in it.
+void heap_release_page(Heap* heap, Page* page);
+// Returns the young page list, linked through next_young, and starts a new
+// one.
+Page* heap_take_young_pages(Heap* heap);
+// Frees every page at once. Whatever the objects own outside their slots
+// must already have been freed.
+void free_heap(Heap* heap);
+
+#endif
@@ -0,0 +1,252 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+#include "memory.h"
+
+#define INTERN_MAX_LOAD 0.75
+
+#define EMPTY 0
+#define TOMBSTONE 1
+
+// The hash as it is kept in the set, moved off the two reserved values.
+static uint32_t stored_hash(uint32_t hash) {
+  return hash <= TOMBSTONE ? hash + 2 : hash;
+}
+
+void init_intern_set(InternSet* set) {
+  set->count = 0;
+  set->capacity = 0;
+  set->hashes = NULL;
+  set->strings = NULL;
+  set->old_capacity = 0;
+  set->moved = 0;
+  set->old_hashes = NULL;
+  set->old_strings = NULL;
+#ifdef STATS
+  set->stats = NULL;
+#endif
+}
+
+static void free_old_arrays(InternSet* set) {
+  FREE_ARRAY(uint32_t, set->old_hashes, set->old_capacity);
+  FREE_ARRAY(Object_String*, set->old_strings, set->old_capacity);
+  set->old_capacity = 0;
+  set->moved = 0;
+  set->old_hashes = NULL;
+  set->old_strings = NULL;
+}
+
+void free_intern_set(InternSet* set) {
+  FREE_ARRAY(uint32_t, set->hashes, set->capacity);
+  FREE_ARRAY(Object_String*, set->strings, set->capacity);
+  free_old_arrays(set);
+  set->count = 0;
+  set->capacity = 0;
+  set->hashes = NULL;
+  set->strings = NULL;
+}
+
+// GROWING
+//
+// Rehashing every string at once when the set fills up would stop whoever
+// is interning a string for as long as it takes to move all of them, which
+// for a big set is milliseconds. Instead, growing only allocates the new,
+// bigger arrays and keeps the old ones around. Each intern_find() then moves
+// the next few of the old slots over before it does its own lookup, until
+// none are left and the old arrays are freed.
+//
+// In between, a string is in one array or the other, so lookups probe both.
+// New strings always go in the new arrays. The old slots are moved in
+// order, and each one moved is left a tombstone, so the probes of the
+// strings still in the old arrays aren’t cut short.
+//
+// At most 3/4 of the old slots hold strings, and the new arrays have twice
+// as many. Moving MOVE_SLOTS per lookup, the old arrays are empty long
+// before enough new strings come in to fill the new arrays up again. If
+// they ever do, the rest are moved all at once before growing again.
+
+#define MOVE_SLOTS 16
+
+// Puts a string in the first free slot on its probe in the new arrays. It
+// goes by the stored hash, so moving a string never has to look at the
+// string itself.
+static void place_string(InternSet* set, uint32_t stored,
+                         Object_String* string) {
+  uint32_t mask = (uint32_t)set->capacity - 1;
+  uint32_t index = stored & mask;
+  while (set->hashes[index] > TOMBSTONE) index = (index + 1) & mask;
+  if (set->hashes[index] == EMPTY) set->count++;
+  set->hashes[index] = stored;
+  set->strings[index] = string;
+}
+
+// Moves the strings in the old slots from `moved` up to `end` to the new
+// arrays, and frees the old arrays once they are all moved.
+static void move_old_slots(InternSet* set, int end) {
+  if (end > set->old_capacity) end = set->old_capacity;
+  for (int i = set->moved; i < end; i++) {
+    if (set->old_strings[i] == NULL) continue;
+    place_string(set, set->old_hashes[i], set->old_strings[i]);
+    set->old_hashes[i] = TOMBSTONE;
+    set->old_strings[i] = NULL;
+  }
+  set->moved = end;
+  if (set->moved == set->old_capacity) free_old_arrays(set);
+}
+
+void intern_finish_growing(InternSet* set) {
+  if (set->old_capacity > 0) move_old_slots(set, set->old_capacity);
+}
+
+// Starts moving the set to arrays of the given capacity. Tombstones are left
+// behind.
+static void grow(InternSet* set, int capacity) {
+  intern_finish_growing(set);
+
+  set->old_capacity = set->capacity;
+  set->moved = 0;
+  set->old_hashes = set->hashes;
+  set->old_strings = set->strings;
+
+  // EMPTY is zero, so there is no need to go over the new arrays up front.
+  // Pages that are zero to begin with don’t cost anything until they are
+  // first written.
+  set->hashes = ALLOCATE_ZEROED(uint32_t, capacity);
+  set->strings = ALLOCATE_ZEROED(Object_String*, capacity);
+  set->capacity = capacity;
+  set->count = 0;
+  if (set->old_capacity == 0) free_old_arrays(set);
+#ifdef STATS
+  if (set->stats != NULL) set->stats->resizes++;
+#endif
+}
+
+// Returns the slot in the old arrays that holds the string, or -1. Only
+// the old slots not moved yet can hold one.
+static int find_old_slot(InternSet* set, const char* chars, int length,
+                         uint32_t stored, int* probes) {
+  uint32_t mask = (uint32_t)set->old_capacity - 1;
+  uint32_t index = stored & mask;
+  for (;;) {
+    uint32_t slot_hash = set->old_hashes[index];
+    if (slot_hash == EMPTY) return -1;
+    if (slot_hash == stored) {
+      Object_String* string = set->old_strings[index];
+      if (string->length == length &&
+          memcmp(string->chars, chars, length) == 0) {
+        return (int)index;
+      }
+    }
+    index = (index + 1) & mask;
+    (*probes)++;
+  }
+}
+
+Object_String* intern_find(InternSet* set, const char* chars, int length,
+                           uint32_t hash, int* slot) {
+  // Grow up front, so the slot handed back is one the string can go in.
+  if (set->count + 1 > set->capacity * INTERN_MAX_LOAD) {
+    grow(set, GROW_CAPACITY(set->capacity));
+  }
+  if (set->old_capacity > 0) move_old_slots(set, set->moved + MOVE_SLOTS);
+
+  uint32_t stored = stored_hash(hash);
+  uint32_t mask = (uint32_t)set->capacity - 1;
+  uint32_t index = stored & mask;
+  int tombstone = -1;
+  int probes = 1;
+  for (;;) {
+    uint32_t slot_hash = set->hashes[index];
+    if (slot_hash == EMPTY) break;
+    if (slot_hash == TOMBSTONE) {
+      if (tombstone == -1) tombstone = (int)index;
+    } else if (slot_hash == stored) {
+      Object_String* string = set->strings[index];
+      if (string->length == length &&
+          memcmp(string->chars, chars, length) == 0) {
+#ifdef STATS
+        if (set->stats != NULL) count_probes(set->stats, probes);
+#endif
+        return string;
+      }
+    }
+
+    index = (index + 1) & mask;
+    probes++;
+  }
+
+  *slot = tombstone != -1 ? tombstone : (int)index;
+  Object_String* string = NULL;
+  if (set->old_capacity > 0) {
+    int old_slot = find_old_slot(set, chars, length, stored, &probes);
+    if (old_slot != -1) string = set->old_strings[old_slot];
+  }
+#ifdef STATS
+  if (set->stats != NULL) count_probes(set->stats, probes);
+#endif
+  return string;
+}
+
+void intern_insert(InternSet* set, int slot, Object_String* string) {
+  if (set->hashes[slot] == EMPTY) set->count++;
+  set->hashes[slot] = stored_hash(string->hash);
+  set->strings[slot] = string;
+}
+
+void intern_delete(InternSet* set, Object_String* string) {
+  uint32_t stored = stored_hash(string->hash);
+  uint32_t mask = (uint32_t)set->capacity - 1;
+  uint32_t index = stored & mask;
+  for (;;) {
+    if (set->strings[index] == string) {
+      intern_delete_slot(set, (int)index);
+      return;
+    }
+    // Not in the new arrays, so it hasn’t been moved yet.
+    if (set->hashes[index] == EMPTY) break;
+    index = (index + 1) & mask;
+  }
+
+  mask = (uint32_t)set->old_capacity - 1;
+  index = stored & mask;
+  while (set->old_strings[index] != string) index = (index + 1) & mask;
+  intern_delete_slot(set, set->capacity + (int)index);
+}
+
+void intern_delete_slot(InternSet* set, int slot) {
+  uint32_t* hashes = set->hashes;
+  Object_String** strings = set->strings;
+  if (slot >= set->capacity) {
+    hashes = set->old_hashes;
+    strings = set->old_strings;
+    slot -= set->capacity;
+  }
+  if (strings[slot] == NULL) return;
+  hashes[slot] = TOMBSTONE;
+  strings[slot] = NULL;
+}
+
+static void copy_arrays(uint32_t* from_hashes, Object_String** from_strings,
+                        uint32_t** to_hashes, Object_String*** to_strings,
+                        int capacity) {
+  *to_hashes = ALLOCATE(uint32_t, capacity);
+  *to_strings = ALLOCATE(Object_String*, capacity);
+  if (capacity > 0) {
+    memcpy(*to_hashes, from_hashes, sizeof(uint32_t) * capacity);
+    memcpy(*to_strings, from_strings, sizeof(Object_String*) * capacity);
+  }
+}
+
+void copy_intern_set(InternSet* from, InternSet* to) {
+  to->count = from->count;
+  to->capacity = from->capacity;
+  copy_arrays(from->hashes, from->strings, &to->hashes, &to->strings,
+              from->capacity);
+  to->old_capacity = from->old_capacity;
+  to->moved = from->moved;
+  if (from->old_capacity > 0) {
+    copy_arrays(from->old_hashes, from->old_strings, &to->old_hashes,
+                &to->old_strings, from->old_capacity);
+  }
+}
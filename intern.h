@@ -0,0 +1,82 @@
+#ifndef clox_intern_h
+#define clox_intern_h
+
+#include "common.h"
+#include "object.h"
+#include "stats.h"
+
+// The set of interned strings.
+//
+// A general Table would spend a whole Value on every string just to hold
+// nil, and every probe would have to follow the key pointer to check the
+// string’s hash. Here the slots are two parallel arrays: the string
+// pointers, and a copy of each string’s hash. A probe walks the hashes,
+// which are packed four to a pointer’s worth of memory, and only looks at a
+// string when its hash matches.
+//
+// Two hash values are reserved to mark slots that are empty or that held a
+// string that has since been deleted (a tombstone). Real hashes that happen
+// to be one of them are stored as a different value, which only costs a
+// rare extra string comparison.
+//
+// The capacity is always a power of two, so hashes are turned into indexes
+// with a mask.
+//
+// The set grows a little at a time (see intern.c). While it does, the old
+// arrays are kept as well, and the strings from their slot `moved` on
+// haven’t been moved to the new ones yet.
+typedef struct {
+  // Strings plus tombstones in the new arrays, which both count against the
+  // load factor.
+  int count;
+  int capacity;
+  uint32_t* hashes;
+  Object_String** strings;
+
+  // Zero when the set isn’t growing.
+  int old_capacity;
+  int moved;
+  uint32_t* old_hashes;
+  Object_String** old_strings;
+#ifdef STATS
+  // Where to count lookups, or NULL. Freeing or copying into the set keeps
+  // it.
+  TableStats* stats;
+#endif
+} InternSet;
+
+void init_intern_set(InternSet* set);
+void free_intern_set(InternSet* set);
+
+// Looks for the interned string with the given characters and returns it.
+// If there isn’t one, returns NULL and sets `slot` to where the string
+// belongs, so that intern_insert() can add it without probing again. The
+// slot stays good across deletions, but not across another insertion.
+Object_String* intern_find(InternSet* set, const char* chars, int length,
+                           uint32_t hash, int* slot);
+// Adds a string that intern_find() just failed to find, at the slot it
+// returned.
+void intern_insert(InternSet* set, int slot, Object_String* string);
+// Removes an interned string. It must be in the set.
+void intern_delete(InternSet* set, Object_String* string);
+// Deletes the string in a slot, if it holds one. Deleting never moves other
+// strings, so threads can clear disjoint slots at the same time.
+void intern_delete_slot(InternSet* set, int slot);
+// Moves every string left in the old arrays over at once.
+void intern_finish_growing(InternSet* set);
+
+// For going through every string in the set. Slots are numbered through the
+// new arrays and then on through the old ones.
+static inline int intern_slot_count(InternSet* set) {
+  return set->capacity + set->old_capacity;
+}
+
+// The string in a slot, or NULL.
+static inline Object_String* intern_slot(InternSet* set, int slot) {
+  if (slot < set->capacity) return set->strings[slot];
+  return set->old_strings[slot - set->capacity];
+}
+// Makes `to`, which must be empty, a copy of `from`.
+void copy_intern_set(InternSet* from, InternSet* to);
+
+#endif
@@ -0,0 +1,804 @@
+// mmap() and mprotect() are POSIX, not C99.
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+#ifdef JIT_AVAILABLE
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// A baseline "template" JIT. Every bytecode instruction is translated on its
+// own into a fixed snippet of x86-64 machine code, one after the other, so the
+// native code has the same shape as the bytecode and there is no dispatch
+// loop at all.
+//
+// The simple stack shuffling instructions (constants, locals, pop) are written
+// out inline. Anything that needs type checks, allocation or error reporting
+// calls back into a C helper below that does what the matching case in run()
+// does. With NaN boxing, number arithmetic also gets an inline fast path.
+//
+// Register use inside the generated function:
+//
+//   rbx  stack_top, a Value* into vm->stack
+//   r12  &vm->stack[0], the base for local variable slots
+//   r14  vm, the isolate the code runs on
+//
+// All three are callee-saved, so they survive helper calls. rbx is written
+// back to vm->stack_top before every helper call and reloaded afterwards,
+// since the helpers push and pop through the VM.
+
+// ---------------------------------------------------------------------------
+// Helpers
+//
+// Each helper gets a pointer just past the instruction it implements, which is
+// exactly where run() would have left ip. Operands are read back from there,
+// and on error it becomes vm->ip so runtime_error() reports the right line.
+// They return false after reporting a runtime error.
+
+#define OPERAND(ip, n) ((ip)[-(n)])
+#define GLOBAL_OPERAND(ip) GLOBAL_SLOT((ip) - 2)
+
+typedef bool (*JitHelper)(VM* vm, uint8_t* ip);
+
+static bool number_operands(VM* vm, uint8_t* ip) {
+  if (IS_NUMBER(vm->stack_top[-1]) && IS_NUMBER(vm->stack_top[-2])) return true;
+  vm->ip = ip;
+  runtime_error(vm, "Operands must be numbers.");
+  return false;
+}
+
+static bool add_values(VM* vm, uint8_t* ip) {
+  Value b = vm->stack_top[-1];
+  Value a = vm->stack_top[-2];
+  if (IS_ANY_STRING(a) && IS_ANY_STRING(b)) {
+    concatenate(vm);
+  } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    vm->stack_top--;
+    vm->stack_top[-1] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+  } else {
+    vm->ip = ip;
+    runtime_error(vm, "Operands must be two numbers or two strings.");
+    return false;
+  }
+  return true;
+}
+
+static bool jit_add(VM* vm, uint8_t* ip) { return add_values(vm, ip); }
+
+#define NUMBER_HELPER(name, value_type, expression)                            \
+  static bool name(VM* vm, uint8_t* ip) {                                      \
+    if (!number_operands(vm, ip)) return false;                                \
+    double b = AS_NUMBER(vm->stack_top[-1]);                                   \
+    double a = AS_NUMBER(vm->stack_top[-2]);                                   \
+    vm->stack_top--;                                                           \
+    vm->stack_top[-1] = value_type(expression);                                \
+    return true;                                                               \
+  }
+
+NUMBER_HELPER(jit_subtract,      NUMBER_VAL, a - b)
+NUMBER_HELPER(jit_multiply,      NUMBER_VAL, a * b)
+NUMBER_HELPER(jit_divide,        NUMBER_VAL, a / b)
+NUMBER_HELPER(jit_greater,       BOOL_VAL,   a > b)
+NUMBER_HELPER(jit_less,          BOOL_VAL,   a < b)
+NUMBER_HELPER(jit_greater_equal, BOOL_VAL,   !(a < b))
+NUMBER_HELPER(jit_less_equal,    BOOL_VAL,   !(a > b))
+
+#undef NUMBER_HELPER
+
+static bool jit_equal(VM* vm, uint8_t* ip) {
+  (void)ip;
+  vm->stack_top--;
+  vm->stack_top[-1] =
+      BOOL_VAL(values_equal(vm->stack_top[-1], vm->stack_top[0]));
+  return true;
+}
+
+static bool jit_not_equal(VM* vm, uint8_t* ip) {
+  (void)ip;
+  vm->stack_top--;
+  vm->stack_top[-1] =
+      BOOL_VAL(!values_equal(vm->stack_top[-1], vm->stack_top[0]));
+  return true;
+}
+
+static bool jit_not(VM* vm, uint8_t* ip) {
+  (void)ip;
+  vm->stack_top[-1] = BOOL_VAL(is_falsey(vm->stack_top[-1]));
+  return true;
+}
+
+static bool jit_negate(VM* vm, uint8_t* ip) {
+  if (!IS_NUMBER(vm->stack_top[-1])) {
+    vm->ip = ip;
+    runtime_error(vm, "Operand must be a number");
+    return false;
+  }
+  vm->stack_top[-1] = NUMBER_VAL(-AS_NUMBER(vm->stack_top[-1]));
+  return true;
+}
+
+static bool jit_print(VM* vm, uint8_t* ip) {
+  (void)ip;
+  print_line(*--vm->stack_top);
+  return true;
+}
+
+static bool defined_global(VM* vm, uint8_t* ip, uint16_t slot) {
+  if (!IS_UNDEFINED(vm->global_values.values[slot])) return true;
+  vm->ip = ip;
+  runtime_error(vm, "Undefined variable '%s'.",
+                AS_STRING(vm->global_names.values[slot])->chars);
+  return false;
+}
+
+static bool jit_get_global(VM* vm, uint8_t* ip) {
+  uint16_t slot = GLOBAL_OPERAND(ip);
+  if (!defined_global(vm, ip, slot)) return false;
+  *vm->stack_top++ = vm->global_values.values[slot];
+  return true;
+}
+
+static bool jit_set_global(VM* vm, uint8_t* ip) {
+  uint16_t slot = GLOBAL_OPERAND(ip);
+  if (!defined_global(vm, ip, slot)) return false;
+  vm->global_values.values[slot] = vm->stack_top[-1];
+  return true;
+}
+
+static bool jit_set_global_pop(VM* vm, uint8_t* ip) {
+  uint16_t slot = GLOBAL_OPERAND(ip);
+  if (!defined_global(vm, ip, slot)) return false;
+  vm->global_values.values[slot] = *--vm->stack_top;
+  return true;
+}
+
+static bool jit_define_global(VM* vm, uint8_t* ip) {
+  vm->global_values.values[GLOBAL_OPERAND(ip)] = *--vm->stack_top;
+  return true;
+}
+
+static bool jit_get_local_add_const(VM* vm, uint8_t* ip) {
+  *vm->stack_top++ = vm->stack[OPERAND(ip, 2)];
+  *vm->stack_top++ = vm->chunk->constants.values[OPERAND(ip, 1)];
+  return add_values(vm, ip);
+}
+
+#undef OPERAND
+#undef GLOBAL_OPERAND
+
+// ---------------------------------------------------------------------------
+// Assembler
+
+typedef struct {
+  uint8_t* code;
+  int count;
+  int capacity;
+} Assembler;
+
+static void emit(Assembler* as, uint8_t byte) {
+  if (as->capacity < as->count + 1) {
+    int old_capacity = as->capacity;
+    as->capacity = GROW_CAPACITY(old_capacity);
+    as->code = GROW_ARRAY(uint8_t, as->code, old_capacity, as->capacity);
+  }
+  as->code[as->count++] = byte;
+}
+
+static void emit_all(Assembler* as, const uint8_t* bytes, int count) {
+  for (int i = 0; i < count; i++) emit(as, bytes[i]);
+}
+
+#define EMIT(as, ...)                                                          \
+  do {                                                                         \
+    static const uint8_t bytes_[] = {__VA_ARGS__};                             \
+    emit_all(as, bytes_, (int)sizeof(bytes_));                                 \
+  } while (false)
+
+static void emit32(Assembler* as, uint32_t value) {
+  for (int i = 0; i < 4; i++) emit(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+  for (int i = 0; i < 8; i++) emit(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void patch32(Assembler* as, int offset, uint32_t value) {
+  for (int i = 0; i < 4; i++) as->code[offset + i] = (uint8_t)(value >> (8 * i));
+}
+
+// Emits the rel32 operand of a jump (or RIP-relative address) that targets an
+// offset that has already been emitted.
+static void emit_jump_back(Assembler* as, int target) {
+  emit32(as, (uint32_t)(target - (as->count + 4)));
+}
+
+// Emits the rel32 of a forward jump and returns where it lives so it can be
+// patched with patch_jump() once the target is known.
+static int emit_jump_forward(Assembler* as) {
+  int offset = as->count;
+  emit32(as, 0);
+  return offset;
+}
+
+static void patch_jump(Assembler* as, int offset) {
+  patch32(as, offset, (uint32_t)(as->count - (offset + 4)));
+}
+
+// Points rsi at one of the literal Values at the start of the code buffer.
+static void emit_lea_rsi_rip(Assembler* as, int target) {
+  EMIT(as, 0x48, 0x8d, 0x35);                       // lea rsi, [rip + disp32]
+  emit_jump_back(as, target);
+}
+
+// Copies one Value from [rsi] to [rdi]. A Value is either one quadword or
+// two, and an SSE register moves either without caring what is inside.
+static void emit_copy_rsi_to_rdi(Assembler* as) {
+#ifdef NAN_BOXING
+  EMIT(as, 0x48, 0x8b, 0x06);                       // mov rax, [rsi]
+  EMIT(as, 0x48, 0x89, 0x07);                       // mov [rdi], rax
+#else
+  EMIT(as, 0x0f, 0x10, 0x06);                       // movups xmm0, [rsi]
+  EMIT(as, 0x0f, 0x11, 0x07);                       // movups [rdi], xmm0
+#endif
+}
+
+static void emit_push_from_rsi(Assembler* as) {
+  EMIT(as, 0x48, 0x89, 0xdf);                       // mov rdi, rbx
+  emit_copy_rsi_to_rdi(as);
+  EMIT(as, 0x48, 0x83, 0xc3, (uint8_t)sizeof(Value)); // add rbx, sizeof(Value)
+}
+
+static void emit_pop(Assembler* as) {
+  EMIT(as, 0x48, 0x83, 0xeb, (uint8_t)sizeof(Value)); // sub rbx, sizeof(Value)
+}
+
+// lea rsi/rdi, [r12 + slot * sizeof(Value)]
+static void emit_local_address(Assembler* as, uint8_t reg_bits, uint8_t slot) {
+  EMIT(as, 0x49, 0x8d);
+  emit(as, (uint8_t)(0x84 | (reg_bits << 3)));
+  emit(as, 0x24);
+  emit32(as, (uint32_t)(slot * sizeof(Value)));
+}
+
+#define RSI_BITS 6
+#define RDI_BITS 7
+
+static void emit_top_address(Assembler* as, uint8_t reg_bits) {
+  EMIT(as, 0x48, 0x8d);                             // lea reg, [rbx - sizeof]
+  emit(as, (uint8_t)(0x43 | (reg_bits << 3)));
+  emit(as, (uint8_t)(-(int)sizeof(Value)));
+}
+
+// Calls `helper(vm, ip)` with the stack pointer synced through the VM, then
+// bails out to the shared error exit if it returned false.
+static void emit_call(Assembler* as, JitHelper helper, uint8_t* ip,
+                      int error_exit) {
+  EMIT(as, 0x49, 0x89, 0x9e);                       // mov [r14 + disp32], rbx
+  emit32(as, (uint32_t)offsetof(VM, stack_top));
+  EMIT(as, 0x4c, 0x89, 0xf7);                       // mov rdi, r14
+  EMIT(as, 0x48, 0xbe);                             // mov rsi, imm64
+  emit64(as, (uint64_t)(uintptr_t)ip);
+  EMIT(as, 0x48, 0xb8);                             // mov rax, imm64
+  emit64(as, (uint64_t)(uintptr_t)helper);
+  EMIT(as, 0xff, 0xd0);                             // call rax
+  EMIT(as, 0x49, 0x8b, 0x9e);                       // mov rbx, [r14 + disp32]
+  emit32(as, (uint32_t)offsetof(VM, stack_top));
+  EMIT(as, 0x84, 0xc0);                             // test al, al
+  EMIT(as, 0x0f, 0x84);                             // je error_exit
+  emit_jump_back(as, error_exit);
+}
+
+// Where the parts of a Value live, relative to the Value itself. A NaN-boxed
+// Value is its own payload. The tagged union keeps a ValueType in front of
+// the payload.
+#ifdef NAN_BOXING
+#define PAYLOAD 0
+#else
+#define PAYLOAD ((int)offsetof(Value, as))
+#endif
+
+#define VALUE_SIZE ((int)sizeof(Value))
+#define LEFT  (-2 * VALUE_SIZE)
+#define RIGHT (-VALUE_SIZE)
+
+// Emits a conditional jump past the fast path and returns the offset of its
+// rel32 so it can be patched to the slow path.
+static int emit_jump_if_not_number(Assembler* as, int disp) {
+#ifdef NAN_BOXING
+  EMIT(as, 0x48, 0x8b, 0x43);                       // mov rax, [rbx + disp8]
+  emit(as, (uint8_t)disp);
+  EMIT(as, 0x48, 0x21, 0xd0);                       // and rax, rdx
+  EMIT(as, 0x48, 0x39, 0xd0);                       // cmp rax, rdx
+  EMIT(as, 0x0f, 0x84);                             // je slow
+#else
+  EMIT(as, 0x83, 0x7b);                             // cmp dword [rbx + disp8], imm8
+  emit(as, (uint8_t)disp);
+  emit(as, (uint8_t)VAL_NUMBER);
+  EMIT(as, 0x0f, 0x85);                             // jne slow
+#endif
+  return emit_jump_forward(as);
+}
+
+// Checks that both operands are numbers and loads the left one into xmm0 and
+// the right one into xmm1. Fills in the two jumps to take when they aren’t.
+static void emit_number_operands(Assembler* as, int slow[2]) {
+#ifdef NAN_BOXING
+  EMIT(as, 0x48, 0xba);                             // mov rdx, QNAN
+  emit64(as, QNAN);
+#endif
+  slow[0] = emit_jump_if_not_number(as, RIGHT);
+  slow[1] = emit_jump_if_not_number(as, LEFT);
+  EMIT(as, 0xf2, 0x0f, 0x10, 0x43);                 // movsd xmm0, [rbx + disp8]
+  emit(as, (uint8_t)(LEFT + PAYLOAD));
+  EMIT(as, 0xf2, 0x0f, 0x10, 0x4b);                 // movsd xmm1, [rbx + disp8]
+  emit(as, (uint8_t)(RIGHT + PAYLOAD));
+}
+
+// Finishes an inline fast path: pops the right operand, jumps over the slow
+// path, and lays down the slow path as a call to the helper.
+static void emit_slow_path(Assembler* as, int slow[2],
+                           JitHelper helper, uint8_t* ip,
+                           int error_exit) {
+  emit_pop(as);
+  EMIT(as, 0xe9);                                   // jmp done
+  int done = emit_jump_forward(as);
+
+  patch_jump(as, slow[0]);
+  patch_jump(as, slow[1]);
+  emit_call(as, helper, ip, error_exit);
+  patch_jump(as, done);
+}
+
+// Arithmetic on two numbers, done in SSE registers. The result replaces the
+// left operand. Its type tag (if any) already says number.
+static void emit_arithmetic(Assembler* as, uint8_t sse_op,
+                            JitHelper helper, uint8_t* ip,
+                            int error_exit) {
+  int slow[2];
+  emit_number_operands(as, slow);
+  EMIT(as, 0xf2, 0x0f);                             // <op>sd xmm0, xmm1
+  emit(as, sse_op);
+  emit(as, 0xc1);
+  EMIT(as, 0xf2, 0x0f, 0x11, 0x43);                 // movsd [rbx + disp8], xmm0
+  emit(as, (uint8_t)(LEFT + PAYLOAD));
+  emit_slow_path(as, slow, helper, ip, error_exit);
+}
+
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5c
+#define SSE_DIV 0x5e
+
+// Stores the Boolean in al over the left operand.
+static void emit_store_bool(Assembler* as) {
+  EMIT(as, 0x0f, 0xb6, 0xc0);                       // movzx eax, al
+#ifdef NAN_BOXING
+  // TRUE_VAL and FALSE_VAL differ only in the lowest bit.
+  EMIT(as, 0x48, 0xba);                             // mov rdx, FALSE_VAL
+  emit64(as, FALSE_VAL);
+  EMIT(as, 0x48, 0x09, 0xd0);                       // or rax, rdx
+  EMIT(as, 0x48, 0x89, 0x43);                       // mov [rbx + disp8], rax
+  emit(as, (uint8_t)LEFT);
+#else
+  EMIT(as, 0xc7, 0x43);                             // mov dword [rbx + disp8], VAL_BOOL
+  emit(as, (uint8_t)LEFT);
+  emit32(as, (uint32_t)VAL_BOOL);
+  EMIT(as, 0x48, 0x89, 0x43);                       // mov [rbx + disp8], rax
+  emit(as, (uint8_t)(LEFT + PAYLOAD));
+#endif
+}
+
+// A comparison of two numbers. comisd reports "unordered" for NaN by setting
+// CF and ZF, so `seta` is false and `setbe` is true for NaN, which is exactly
+// how a > b and !(a > b) behave in C.
+static void emit_comparison(Assembler* as, bool swap, uint8_t setcc,
+                            JitHelper helper, uint8_t* ip,
+                            int error_exit) {
+  int slow[2];
+  emit_number_operands(as, slow);
+  if (swap) {
+    EMIT(as, 0x66, 0x0f, 0x2f, 0xc8);               // comisd xmm1, xmm0
+  } else {
+    EMIT(as, 0x66, 0x0f, 0x2f, 0xc1);               // comisd xmm0, xmm1
+  }
+  EMIT(as, 0x0f);                                   // set<cc> al
+  emit(as, setcc);
+  emit(as, 0xc0);
+  emit_store_bool(as);
+  emit_slow_path(as, slow, helper, ip, error_exit);
+}
+
+#define SETA  0x97
+#define SETBE 0x96
+
+// == and != on two numbers compare them as doubles, where NaN is unequal to
+// everything (ucomisd flags it with PF). With NaN boxing every other pair of
+// Values with the same bits is equal, so the helper is only needed when the
+// bits differ (two different string objects can still be equal), or always
+// for non-numbers in the tagged union.
+static void emit_equality(Assembler* as, bool negate,
+                          JitHelper helper, uint8_t* ip,
+                          int error_exit) {
+  int slow[2];
+  emit_number_operands(as, slow);
+  EMIT(as, 0x66, 0x0f, 0x2e, 0xc1);                 // ucomisd xmm0, xmm1
+  EMIT(as, 0x0f, 0x94, 0xc0);                       // sete al
+  EMIT(as, 0x0f, 0x9b, 0xc1);                       // setnp cl
+  EMIT(as, 0x20, 0xc8);                             // and al, cl
+
+#ifdef NAN_BOXING
+  EMIT(as, 0xe9);                                   // jmp result
+  int numbers = emit_jump_forward(as);
+  patch_jump(as, slow[0]);
+  patch_jump(as, slow[1]);
+  // Anything else with the same bits is equal. Different bits settle it too,
+  // except for two strings, which only the helper can tell.
+  EMIT(as, 0x48, 0x8b, 0x43);                       // mov rax, [rbx + disp8]
+  emit(as, (uint8_t)RIGHT);
+  EMIT(as, 0x48, 0x39, 0x43);                       // cmp [rbx + disp8], rax
+  emit(as, (uint8_t)LEFT);
+  EMIT(as, 0x0f, 0x94, 0xc0);                       // sete al
+  EMIT(as, 0x0f, 0x85);                             // jne helper
+  int different = emit_jump_forward(as);
+  patch_jump(as, numbers);
+#endif
+
+  if (negate) EMIT(as, 0x34, 0x01);                 // xor al, 1
+  emit_store_bool(as);
+
+#ifdef NAN_BOXING
+  emit_pop(as);
+  EMIT(as, 0xe9);                                   // jmp done
+  int done = emit_jump_forward(as);
+  patch_jump(as, different);
+  emit_call(as, helper, ip, error_exit);
+  patch_jump(as, done);
+#else
+  emit_slow_path(as, slow, helper, ip, error_exit);
+#endif
+}
+
+// Points `reg` (rsi or rdi) at a global variable’s slot. The values array is
+// reloaded every time, since compiling a later chunk may grow it.
+static void emit_global_address(Assembler* as, uint8_t reg_bits,
+                                uint16_t slot) {
+  EMIT(as, 0x49, 0x8b, 0x86);                       // mov rax, [r14 + disp32]
+  emit32(as, (uint32_t)(offsetof(VM, global_values) +
+                        offsetof(ValueArray, values)));
+  EMIT(as, 0x48, 0x8d);                             // lea reg, [rax + disp32]
+  emit(as, (uint8_t)(0x80 | (reg_bits << 3)));
+  emit32(as, (uint32_t)(slot * VALUE_SIZE));
+}
+
+// Jumps to the slow path if the global at [reg] has never been defined.
+static int emit_jump_if_undefined(Assembler* as, uint8_t reg_bits) {
+#ifdef NAN_BOXING
+  EMIT(as, 0x48, 0x8b);                             // mov rcx, [reg]
+  emit(as, (uint8_t)(0x08 | reg_bits));
+  EMIT(as, 0x48, 0xba);                             // mov rdx, UNDEFINED_VAL
+  emit64(as, UNDEFINED_VAL);
+  EMIT(as, 0x48, 0x39, 0xd1);                       // cmp rcx, rdx
+#else
+  EMIT(as, 0x83);                                   // cmp dword [reg], imm8
+  emit(as, (uint8_t)(0x38 | reg_bits));
+  emit(as, (uint8_t)VAL_UNDEFINED);
+#endif
+  EMIT(as, 0x0f, 0x84);                             // je slow
+  return emit_jump_forward(as);
+}
+
+// Reads or writes a global in place, calling the helper only when it is
+// undefined so that it reports the error.
+static void emit_global(Assembler* as, uint8_t instruction, uint16_t slot,
+                        JitHelper helper, uint8_t* ip,
+                        int error_exit) {
+  if (instruction == OP_GET_GLOBAL) {
+    emit_global_address(as, RSI_BITS, slot);
+    int slow = emit_jump_if_undefined(as, RSI_BITS);
+    emit_push_from_rsi(as);
+    EMIT(as, 0xe9);                                 // jmp done
+    int done = emit_jump_forward(as);
+    patch_jump(as, slow);
+    emit_call(as, helper, ip, error_exit);
+    patch_jump(as, done);
+    return;
+  }
+
+  emit_global_address(as, RDI_BITS, slot);
+  int slow = -1;
+  if (instruction != OP_DEFINE_GLOBAL) {
+    slow = emit_jump_if_undefined(as, RDI_BITS);
+  }
+  emit_top_address(as, RSI_BITS);
+  emit_copy_rsi_to_rdi(as);
+  if (instruction != OP_SET_GLOBAL) emit_pop(as);
+  if (slow == -1) return;
+
+  EMIT(as, 0xe9);                                   // jmp done
+  int done = emit_jump_forward(as);
+  patch_jump(as, slow);
+  emit_call(as, helper, ip, error_exit);
+  patch_jump(as, done);
+}
+
+// ---------------------------------------------------------------------------
+// Translation
+
+// The literal Values pushed by OP_NIL, OP_TRUE and OP_FALSE live at the very
+// start of the code buffer, ahead of the entry point, and are addressed
+// RIP-relative.
+#define LITERAL_NIL   0
+#define LITERAL_TRUE  1
+#define LITERAL_FALSE 2
+
+static void emit_literals(Assembler* as) {
+  Value literals[] = {NIL_VAL, BOOL_VAL(true), BOOL_VAL(false)};
+  emit_all(as, (const uint8_t*)literals, (int)sizeof(literals));
+  while (as->count % 16 != 0) emit(as, 0xcc);
+}
+
+static void emit_epilogue(Assembler* as, InterpretResult result) {
+  emit(as, 0xb8);                                   // mov eax, imm32
+  emit32(as, (uint32_t)result);
+  EMIT(as, 0x41, 0x5e);                             // pop r14
+  EMIT(as, 0x41, 0x5c);                             // pop r12
+  EMIT(as, 0x5b);                                   // pop rbx
+  EMIT(as, 0xc3);                                   // ret
+}
+
+// Returns the helper that implements a non-inlined instruction, or NULL.
+// Quickened instructions share the helper of their generic form, since the
+// helpers do the full type dispatch anyway.
+static JitHelper helper_for(uint8_t instruction) {
+  switch (instruction) {
+    case OP_GET_GLOBAL:       return jit_get_global;
+    case OP_SET_GLOBAL:       return jit_set_global;
+    case OP_SET_GLOBAL_POP:   return jit_set_global_pop;
+    case OP_DEFINE_GLOBAL:    return jit_define_global;
+    case OP_EQUAL:            return jit_equal;
+    case OP_NOT_EQUAL:        return jit_not_equal;
+    case OP_GREATER:
+    case OP_GREATER_NUM:      return jit_greater;
+    case OP_LESS:
+    case OP_LESS_NUM:         return jit_less;
+    case OP_GREATER_EQUAL:    return jit_greater_equal;
+    case OP_LESS_EQUAL:       return jit_less_equal;
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:          return jit_add;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:     return jit_subtract;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:     return jit_multiply;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:       return jit_divide;
+    case OP_NOT:              return jit_not;
+    case OP_NEGATE:           return jit_negate;
+    case OP_PRINT:            return jit_print;
+    case OP_GET_LOCAL_ADD_CONST: return jit_get_local_add_const;
+    default:                  return NULL;
+  }
+}
+
+// How many operand bytes follow each opcode.
+static int operand_count(uint8_t instruction) {
+  switch (instruction) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+      return 1;
+    case OP_GET_LOCAL_ADD_CONST:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+    case OP_DEFINE_GLOBAL:
+      return 2;
+    default:
+      return 0;
+  }
+}
+
+// Returns the offset of the entry point in the assembled code.
+static int translate(Assembler* as, Chunk* chunk) {
+  emit_literals(as);
+  int entry = as->count;
+
+  // Prologue. Three pushes on top of the return address leave the stack
+  // 16-byte aligned for the helper calls.
+  EMIT(as, 0x53);                                   // push rbx
+  EMIT(as, 0x41, 0x54);                             // push r12
+  EMIT(as, 0x41, 0x56);                             // push r14
+  EMIT(as, 0x49, 0x89, 0xfe);                       // mov r14, rdi
+  EMIT(as, 0x49, 0x8b, 0x9e);                       // mov rbx, [r14 + disp32]
+  emit32(as, (uint32_t)offsetof(VM, stack_top));
+  EMIT(as, 0x4d, 0x8d, 0xa6);                       // lea r12, [r14 + disp32]
+  emit32(as, (uint32_t)offsetof(VM, stack));
+  EMIT(as, 0xe9);                                   // jmp body
+  int body = emit_jump_forward(as);
+
+  // The shared exit for runtime errors. runtime_error() has already reset
+  // the stack.
+  int error_exit = as->count;
+  emit_epilogue(as, INTERPRET_RUNTIME_ERROR);
+  patch_jump(as, body);
+
+  for (int offset = 0; offset < chunk->count;) {
+    uint8_t instruction = chunk->code[offset];
+    uint8_t* next = &chunk->code[offset + 1 + operand_count(instruction)];
+
+    switch (instruction) {
+      case OP_CONSTANT: {
+        EMIT(as, 0x48, 0xbe);                       // mov rsi, imm64
+        emit64(as, (uint64_t)(uintptr_t)
+                   &chunk->constants.values[chunk->code[offset + 1]]);
+        emit_push_from_rsi(as);
+        break;
+      }
+      case OP_NIL:
+        emit_lea_rsi_rip(as, LITERAL_NIL * (int)sizeof(Value));
+        emit_push_from_rsi(as);
+        break;
+      case OP_TRUE:
+        emit_lea_rsi_rip(as, LITERAL_TRUE * (int)sizeof(Value));
+        emit_push_from_rsi(as);
+        break;
+      case OP_FALSE:
+        emit_lea_rsi_rip(as, LITERAL_FALSE * (int)sizeof(Value));
+        emit_push_from_rsi(as);
+        break;
+      case OP_POP:
+        emit_pop(as);
+        break;
+      case OP_GET_LOCAL:
+        emit_local_address(as, RSI_BITS, chunk->code[offset + 1]);
+        emit_push_from_rsi(as);
+        break;
+      case OP_SET_LOCAL:
+        emit_top_address(as, RSI_BITS);
+        emit_local_address(as, RDI_BITS, chunk->code[offset + 1]);
+        emit_copy_rsi_to_rdi(as);
+        break;
+      case OP_SET_LOCAL_POP:
+        emit_top_address(as, RSI_BITS);
+        emit_local_address(as, RDI_BITS, chunk->code[offset + 1]);
+        emit_copy_rsi_to_rdi(as);
+        emit_pop(as);
+        break;
+      case OP_ADD:
+      case OP_ADD_NUM:
+        emit_arithmetic(as, SSE_ADD, jit_add, next, error_exit);
+        break;
+      case OP_SUBTRACT:
+      case OP_SUBTRACT_NUM:
+        emit_arithmetic(as, SSE_SUB, jit_subtract, next, error_exit);
+        break;
+      case OP_MULTIPLY:
+      case OP_MULTIPLY_NUM:
+        emit_arithmetic(as, SSE_MUL, jit_multiply, next, error_exit);
+        break;
+      case OP_DIVIDE:
+      case OP_DIVIDE_NUM:
+        emit_arithmetic(as, SSE_DIV, jit_divide, next, error_exit);
+        break;
+      case OP_GREATER:
+      case OP_GREATER_NUM:
+        emit_comparison(as, false, SETA, jit_greater, next, error_exit);
+        break;
+      case OP_LESS:
+      case OP_LESS_NUM:
+        emit_comparison(as, true, SETA, jit_less, next, error_exit);
+        break;
+      case OP_LESS_EQUAL:
+        emit_comparison(as, false, SETBE, jit_less_equal, next, error_exit);
+        break;
+      case OP_GREATER_EQUAL:
+        emit_comparison(as, true, SETBE, jit_greater_equal, next, error_exit);
+        break;
+      case OP_EQUAL:
+        emit_equality(as, false, jit_equal, next, error_exit);
+        break;
+      case OP_NOT_EQUAL:
+        emit_equality(as, true, jit_not_equal, next, error_exit);
+        break;
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL:
+      case OP_SET_GLOBAL_POP:
+      case OP_DEFINE_GLOBAL:
+        emit_global(as, instruction, GLOBAL_SLOT(&chunk->code[offset + 1]),
+                    helper_for(instruction), next, error_exit);
+        break;
+      case OP_RETURN:
+        EMIT(as, 0x49, 0x89, 0x9e);                 // mov [r14 + disp32], rbx
+        emit32(as, (uint32_t)offsetof(VM, stack_top));
+        emit_epilogue(as, INTERPRET_OK);
+        break;
+      default:
+        emit_call(as, helper_for(instruction), next, error_exit);
+        break;
+    }
+
+    offset += 1 + operand_count(instruction);
+  }
+
+  return entry;
+}
+
+bool jit_compile(Chunk* chunk, JitCode* jit) {
+  Assembler as = {NULL, 0, 0};
+  int entry = translate(&as, chunk);
+  size_t length = (size_t)as.count;
+
+  // Write the code into fresh pages, then flip them from writable to
+  // executable. Never both at once.
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t size = (length + page - 1) / page * page;
+  void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    FREE_ARRAY(uint8_t, as.code, as.capacity);
+    return false;
+  }
+
+  memcpy(memory, as.code, length);
+  FREE_ARRAY(uint8_t, as.code, as.capacity);
+
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size);
+    return false;
+  }
+
+  jit->code = (uint8_t*)memory;
+  jit->size = size;
+  jit->entry = jit->code + entry;
+  return true;
+}
+
+InterpretResult jit_execute(VM* vm, JitCode* jit) {
+  typedef InterpretResult (*NativeChunk)(VM* vm);
+  NativeChunk native = (NativeChunk)(uintptr_t)jit->entry;
+  return native(vm);
+}
+
+void jit_free(JitCode* jit) {
+  if (jit->code != NULL) munmap(jit->code, jit->size);
+  jit->code = NULL;
+  jit->entry = NULL;
+  jit->size = 0;
+}
+
+#else
+
+bool jit_compile(Chunk* chunk, JitCode* jit) {
+  (void)chunk;
+  jit->code = NULL;
+  jit->entry = NULL;
+  jit->size = 0;
+  return false;
+}
+
+InterpretResult jit_execute(VM* vm, JitCode* jit) {
+  (void)vm;
+  (void)jit;
+  return INTERPRET_RUNTIME_ERROR;
+}
+
+void jit_free(JitCode* jit) {
+  (void)jit;
+}
+
+#endif
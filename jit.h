@@ -0,0 +1,30 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "chunk.h"
+#include "vm.h"
+
+// The baseline JIT only knows how to write x86-64 machine code, and needs
+// mmap() to get executable memory.
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define JIT_AVAILABLE
+#endif
+
+// Native code for one chunk. The chunk must outlive it and must not change
+// while it runs: the code has the addresses of the chunk’s bytecode and
+// constants baked in.
+typedef struct {
+  uint8_t* code;
+  uint8_t* entry;
+  size_t size;
+} JitCode;
+
+// Translates a finished chunk into machine code. Returns false if there is no
+// JIT for this platform, in which case the caller should interpret the chunk.
+bool jit_compile(Chunk* chunk, JitCode* jit);
+// Runs the code on the given isolate. The same code can run on any isolate
+// whose globals the chunk was compiled against.
+InterpretResult jit_execute(VM* vm, JitCode* jit);
+void jit_free(JitCode* jit);
+
+#endif
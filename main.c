@@ -1,29 +1,165 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "aot.h"
+#include "batch.h"
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "memory.h"
+#include "program.h"
+#include "snapshot.h"
 #include "vm.h"
 
-static void repl();
-static void run_file(const char* path);
+static void repl(VM* vm);
+static int run_script(VM* vm, const char* path);
+static int run_scripts(const char** paths, int count, int jobs);
+static void emit_c_file(VM* vm, const char* path);
+static void write_snapshot_file(VM* vm, const char* path);
+static int analyze_heap(const char* path);
 static char* read_file(const char* path);
+static void usage();
+
+// Set by the options. Every isolate, including the ones --jobs creates, picks
+// them up through configure().
+static bool jit_enabled = false;
+static int optimize = 0;
+static bool gc_stress = false;
+static size_t gc_nursery_size = GC_NURSERY_SIZE;
+static size_t gc_min_heap_size = GC_MIN_HEAP_SIZE;
+static double gc_heap_growth = GC_HEAP_GROWTH;
+static int gc_threads = 1;
+static const char* heap_snapshot_path = NULL;
+#ifdef STATS
+static bool stats_json = false;
+#endif
+
+static void configure(VM* vm) {
+  vm->jit_enabled = jit_enabled;
+  vm->optimize = optimize;
+  vm->gc_stress = gc_stress;
+  vm->gc_nursery_size = gc_nursery_size;
+  vm->gc_min_heap_size = gc_min_heap_size;
+  vm->next_major_gc = gc_min_heap_size;
+  vm->gc_heap_growth = gc_heap_growth;
+  vm->gc_threads = gc_threads;
+#ifdef STATS
+  if (stats_json) enable_stats(vm);
+#endif
+}
 
 int main(int argc, const char** argv) {
-  init_vm();
+  // Options come first, followed by the script paths, if any.
+  bool emit_c = false;
+  bool analyze = false;
+  bool seeded = false;
+  int jobs = 1;
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    if (strcmp(argv[arg], "-O") == 0) {
+      if (optimize < 1) optimize = 1;
+    } else if (strcmp(argv[arg], "-O2") == 0) {
+      optimize = 2;
+    } else if (strcmp(argv[arg], "--jit") == 0) {
+      jit_enabled = true;
+    } else if (strcmp(argv[arg], "--emit-c") == 0) {
+      emit_c = true;
+    } else if (strcmp(argv[arg], "--heap-snapshot") == 0 && arg + 1 < argc) {
+      heap_snapshot_path = argv[++arg];
+    } else if (strcmp(argv[arg], "--analyze-heap") == 0) {
+      analyze = true;
+    } else if (strcmp(argv[arg], "--jobs") == 0 && arg + 1 < argc) {
+      jobs = atoi(argv[++arg]);
+      if (jobs < 1) usage();
+    } else if (strcmp(argv[arg], "--hash-seed") == 0 && arg + 1 < argc) {
+      set_hash_seed(strtoull(argv[++arg], NULL, 10));
+      seeded = true;
+    } else if (strcmp(argv[arg], "--gc-stress") == 0) {
+      gc_stress = true;
+    } else if (strcmp(argv[arg], "--gc-nursery") == 0 && arg + 1 < argc) {
+      gc_nursery_size = strtoul(argv[++arg], NULL, 10);
+    } else if (strcmp(argv[arg], "--gc-heap") == 0 && arg + 1 < argc) {
+      gc_min_heap_size = strtoul(argv[++arg], NULL, 10);
+    } else if (strcmp(argv[arg], "--gc-growth") == 0 && arg + 1 < argc) {
+      gc_heap_growth = strtod(argv[++arg], NULL);
+      if (gc_heap_growth < 1.0) usage();
+    } else if (strcmp(argv[arg], "--gc-threads") == 0 && arg + 1 < argc) {
+      gc_threads = atoi(argv[++arg]);
+      if (gc_threads < 1) usage();
+#ifdef STATS
+    } else if (strcmp(argv[arg], "--stats=json") == 0) {
+      stats_json = true;
+#endif
+    } else {
+      usage();
+    }
+  }
+  int path_count = argc - arg;
+  if (!seeded) set_hash_seed(random_hash_seed());
+
+  if (analyze) {
+    if (path_count != 1) usage();
+    return analyze_heap(argv[arg]);
+  }
 
-  if (argc == 1) {
-    repl();
-  } else if(argc == 2) {
-    run_file(argv[1]);
+  // Several scripts are a batch, each run in an isolate of its own.
+  if (!emit_c && path_count > 1) {
+    return run_scripts(argv + arg, path_count, jobs);
+  }
+
+  VM vm;
+  init_vm(&vm);
+  configure(&vm);
+
+  int status = 0;
+  if (emit_c) {
+    if (path_count != 1) usage();
+    emit_c_file(&vm, argv[arg]);
+  } else if (path_count == 0) {
+    repl(&vm);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    status = run_script(&vm, argv[arg]);
   }
 
-  free_vm();
-  return 0;
+#ifdef STATS
+  if (stats_json && !emit_c) write_stats_json(&vm, NULL, stderr);
+#endif
+  if (heap_snapshot_path != NULL && !emit_c) {
+    write_snapshot_file(&vm, heap_snapshot_path);
+  }
+  free_vm(&vm);
+  return status;
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: clox [options] [path...]\n"
+                  "       clox --emit-c path\n"
+                  "       clox --analyze-heap snapshot\n"
+                  "\n"
+                  "  -O                  optimize the bytecode\n"
+                  "  -O2                 optimize it through an SSA form too\n"
+                  "  --jit               compile to native code\n"
+                  "  --jobs N            run N scripts at a time\n"
+                  "  --hash-seed N       hash strings with a fixed seed,\n"
+                  "                      to repeat a run exactly\n"
+                  "  --gc-stress         collect on every allocation\n"
+                  "  --gc-nursery BYTES  young generation size\n"
+                  "  --gc-heap BYTES     old generation size that starts\n"
+                  "                      the first major collection\n"
+                  "  --gc-growth FACTOR  old generation growth between\n"
+                  "                      major collections\n"
+                  "  --gc-threads N      run major collections on N\n"
+                  "                      threads\n"
+                  "  --heap-snapshot PATH\n"
+                  "                      write a heap snapshot when\n"
+                  "                      done, to PATH.N for script\n"
+                  "                      N of several\n");
+#ifdef STATS
+  fprintf(stderr, "  --stats=json        report runtime counters on\n"
+                  "                      stderr as JSON when done\n");
+#endif
+  exit(64);
 }
 
 // The difficult part is that we want to allocate a big enough string to read the whole
@@ -34,11 +170,14 @@ int main(int argc, const char** argv) {
 // Since we seeked (sought?) to the end, that’s the size.
 // We rewind back to the beginning, allocate a string of that size,
 // and read the whole file in a single batch.
+//
+// Returns NULL after reporting the problem if the file can’t be read, since in
+// a batch one missing script shouldn’t take the others down with it.
 static char* read_file(const char* path) {
   FILE* file = fopen(path, "rb");
   if (file == NULL) {
     fprintf(stderr, "Could not pen file <%s>\n", path);
-    exit(74);
+    return NULL;
   }
 
   fseek(file, 0L, SEEK_END);
@@ -49,13 +188,16 @@ static char* read_file(const char* path) {
   char* buffer = (char*) malloc(file_size + 1);
   if (buffer == NULL) {
     fprintf(stderr, "Not enough memory to read <%s>\n", path);
-    exit(74);
+    fclose(file);
+    return NULL;
   }
 
   size_t bytes_read = fread(buffer ,sizeof(char), file_size, file);
   if (bytes_read < file_size) {
     fprintf(stderr, "Could not read file <%s> \n", path);
-    exit(74);
+    free(buffer);
+    fclose(file);
+    return NULL;
   }
   buffer[bytes_read] = '\0';
 
@@ -63,16 +205,154 @@ static char* read_file(const char* path) {
   return buffer;
 }
 
-static void run_file(const char* path) {
+static int exit_status(InterpretResult result) {
+  if (result == INTERPRET_COMPILE_ERROR) return 65;
+  if (result == INTERPRET_RUNTIME_ERROR) return 70;
+  return 0;
+}
+
+// Returns the exit status for the script: 65 for a compile error, 70 for a
+// runtime error and 74 if it couldn’t be read.
+static int run_script(VM* vm, const char* path) {
   char* source = read_file(path);
-  InterpretResult result = interpret(source);
+  if (source == NULL) return 74;
+
+  InterpretResult result = interpret(vm, source);
   free(source);
 
-  if (result == INTERPRET_COMPILE_ERROR) exit(65);
-  if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+  return exit_status(result);
+}
+
+// A batch compiles every distinct script once, up front, and the workers
+// share the resulting programs. A script named several times is compiled
+// once and run once for each time it’s named. Scripts that couldn’t be
+// compiled have no program, just the status they failed with.
+static const char** batch_paths;
+static Program** batch_programs;
+static int* batch_statuses;
+
+// With --stats=json every script reports on its own line, tagged with its
+// path. Only the run is counted: the programs were compiled, and their
+// strings interned, in scratch isolates that don’t keep stats.
+static int run_batch_script(VM* vm, int script) {
+  if (batch_programs[script] == NULL) return batch_statuses[script];
+  configure(vm);
+  int status = exit_status(run_program(vm, batch_programs[script]));
+#ifdef STATS
+  if (stats_json) write_stats_json(vm, batch_paths[script], stderr);
+#endif
+  if (heap_snapshot_path != NULL) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s.%d", heap_snapshot_path, script);
+    write_snapshot_file(vm, path);
+  }
+  return status;
+}
+
+static int run_scripts(const char** paths, int count, int jobs) {
+  batch_paths = paths;
+  batch_programs = ALLOCATE(Program*, count);
+  batch_statuses = ALLOCATE(int, count);
+  for (int i = 0; i < count; i++) {
+    batch_programs[i] = NULL;
+    batch_statuses[i] = 0;
+
+    int first = 0;
+    while (strcmp(paths[first], paths[i]) != 0) first++;
+    if (first < i) {
+      batch_programs[i] = batch_programs[first];
+      batch_statuses[i] = batch_statuses[first];
+      continue;
+    }
+
+    char* source = read_file(paths[i]);
+    if (source == NULL) {
+      batch_statuses[i] = 74;
+      continue;
+    }
+    batch_programs[i] = compile_program(source, jit_enabled, optimize);
+    if (batch_programs[i] == NULL) batch_statuses[i] = 65;
+    free(source);
+  }
+
+  int status = run_batch(count, jobs, run_batch_script);
+
+  for (int i = 0; i < count; i++) {
+    // Only the first script with a given path owns its program.
+    int first = 0;
+    while (strcmp(paths[first], paths[i]) != 0) first++;
+    if (first == i && batch_programs[i] != NULL) {
+      free_program(batch_programs[i]);
+    }
+  }
+  FREE_ARRAY(Program*, batch_programs, count);
+  FREE_ARRAY(int, batch_statuses, count);
+  return status;
+}
+
+// Compiles the script and writes it out as C next to it, so foo.lox becomes
+// foo.c. Writing to a file rather than stdout keeps the output clean in
+// builds that print disassembly.
+static void emit_c_file(VM* vm, const char* path) {
+  char* source = read_file(path);
+  if (source == NULL) exit(74);
+  Chunk chunk;
+  init_chunk(&chunk);
+  if (!compile(vm, source, &chunk)) exit(65);
+  free(source);
+
+  size_t length = strlen(path);
+  if (length > 4 && strcmp(path + length - 4, ".lox") == 0) length -= 4;
+  char* output_path = (char*) malloc(length + 3);
+  if (output_path == NULL) {
+    fprintf(stderr, "Not enough memory to emit C for <%s>\n", path);
+    exit(74);
+  }
+  memcpy(output_path, path, length);
+  strcpy(output_path + length, ".c");
+
+  FILE* out = fopen(output_path, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Could not open file <%s>\n", output_path);
+    exit(74);
+  }
+  aot_emit(vm, &chunk, out);
+  fclose(out);
+
+  free(output_path);
+  free_chunk(&chunk);
+}
+
+// A snapshot that can’t be written is reported, but doesn’t change the
+// exit status: the script itself ran fine.
+static void write_snapshot_file(VM* vm, const char* path) {
+  FILE* out = fopen(path, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "Could not open file <%s>\n", path);
+    return;
+  }
+  bool written = write_heap_snapshot(vm, out);
+  if (fclose(out) != 0 || !written) {
+    fprintf(stderr, "Could not write heap snapshot <%s>\n", path);
+  }
+}
+
+static int analyze_heap(const char* path) {
+  FILE* in = fopen(path, "rb");
+  if (in == NULL) {
+    fprintf(stderr, "Could not open file <%s>\n", path);
+    return 74;
+  }
+  bool analyzed = analyze_heap_snapshot(in, stdout);
+  fclose(in);
+  if (!analyzed) {
+    fprintf(stderr, "Could not read heap snapshot <%s>\n", path);
+    return 65;
+  }
+  return 0;
 }
 
-static void repl() {
+static void repl(VM* vm) {
   char line[1024];
   for (;;) {
     printf("> ");
@@ -82,6 +362,6 @@ static void repl() {
       break;
     }
 
-    interpret(line);
+    interpret(vm, line);
   }
 }
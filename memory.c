@@ -1,4 +1,7 @@
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
 #include "memory.h"
 #include "vm.h"
 
@@ -17,22 +20,681 @@ void* reallocate(void* pointer, size_t old_size, size_t new_size) {
   return result;
 }
 
-static void free_object(Object* object) {
+void* allocate_zeroed(size_t size) {
+  if (size == 0) return NULL;
+  void* result = calloc(1, size);
+  if (result == NULL) exit(1);
+  return result;
+}
+
+// GARBAGE COLLECTION
+//
+// The heap is split in two generations. Most strings die young (think of the
+// intermediate results of a chain of concatenations), so new objects go into
+// a nursery that is collected on its own, often and cheaply: a minor
+// collection marks what the roots reach in the nursery, frees the rest of it
+// and promotes the survivors to the old generation. Its cost is proportional
+// to the roots and the survivors, not to the whole heap.
+//
+// The old generation is collected by a major collection, which does its work
+// a few objects at a time interleaved with allocation, so no single pause
+// has to mark or sweep the whole heap. It goes through three phases:
+//
+// - GC_MARK: the roots are marked, then the gray stack is traced a step at
+//   a time. Once it is empty, finish_marking() marks the roots once more to
+//   pick up whatever the program stored in them since they were first
+//   scanned, and the objects still white are garbage.
+// - GC_SWEEP: the heap’s pages are swept a step at a time, freeing the
+//   garbage and any page left empty.
+// - GC_IDLE: nothing to do until the old generation grows enough.
+//
+// The only objects that refer to others are ropes, and a rope never changes
+// after it is made, so the roots are the only references the program can
+// change behind the collector’s back, and the final root scan is all
+// incremental marking needs. A rope also only refers to strings older than
+// itself, so an old object never points into the nursery. Young ropes do
+// point at old strings, though, and a major collection doesn’t trace the
+// nursery, so marking finishes by emptying the nursery with a minor
+// collection first: whatever young objects were holding on to is then
+// reached through their promoted selves. (Without that, storing a reference
+// into an existing object would also need a write barrier, both to keep a
+// black object from hiding a white one and to remember old objects that
+// point into the nursery.)
+//
+// Rather than walking the whole old generation to reset marks, the meaning
+// of white flips at the end of every marking phase: objects in the old white
+// are dead, and the sweeper turns the black survivors into the new white.
+// Objects promoted in the middle of a sweep are born in the new white, so the
+// sweeper leaves them alone.
+//
+// The string table is weak: it doesn’t keep strings alive, and the sweepers
+// take dead strings out of it as they free them.
+//
+// With gc_threads set above one, major collections instead stop the program
+// and mark and sweep on that many threads at once (see PARALLEL MAJOR
+// COLLECTION below).
+
+#define BLACK 2
+#define DEAD_WHITE(vm) ((uint8_t)!(vm)->gc_white)
+
+// Objects own nothing outside their slots, so freeing one gives back
+// exactly its slot.
+static size_t object_size(Object* object) {
+  return page_of(object)->slot_size;
+}
+
+// Counts an object that is about to be freed, if the isolate keeps stats.
+static void count_free(VM* vm, Object* object) {
+#ifdef STATS
+  COUNT_STAT(vm, objects_freed[object->type], 1);
+  COUNT_STAT(vm, bytes_freed[object->type], object_size(object));
+#else
+  (void)vm;
+  (void)object;
+#endif
+}
+
+static void free_dead_object(VM* vm, Object* object) {
+  count_free(vm, object);
+  if (object->type == OBJECT_STRING && ((Object_String*) object)->interned) {
+    intern_delete(&vm->strings, (Object_String*) object);
+  }
+  heap_free(&vm->heap, object);
+}
+
+// Frees a page the collector has found empty, unless objects were allocated
+// in it since the last minor collection or the sweeper is in the middle of
+// it.
+static void release_if_empty(VM* vm, Page* page) {
+  if (page->live == 0 && !page->has_young && page != vm->sweep_page) {
+    heap_release_page(&vm->heap, page);
+  }
+}
+
+// Marks an object of the generation being collected and pushes it on the
+// gray stack to have its references traced.
+static void mark_object(VM* vm, Object* object, Generation generation) {
+  if (object->generation != generation || object->color == BLACK) return;
+  object->color = BLACK;
+
+  if (vm->gray_capacity < vm->gray_count + 1) {
+    int old_capacity = vm->gray_capacity;
+    vm->gray_capacity = GROW_CAPACITY(old_capacity);
+    vm->gray_stack = GROW_ARRAY(Object*, vm->gray_stack, old_capacity,
+                                vm->gray_capacity);
+  }
+  vm->gray_stack[vm->gray_count++] = object;
+}
+
+static void mark_value(VM* vm, Value value, Generation generation) {
+  if (IS_OBJECT(value)) mark_object(vm, AS_OBJECT(value), generation);
+}
+
+static void mark_array(VM* vm, ValueArray* array, Generation generation) {
+  for (int i = 0; i < array->count; i++) {
+    mark_value(vm, array->values[i], generation);
+  }
+}
+
+static void mark_roots(VM* vm, Generation generation) {
+  for (Value* slot = vm->stack; slot < vm->stack_top; slot++) {
+    mark_value(vm, *slot, generation);
+  }
+
+  mark_array(vm, &vm->global_values, generation);
+  // The keys of global_slots are these same strings.
+  mark_array(vm, &vm->global_names, generation);
+
+  if (vm->chunk != NULL) {
+    mark_array(vm, &vm->chunk->constants, generation);
+  }
+  if (vm->compiling_chunk != NULL) {
+    mark_array(vm, &vm->compiling_chunk->constants, generation);
+  }
+}
+
+// Marks everything a gray object refers to.
+static void blacken_object(VM* vm, Object* object, Generation generation) {
+  switch (object->type) {
+    case OBJECT_STRING:
+      // Strings don’t refer to anything.
+      break;
+    case OBJECT_ROPE: {
+      Object_Rope* rope = (Object_Rope*) object;
+      mark_object(vm, rope->left, generation);
+      mark_object(vm, rope->right, generation);
+      break;
+    }
+  }
+}
+
+// A minor collection runs to completion in one go. It may interrupt a major
+// collection’s marking, so it only traces the gray objects it pushed itself.
+static void minor_collection(VM* vm) {
+  int gray_bottom = vm->gray_count;
+  mark_roots(vm, GENERATION_YOUNG);
+  while (vm->gray_count > gray_bottom) {
+    Object* object = vm->gray_stack[--vm->gray_count];
+    blacken_object(vm, object, GENERATION_YOUNG);
+  }
+
+  Page* page = heap_take_young_pages(&vm->heap);
+  while (page != NULL) {
+    Page* next = page->next_young;
+    for (int slot = 0; slot < page->bump; slot++) {
+      Object* object = page_object(page, slot);
+      if (object == NULL || object->generation != GENERATION_YOUNG) continue;
+
+      if (object->color == BLACK) {
+        object->generation = GENERATION_OLD;
+        object->color = vm->gc_white;
+        vm->old_bytes += object_size(object);
+      } else {
+        free_dead_object(vm, object);
+      }
+    }
+    release_if_empty(vm, page);
+    page = next;
+  }
+  vm->young_bytes = 0;
+}
+
+static void finish_marking(VM* vm) {
+  minor_collection(vm);
+  mark_roots(vm, GENERATION_OLD);
+  while (vm->gray_count > 0) {
+    Object* object = vm->gray_stack[--vm->gray_count];
+    blacken_object(vm, object, GENERATION_OLD);
+  }
+
+  vm->gc_white = DEAD_WHITE(vm);
+  vm->gc_phase = GC_SWEEP;
+  vm->sweep_page = vm->heap.pages;
+  vm->sweep_slot = 0;
+}
+
+// Sweeps up to `budget` slots. Returns true once every page has been swept.
+// Pages allocated since the sweep started hold only objects in the new
+// white, so it doesn’t matter that the sweeper never gets to them.
+static bool sweep_old(VM* vm, int budget) {
+  uint8_t dead = DEAD_WHITE(vm);
+  while (budget-- > 0) {
+    Page* page = vm->sweep_page;
+    if (page == NULL) return true;
+
+    if (vm->sweep_slot == page->bump) {
+      vm->sweep_page = page->next;
+      vm->sweep_slot = 0;
+      release_if_empty(vm, page);
+      continue;
+    }
+
+    Object* object = page_object(page, vm->sweep_slot++);
+    if (object == NULL || object->generation != GENERATION_OLD) continue;
+    if (object->color == dead) {
+      vm->old_bytes -= object_size(object);
+      free_dead_object(vm, object);
+    } else {
+      object->color = vm->gc_white;
+    }
+  }
+  return false;
+}
+
+static void set_next_major_gc(VM* vm) {
+  size_t next = (size_t)(vm->old_bytes * vm->gc_heap_growth);
+  vm->next_major_gc = next > vm->gc_min_heap_size ? next : vm->gc_min_heap_size;
+}
+
+static void major_step(VM* vm) {
+  switch (vm->gc_phase) {
+    case GC_IDLE:
+      vm->gc_phase = GC_MARK;
+      mark_roots(vm, GENERATION_OLD);
+      break;
+
+    case GC_MARK: {
+      int budget = GC_STEP_OBJECTS;
+      while (vm->gray_count > 0 && budget-- > 0) {
+        Object* object = vm->gray_stack[--vm->gray_count];
+        blacken_object(vm, object, GENERATION_OLD);
+      }
+      if (vm->gray_count == 0) finish_marking(vm);
+      break;
+    }
+
+    case GC_SWEEP:
+      if (sweep_old(vm, GC_STEP_OBJECTS)) {
+        vm->gc_phase = GC_IDLE;
+        set_next_major_gc(vm);
+      }
+      break;
+  }
+}
+
+// PARALLEL MAJOR COLLECTION
+//
+// The threads first claim slices of the roots and mark what they reach.
+// Marking sets the color with an atomic exchange, so when two threads reach
+// the same object only one of them goes on to trace it. Objects that can
+// refer to others are pushed on the marking thread’s own mark stack, and a
+// thread whose stack runs dry steals from the bottom of the others’, the
+// same way batch.c shares out scripts. (Flat strings refer to nothing, so
+// only ropes ever go on a mark stack.)
+//
+// Once marking is done the threads split the string table between them to
+// drop the dead strings from it, and then claim pages one at a time and
+// sweep them. Each phase has to finish before the next starts, since a
+// sweeper frees objects the table cleaners still look at, so every phase is
+// a separate fork and join.
+
+#define ROOT_SLICE 4096
+#define TABLE_SLICE 4096
+
+typedef struct {
+  Value* values;
+  int count;
+} RootRange;
+
+typedef struct {
+  pthread_mutex_t lock;
+  Object** objects;
+  int count;
+  int capacity;
+  int bottom;
+} MarkStack;
+
+typedef struct {
+  VM* vm;
+  int thread_count;
+
+  RootRange roots[5];
+  int root_count;
+  int next_root_slice;
+
+  MarkStack* stacks;
+  // How many threads may still push onto their mark stacks.
+  int busy;
+
+  int next_table_slice;
+  Page** pages;
+  int page_count;
+  int next_page;
+  size_t freed_bytes;
+} ParallelGc;
+
+typedef struct {
+  ParallelGc* gc;
+  int id;
+  pthread_t thread;
+#ifdef STATS
+  // What this thread swept, added to the isolate’s stats after the join.
+  uint64_t objects_freed[OBJECT_TYPE_COUNT];
+  uint64_t bytes_freed[OBJECT_TYPE_COUNT];
+#endif
+} GcThread;
+
+static bool has_references(Object* object) {
+  switch (object->type) {
+    case OBJECT_STRING: return false;
+    case OBJECT_ROPE:   return true;
+  }
+  return true;
+}
+
+static void push_mark_stack(MarkStack* stack, Object* object) {
+  pthread_mutex_lock(&stack->lock);
+  if (stack->capacity < stack->count + 1) {
+    int old_capacity = stack->capacity;
+    stack->capacity = GROW_CAPACITY(old_capacity);
+    stack->objects = GROW_ARRAY(Object*, stack->objects, old_capacity,
+                                stack->capacity);
+  }
+  stack->objects[stack->count++] = object;
+  pthread_mutex_unlock(&stack->lock);
+}
+
+// Pops from the top of the thread’s own stack, or NULL if it’s empty.
+static Object* pop_mark_stack(MarkStack* stack) {
+  Object* object = NULL;
+  pthread_mutex_lock(&stack->lock);
+  if (stack->count > stack->bottom) object = stack->objects[--stack->count];
+  if (stack->count == stack->bottom) stack->count = stack->bottom = 0;
+  pthread_mutex_unlock(&stack->lock);
+  return object;
+}
+
+// Steals from the bottom of another thread’s stack, or returns NULL.
+static Object* steal_mark_stack(MarkStack* stack) {
+  Object* object = NULL;
+  pthread_mutex_lock(&stack->lock);
+  if (stack->count > stack->bottom) object = stack->objects[stack->bottom++];
+  if (stack->count == stack->bottom) stack->count = stack->bottom = 0;
+  pthread_mutex_unlock(&stack->lock);
+  return object;
+}
+
+static bool mark_stack_is_empty(MarkStack* stack) {
+  pthread_mutex_lock(&stack->lock);
+  bool empty = stack->count == stack->bottom;
+  pthread_mutex_unlock(&stack->lock);
+  return empty;
+}
+
+static void mark_object_parallel(GcThread* thread, Object* object) {
+  if (object->generation != GENERATION_OLD) return;
+  if (__atomic_exchange_n(&object->color, BLACK, __ATOMIC_RELAXED) == BLACK) {
+    return;
+  }
+  if (has_references(object)) {
+    push_mark_stack(&thread->gc->stacks[thread->id], object);
+  }
+}
+
+static void blacken_object_parallel(GcThread* thread, Object* object) {
   switch (object->type) {
-    case OBJECT_STRING: {
-      Object_String* string = (Object_String*) object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(Object_String, object);
+    case OBJECT_STRING:
+      break;
+    case OBJECT_ROPE: {
+      Object_Rope* rope = (Object_Rope*) object;
+      mark_object_parallel(thread, rope->left);
+      mark_object_parallel(thread, rope->right);
+      break;
+    }
+  }
+}
+
+// Claims and marks slices of the roots until there are none left.
+static void mark_root_slices(GcThread* thread) {
+  ParallelGc* gc = thread->gc;
+  for (;;) {
+    int slice = __atomic_fetch_add(&gc->next_root_slice, 1, __ATOMIC_RELAXED);
+
+    // Every range starts on a fresh slice.
+    int range = 0;
+    while (range < gc->root_count) {
+      int slices = (gc->roots[range].count + ROOT_SLICE - 1) / ROOT_SLICE;
+      if (slice < slices) break;
+      slice -= slices;
+      range++;
+    }
+    if (range == gc->root_count) return;
+
+    RootRange* roots = &gc->roots[range];
+    int start = slice * ROOT_SLICE;
+    int end = start + ROOT_SLICE;
+    if (end > roots->count) end = roots->count;
+    for (int i = start; i < end; i++) {
+      if (IS_OBJECT(roots->values[i])) {
+        mark_object_parallel(thread, AS_OBJECT(roots->values[i]));
+      }
+    }
+  }
+}
+
+static Object* find_gray_object(GcThread* thread) {
+  ParallelGc* gc = thread->gc;
+  Object* object = pop_mark_stack(&gc->stacks[thread->id]);
+  for (int i = 1; object == NULL && i < gc->thread_count; i++) {
+    object = steal_mark_stack(&gc->stacks[(thread->id + i) % gc->thread_count]);
+  }
+  return object;
+}
+
+static bool any_gray_objects(ParallelGc* gc) {
+  for (int i = 0; i < gc->thread_count; i++) {
+    if (!mark_stack_is_empty(&gc->stacks[i])) return true;
+  }
+  return false;
+}
+
+static void* mark_in_parallel(void* argument) {
+  GcThread* thread = (GcThread*)argument;
+  ParallelGc* gc = thread->gc;
+  mark_root_slices(thread);
+
+  // Only busy threads push, and a thread only goes idle once its own stack
+  // is empty, so once every thread is idle there is nothing left to trace.
+  for (;;) {
+    Object* object = find_gray_object(thread);
+    if (object != NULL) {
+      blacken_object_parallel(thread, object);
+      continue;
+    }
+
+    __atomic_sub_fetch(&gc->busy, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+      if (__atomic_load_n(&gc->busy, __ATOMIC_SEQ_CST) == 0) return NULL;
+      if (any_gray_objects(gc)) {
+        __atomic_add_fetch(&gc->busy, 1, __ATOMIC_SEQ_CST);
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+static void* clean_table_in_parallel(void* argument) {
+  GcThread* thread = (GcThread*)argument;
+  InternSet* strings = &thread->gc->vm->strings;
+  for (;;) {
+    int slice = __atomic_fetch_add(&thread->gc->next_table_slice, 1,
+                                   __ATOMIC_RELAXED);
+    int slot_count = intern_slot_count(strings);
+    int start = slice * TABLE_SLICE;
+    if (start >= slot_count) return NULL;
+    int end = start + TABLE_SLICE;
+    if (end > slot_count) end = slot_count;
+
+    // Turning a slot into a tombstone leaves every probe sequence intact,
+    // so each thread can clear its own slots without looking at others.
+    for (int i = start; i < end; i++) {
+      Object* string = (Object*)intern_slot(strings, i);
+      if (string == NULL) continue;
+      if (string->generation == GENERATION_OLD && string->color != BLACK) {
+        intern_delete_slot(strings, i);
+      }
+    }
+  }
+}
+
+static void* sweep_in_parallel(void* argument) {
+  GcThread* thread = (GcThread*)argument;
+  ParallelGc* gc = thread->gc;
+  uint8_t white = gc->vm->gc_white;
+  size_t freed = 0;
+  for (;;) {
+    int index = __atomic_fetch_add(&gc->next_page, 1, __ATOMIC_RELAXED);
+    if (index >= gc->page_count) break;
+
+    Page* page = gc->pages[index];
+    for (int slot = 0; slot < page->bump; slot++) {
+      Object* object = page_object(page, slot);
+      if (object == NULL || object->generation != GENERATION_OLD) continue;
+      if (object->color == BLACK) {
+        object->color = white;
+      } else {
+        freed += object_size(object);
+#ifdef STATS
+        thread->objects_freed[object->type]++;
+        thread->bytes_freed[object->type] += object_size(object);
+#endif
+        page_free(page, object);
+      }
+    }
+  }
+  __atomic_add_fetch(&gc->freed_bytes, freed, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+// Runs `work` on every thread, the calling thread included, and waits for
+// all of them to finish. If some threads can’t be started the rest claim
+// their share of the work.
+static void run_on_threads(GcThread* threads, int count,
+                           void* (*work)(void*)) {
+  int started = 1;
+  for (; started < count; started++) {
+    if (pthread_create(&threads[started].thread, NULL, work,
+                       &threads[started]) != 0) {
       break;
     }
   }
+  work(&threads[0]);
+  for (int i = 1; i < started; i++) {
+    pthread_join(threads[i].thread, NULL);
+  }
 }
 
-void free_objects() {
-  Object* object = vm.objects;
-  while (object != NULL) {
-    Object* next = object->next;
-    free_object(object);
-    object = next;
+static void parallel_major_collection(VM* vm) {
+  // The same as finish_marking(): the nursery has to be empty for the
+  // marking threads to reach everything young ropes refer to.
+  minor_collection(vm);
+
+  ParallelGc gc;
+  gc.vm = vm;
+  gc.thread_count = vm->gc_threads;
+
+  gc.root_count = 0;
+  gc.roots[gc.root_count++] =
+      (RootRange){vm->stack, (int)(vm->stack_top - vm->stack)};
+  gc.roots[gc.root_count++] =
+      (RootRange){vm->global_values.values, vm->global_values.count};
+  gc.roots[gc.root_count++] =
+      (RootRange){vm->global_names.values, vm->global_names.count};
+  if (vm->chunk != NULL) {
+    gc.roots[gc.root_count++] = (RootRange){vm->chunk->constants.values,
+                                            vm->chunk->constants.count};
   }
+  if (vm->compiling_chunk != NULL) {
+    gc.roots[gc.root_count++] =
+        (RootRange){vm->compiling_chunk->constants.values,
+                    vm->compiling_chunk->constants.count};
+  }
+  gc.next_root_slice = 0;
+  gc.next_table_slice = 0;
+  gc.next_page = 0;
+  gc.freed_bytes = 0;
+
+  gc.page_count = 0;
+  for (Page* page = vm->heap.pages; page != NULL; page = page->next) {
+    gc.page_count++;
+  }
+  gc.pages = ALLOCATE(Page*, gc.page_count);
+  int index = 0;
+  for (Page* page = vm->heap.pages; page != NULL; page = page->next) {
+    gc.pages[index++] = page;
+  }
+
+  // Until a thread runs out of work it might still push some.
+  gc.busy = gc.thread_count;
+  gc.stacks = ALLOCATE(MarkStack, gc.thread_count);
+  GcThread* threads = ALLOCATE(GcThread, gc.thread_count);
+  for (int i = 0; i < gc.thread_count; i++) {
+    pthread_mutex_init(&gc.stacks[i].lock, NULL);
+    gc.stacks[i].objects = NULL;
+    gc.stacks[i].count = 0;
+    gc.stacks[i].capacity = 0;
+    gc.stacks[i].bottom = 0;
+    threads[i].gc = &gc;
+    threads[i].id = i;
+#ifdef STATS
+    memset(threads[i].objects_freed, 0, sizeof(threads[i].objects_freed));
+    memset(threads[i].bytes_freed, 0, sizeof(threads[i].bytes_freed));
+#endif
+  }
+
+  run_on_threads(threads, gc.thread_count, mark_in_parallel);
+  run_on_threads(threads, gc.thread_count, clean_table_in_parallel);
+  run_on_threads(threads, gc.thread_count, sweep_in_parallel);
+  vm->old_bytes -= gc.freed_bytes;
+#ifdef STATS
+  for (int i = 0; i < gc.thread_count; i++) {
+    for (int type = 0; type < OBJECT_TYPE_COUNT; type++) {
+      COUNT_STAT(vm, objects_freed[type], threads[i].objects_freed[type]);
+      COUNT_STAT(vm, bytes_freed[type], threads[i].bytes_freed[type]);
+    }
+  }
+#endif
+  set_next_major_gc(vm);
+
+  // The page lists are shared, so only now can swept pages be put back on
+  // them or freed.
+  for (int i = 0; i < gc.page_count; i++) {
+    heap_refile_page(&vm->heap, gc.pages[i]);
+    release_if_empty(vm, gc.pages[i]);
+  }
+  FREE_ARRAY(Page*, gc.pages, gc.page_count);
+
+  for (int i = 0; i < gc.thread_count; i++) {
+    pthread_mutex_destroy(&gc.stacks[i].lock);
+    FREE_ARRAY(Object*, gc.stacks[i].objects, gc.stacks[i].capacity);
+  }
+  FREE_ARRAY(GcThread, threads, gc.thread_count);
+  FREE_ARRAY(MarkStack, gc.stacks, gc.thread_count);
+}
+
+void gc_step(VM* vm) {
+  if (!vm->gc_enabled) return;
+
+  // Stress mode collects the nursery and advances the major collection on
+  // every single allocation, to shake out objects the roots don’t cover.
+  if (vm->gc_stress || vm->young_bytes >= vm->gc_nursery_size) {
+    minor_collection(vm);
+  }
+
+  if (vm->gc_threads > 1) {
+    if (vm->gc_stress || vm->old_bytes >= vm->next_major_gc) {
+      parallel_major_collection(vm);
+    }
+  } else if (vm->gc_stress || vm->gc_phase != GC_IDLE ||
+             vm->old_bytes >= vm->next_major_gc) {
+    major_step(vm);
+  }
+}
+
+void collect_garbage(VM* vm) {
+  minor_collection(vm);
+  if (vm->gc_threads > 1) {
+    parallel_major_collection(vm);
+    return;
+  }
+
+  // Finish the collection in progress, if any, then run a whole new one, so
+  // that everything unreachable right now is freed.
+  while (vm->gc_phase != GC_IDLE) major_step(vm);
+  do {
+    major_step(vm);
+  } while (vm->gc_phase != GC_IDLE);
+}
+
+void revive_object(VM* vm, Object* object) {
+  // Only a sweep in progress leaves objects in the dead white.
+  if (object->generation == GENERATION_OLD &&
+      object->color == DEAD_WHITE(vm)) {
+    object->color = vm->gc_white;
+  }
+}
+
+void free_objects(VM* vm) {
+#ifdef STATS
+  // Freeing the pages frees the objects without looking at them, so only
+  // look when there is something to count.
+  if (vm->stats_enabled) {
+    for (Page* page = vm->heap.pages; page != NULL; page = page->next) {
+      for (int slot = 0; slot < page->bump; slot++) {
+        Object* object = page_object(page, slot);
+        if (object != NULL) count_free(vm, object);
+      }
+    }
+  }
+#endif
+  free_heap(&vm->heap);
+  vm->young_bytes = 0;
+  vm->old_bytes = 0;
+
+  vm->gc_phase = GC_IDLE;
+  vm->gray_count = 0;
+  vm->sweep_page = NULL;
+  vm->sweep_slot = 0;
+  vm->next_major_gc = vm->gc_min_heap_size;
 }
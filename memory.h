@@ -1,6 +1,7 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
+#include "heap.h"
 #include "object.h"
 #include "common.h"
 
@@ -19,6 +20,12 @@
   (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
 
+// Allocates an array with every byte zero. Big ones come straight from the
+// system as pages that are zero already, which costs nothing until each page
+// is first touched. Free it with FREE_ARRAY().
+#define ALLOCATE_ZEROED(type, count) \
+  (type*)allocate_zeroed(sizeof(type) * (count))
+
 // It’s a tiny wrapper around reallocate() that
 // “resizes” an allocation down to zero bytes.
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
@@ -27,7 +34,32 @@
 // When new_size is 0, we handle deallocation case by calling free()
 // otherwise realloc() handles every other case
 void* reallocate(void* pointer, size_t old_size, size_t new_size);
+void* allocate_zeroed(size_t size);
+
+// Defaults for the collector’s tuning knobs (see VM in vm.h). A minor
+// collection runs whenever gc_nursery_size bytes have been allocated since
+// the last one. A major collection starts when the old generation reaches
+// gc_heap_growth times its size after the previous major collection, but
+// never below gc_min_heap_size. Each step of a major collection marks or
+// sweeps GC_STEP_OBJECTS objects.
+#define GC_NURSERY_SIZE (256 * 1024)
+#define GC_MIN_HEAP_SIZE (1024 * 1024)
+#define GC_HEAP_GROWTH 2.0
+#define GC_STEP_OBJECTS 256
+
+// Called before every object allocation to do whatever collection work is
+// due. Values that aren’t reachable from the isolate’s roots (its stack,
+// globals, and the constants of the chunks it is running and compiling)
+// must not be held across an allocation.
+void gc_step(VM* vm);
+// Runs a complete collection of both generations right away.
+void collect_garbage(VM* vm);
+// The string table only refers to strings weakly, so interning can turn up
+// a string the collector has already found dead but not freed yet. This
+// brings it back to life.
+void revive_object(VM* vm, Object* object);
 
-void free_objects();
+// Frees all of the isolate’s objects and resets its collector.
+void free_objects(VM* vm);
 
 #endif
@@ -1,78 +1,371 @@
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#include "table.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJECT(type, object_type)  \
-  (type*) allocate_object(sizeof(type), object_type)
+// Hash function for the hash tables.
+//
+// This is wyhash (by Wang Yi), cut down to what strings need. It eats the
+// string sixteen bytes at a time, mixing each pair of 64-bit words with one
+// 64x64->128-bit multiply, and folds the two halves of the product together.
+// Strings of up to sixteen bytes, and the last few bytes of longer ones, are
+// read as a couple of words that may overlap, rather than a byte at a time,
+// so there is no loop over the tail.
+//
+// The hash is keyed with a seed. Without one, anyone who can choose the
+// names in a script could pick ones that all land on the same probe and
+// make every lookup walk all of them. main() seeds it from the system’s
+// random source at startup (see random_hash_seed()), and it has to be set
+// before any isolate hashes a string, since isolates and Programs hand
+// strings to each other with their hashes.
 
-// Hash function for the hash table
-//  The algorithm is called “FNV-1a”
-static uint32_t hash_string(const char* key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t) key[i];
-    hash *= 16777619;
+static const uint64_t hash_secret[4] = {
+  0x2d358dccaa6c78a5u, 0x8bb84b93962eacc9u,
+  0x4b33a62ed433d4a3u, 0x4d5a2da51de1aa47u,
+};
+
+// The seed, already mixed with the secret, which every hash starts from.
+static uint64_t hash_seed = 0;
+
+// Multiplies `a` by `b` and leaves the low half of the product in `a` and the
+// high half in `b`.
+static inline void multiply_128(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t product = (__uint128_t)*a * *b;
+  *a = (uint64_t)product;
+  *b = (uint64_t)(product >> 64);
+#else
+  uint64_t a_high = *a >> 32, a_low = (uint32_t)*a;
+  uint64_t b_high = *b >> 32, b_low = (uint32_t)*b;
+  uint64_t high = a_high * b_high, middle_0 = a_high * b_low;
+  uint64_t middle_1 = b_high * a_low, low = a_low * b_low;
+  uint64_t t = low + (middle_0 << 32);
+  uint64_t carry = t < low;
+  uint64_t low_half = t + (middle_1 << 32);
+  carry += low_half < t;
+  *a = low_half;
+  *b = high + (middle_0 >> 32) + (middle_1 >> 32) + carry;
+#endif
+}
+
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+  multiply_128(&a, &b);
+  return a ^ b;
+}
+
+// Reads the bytes as a little-endian number, whatever the machine’s byte
+// order, so a string hashes the same everywhere.
+static inline uint64_t read_64(const uint8_t* bytes) {
+  uint64_t word;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(&word, bytes, sizeof(word));
+#else
+  word = 0;
+  for (int i = 0; i < 8; i++) word |= (uint64_t)bytes[i] << (8 * i);
+#endif
+  return word;
+}
+
+static inline uint64_t read_32(const uint8_t* bytes) {
+  uint32_t word;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(&word, bytes, sizeof(word));
+#else
+  word = 0;
+  for (int i = 0; i < 4; i++) word |= (uint32_t)bytes[i] << (8 * i);
+#endif
+  return word;
+}
+
+// One to three bytes: the first, the middle and the last, which between
+// them cover every byte.
+static inline uint64_t read_small(const uint8_t* bytes, size_t length) {
+  return ((uint64_t)bytes[0] << 16) | ((uint64_t)bytes[length >> 1] << 8) |
+         bytes[length - 1];
+}
+
+void set_hash_seed(uint64_t seed) {
+  hash_seed = seed ^ mix(seed ^ hash_secret[0], hash_secret[1]);
+}
+
+uint32_t hash_string(const char* key, int length) {
+  const uint8_t* bytes = (const uint8_t*) key;
+  size_t left = (size_t) length;
+  uint64_t seed = hash_seed;
+  uint64_t a;
+  uint64_t b;
+
+  if (left <= 16) {
+    if (left >= 4) {
+      // Two pairs of four-byte reads, from each end. For eight bytes or more
+      // the second of each pair moves in by four.
+      size_t inset = (left >> 3) << 2;
+      a = (read_32(bytes) << 32) | read_32(bytes + inset);
+      b = (read_32(bytes + left - 4) << 32) | read_32(bytes + left - 4 - inset);
+    } else if (left > 0) {
+      a = read_small(bytes, left);
+      b = 0;
+    } else {
+      a = 0;
+      b = 0;
+    }
+  } else {
+    // Long strings keep three lanes going at once, so the multiplies don’t
+    // wait on each other.
+    if (left > 48) {
+      uint64_t lane_1 = seed;
+      uint64_t lane_2 = seed;
+      do {
+        seed = mix(read_64(bytes) ^ hash_secret[1],
+                   read_64(bytes + 8) ^ seed);
+        lane_1 = mix(read_64(bytes + 16) ^ hash_secret[2],
+                     read_64(bytes + 24) ^ lane_1);
+        lane_2 = mix(read_64(bytes + 32) ^ hash_secret[3],
+                     read_64(bytes + 40) ^ lane_2);
+        bytes += 48;
+        left -= 48;
+      } while (left > 48);
+      seed ^= lane_1 ^ lane_2;
+    }
+    while (left > 16) {
+      seed = mix(read_64(bytes) ^ hash_secret[1], read_64(bytes + 8) ^ seed);
+      bytes += 16;
+      left -= 16;
+    }
+    // The last sixteen bytes, overlapping ones already mixed in if need be.
+    a = read_64(bytes + left - 16);
+    b = read_64(bytes + left - 8);
   }
-  return hash;
+
+  a ^= hash_secret[1];
+  b ^= seed;
+  multiply_128(&a, &b);
+  uint64_t hash = mix(a ^ hash_secret[0] ^ (uint64_t) length,
+                      b ^ hash_secret[1]);
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+uint64_t random_hash_seed(void) {
+  uint64_t seed = 0;
+  FILE* random = fopen("/dev/urandom", "rb");
+  if (random != NULL) {
+    size_t read = fread(&seed, sizeof(seed), 1, random);
+    fclose(random);
+    if (read == 1) return seed;
+  }
+
+  // No random source (Windows, say), so make do with what differs from one
+  // run to the next: the time, and where the system put the stack and heap.
+  int local;
+  void* block = malloc(1);
+  seed = mix((uint64_t) time(NULL) ^ hash_secret[0],
+             (uint64_t) clock() ^ hash_secret[1]);
+  seed = mix(seed ^ (uint64_t)(uintptr_t) &local,
+             (uint64_t)(uintptr_t) block ^ hash_secret[2]);
+  free(block);
+  return seed;
 }
 
 // It allocates an object of the given size on the heap. Note that the size is
 // not just the size of Obj itself. The caller passes in the number of bytes so
 // that there is room for the extra payload fields needed by the specific object
 // type being created.
-static Object* allocate_object(size_t size, Object_Type type) {
-  Object* object = (Object*) reallocate(NULL, 0, size);
+//
+// Every new object starts out in the young generation, and this is where the
+// collector gets its chance to run (see memory.c).
+static Object* allocate_object(VM* vm, size_t size, Object_Type type) {
+  gc_step(vm);
+
+  Object* object = heap_allocate(&vm->heap, size);
   object->type = type;
-  object->next = vm.objects;
-  vm.objects = object;
+  object->color = vm->gc_white;
+  object->generation = GENERATION_YOUNG;
+  vm->young_bytes += size;
+  COUNT_STAT(vm, objects_allocated[type], 1);
+  COUNT_STAT(vm, bytes_allocated[type], page_of(object)->slot_size);
   return object;
 }
 
 // It creates a new ObjString on the heap and then initializes its fields. It’s
 // sort of like a constructor in an OOP language. As such, it first calls the “base
-// class” constructor to initialize the Obj state,
-static Object_String* allocate_string(char* chars, int length, uint32_t hash) {
-  Object_String* string = ALLOCATE_OBJECT(Object_String, OBJECT_STRING);
+// class” constructor to initialize the Obj state. The object is allocated
+// just big enough for the string’s characters and the trailing terminator,
+// which is already in place; the caller fills in the rest.
+static Object_String* allocate_string(VM* vm, int length) {
+  Object_String* string = (Object_String*) allocate_object(
+      vm, offsetof(Object_String, chars) + length + 1, OBJECT_STRING);
   string->length = length;
-  string->chars = chars;
-  string->hash = hash;
-  table_set(&vm.strings, string, NIL_VAL);
+  string->hash = 0;
+  string->interned = false;
+  string->chars[length] = '\0';
   return string;
 }
 
-Object_String* copy_string(const char* chars, int length) {
+Object_String* copy_string(VM* vm, const char* chars, int length) {
   uint32_t hash = hash_string(chars, length);
-  Object_String* interned = table_find_string(&vm.strings, chars, length, hash);
-  if (interned != NULL) return interned;
-  // allocate a new array on the heap, just big enough for the string’s
-  // characters and the trailing terminator
-  char* heap_chars = ALLOCATE(char, length + 1);
-  memcpy(heap_chars, chars, length);
-  heap_chars[length] = '\0';
-  return allocate_string(heap_chars, length, hash);
+  int slot;
+  Object_String* interned =
+      intern_find(&vm->strings, chars, length, hash, &slot);
+  if (interned != NULL) {
+    COUNT_STAT(vm, intern_hits, 1);
+    revive_object(vm, (Object*) interned);
+    return interned;
+  }
+  COUNT_STAT(vm, intern_misses, 1);
+
+  // The collector may delete dead strings from the set while the new one is
+  // allocated, but that leaves the slot where it was.
+  Object_String* string = allocate_string(vm, length);
+  memcpy(string->chars, chars, length);
+  string->hash = hash;
+  string->interned = true;
+  intern_insert(&vm->strings, slot, string);
+  return string;
 }
 
-void print_object(Value value) {
-  switch(OBJECT_TYPE(value)) {
-    case OBJECT_STRING:
-      printf("%s", AS_CSTRING(value));
-      break;
+Object* concatenate_strings(VM* vm, Object* left, Object* right) {
+  int left_length = string_length(left);
+  int right_length = string_length(right);
+  // There is no way to report this to the program, so treat it like running
+  // out of memory (see reallocate()).
+  if (left_length > INT_MAX - right_length) exit(1);
+  int length = left_length + right_length;
+
+  if (length < ROPE_MIN_LENGTH) {
+    // Every rope is longer than this, so both sides are flat.
+    Object_String* a = (Object_String*) left;
+    Object_String* b = (Object_String*) right;
+    Object_String* result = allocate_string(vm, length);
+    memcpy(result->chars, a->chars, a->length);
+    memcpy(result->chars + a->length, b->chars, b->length);
+    return (Object*) result;
   }
+
+  Object_Rope* rope = (Object_Rope*) allocate_object(vm, sizeof(Object_Rope),
+                                                     OBJECT_ROPE);
+  rope->length = length;
+  rope->left = left;
+  rope->right = right;
+  return (Object*) rope;
 }
 
-Object_String* take_string(char* chars, int length) {
-  uint32_t hash = hash_string(chars, length);
-  Object_String* interned = table_find_string(&vm.strings, chars, length, hash);
+// Walks the flat pieces of a string from left to right. The pieces still to
+// visit are kept on an explicit stack rather than by recursing, since a rope
+// built up one piece at a time is as deep as it has pieces.
+typedef struct {
+  Object** pending;
+  int count;
+  int capacity;
+} Pieces;
 
-  if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
-    return interned;
+static void push_piece(Pieces* pieces, Object* string) {
+  if (pieces->capacity < pieces->count + 1) {
+    int old_capacity = pieces->capacity;
+    pieces->capacity = GROW_CAPACITY(old_capacity);
+    pieces->pending = GROW_ARRAY(Object*, pieces->pending, old_capacity,
+                                 pieces->capacity);
+  }
+  pieces->pending[pieces->count++] = string;
+}
+
+static void start_pieces(Pieces* pieces, Object* string) {
+  pieces->pending = NULL;
+  pieces->count = 0;
+  pieces->capacity = 0;
+  push_piece(pieces, string);
+}
+
+// Returns the next flat piece, or NULL once there are no more.
+static Object_String* next_piece(Pieces* pieces) {
+  while (pieces->count > 0) {
+    Object* string = pieces->pending[--pieces->count];
+    if (string->type == OBJECT_STRING) return (Object_String*) string;
+
+    Object_Rope* rope = (Object_Rope*) string;
+    push_piece(pieces, rope->right);
+    push_piece(pieces, rope->left);
+  }
+  return NULL;
+}
+
+static void end_pieces(Pieces* pieces) {
+  FREE_ARRAY(Object*, pieces->pending, pieces->capacity);
+}
+
+bool strings_equal(Object* a, Object* b) {
+  if (a == b) return true;
+  if (string_length(a) != string_length(b)) return false;
+  if (a->type == OBJECT_STRING && b->type == OBJECT_STRING) {
+    Object_String* a_string = (Object_String*) a;
+    Object_String* b_string = (Object_String*) b;
+    // Two different interned strings can’t be equal.
+    if (a_string->interned && b_string->interned) return false;
+    return memcmp(a_string->chars, b_string->chars, a_string->length) == 0;
   }
 
-  return allocate_string(chars, length, hash);
+  Pieces a_pieces;
+  Pieces b_pieces;
+  start_pieces(&a_pieces, a);
+  start_pieces(&b_pieces, b);
+  const char* a_chars = NULL;
+  const char* b_chars = NULL;
+  int a_left = 0;
+  int b_left = 0;
+
+  // The lengths match, so both run out of pieces at the same time.
+  bool equal = true;
+  while (equal) {
+    if (a_left == 0) {
+      Object_String* piece = next_piece(&a_pieces);
+      if (piece == NULL) break;
+      a_chars = piece->chars;
+      a_left = piece->length;
+      continue;
+    }
+    if (b_left == 0) {
+      Object_String* piece = next_piece(&b_pieces);
+      b_chars = piece->chars;
+      b_left = piece->length;
+      continue;
+    }
+
+    int length = a_left < b_left ? a_left : b_left;
+    equal = memcmp(a_chars, b_chars, length) == 0;
+    a_chars += length;
+    a_left -= length;
+    b_chars += length;
+    b_left -= length;
+  }
+
+  end_pieces(&a_pieces);
+  end_pieces(&b_pieces);
+  return equal;
+}
+
+static void print_rope(Object_Rope* rope) {
+  Pieces pieces;
+  start_pieces(&pieces, (Object*) rope);
+  Object_String* piece;
+  while ((piece = next_piece(&pieces)) != NULL) {
+    fwrite(piece->chars, 1, piece->length, stdout);
+  }
+  end_pieces(&pieces);
+}
+
+void print_object(Value value) {
+  switch(OBJECT_TYPE(value)) {
+    case OBJECT_STRING:
+      printf("%s", AS_CSTRING(value));
+      break;
+    case OBJECT_ROPE:
+      print_rope((Object_Rope*) AS_OBJECT(value));
+      break;
+  }
 }
@@ -7,6 +7,10 @@
 
 #define OBJECT_TYPE(value)  (AS_OBJECT(value)->type)
 #define IS_STRING(value)    is_object(value, OBJECT_STRING)
+#define IS_ROPE(value)      is_object(value, OBJECT_ROPE)
+// A Lox string is either kind of object. Only IS_STRING() values can be used
+// with AS_STRING().
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_ROPE(value))
 
 // These two macros take a Value that is expected to contain a pointer to a valid
 // ObjString on the heap. The first one returns the ObjString* pointer. The
@@ -16,11 +20,25 @@
 
 typedef enum {
   OBJECT_STRING,
+  OBJECT_ROPE,
 } Object_Type;
 
+// Which of the collector’s generations an object belongs to (see memory.c).
+// Objects that belong to a shared Program are permanent: no isolate’s
+// collector ever marks or frees them. A heap slot with no object in it is
+// marked free (see heap.h).
+typedef enum {
+  GENERATION_YOUNG,
+  GENERATION_OLD,
+  GENERATION_PERMANENT,
+  GENERATION_FREE,
+} Generation;
+
 struct Object {
   Object_Type type;
-  struct Object* next;
+  // The collector’s mark for the object, one of the two whites or black.
+  uint8_t color;
+  uint8_t generation;
 };
 
 // Within a structure object, the non-bit-field members and the units in which
@@ -32,19 +50,66 @@ struct Object {
 //
 // Given an ObjString*, you can safely cast it to Obj* and then access the
 // type field from it. Every ObjString “is” an Obj in the OOP sense of “is”.
+//
+// The characters come right after the header, in the same heap slot, so a
+// string is a single allocation and comparing one touches a single block of
+// memory.
+//
+// Only the strings the compiler makes are interned. Strings made while the
+// program runs are mostly printed once or thrown away, so they are never
+// hashed or added to the string table, and comparing one means comparing
+// characters (see strings_equal()). `hash` is only set for interned strings.
 struct Object_String {
   Object object;
   int length;
-  char* chars;
   uint32_t hash;
+  bool interned;
+  char chars[];
 };
 
-Object_String* copy_string(const char* chars, int length);
+// Concatenations that come out at least this long build a rope. Shorter
+// ones copy the characters, since that is cheap.
+#define ROPE_MIN_LENGTH 64
+
+// A string made by concatenating two others, without copying either one.
+// Each side is an Object_String or another Object_Rope. The characters are
+// never gathered into one place: printing and comparing a rope walk its flat
+// pieces in order.
+//
+// A rope never changes once it is made, and it only refers to strings that
+// already existed when it was made. The collector relies on both (see
+// memory.c).
+struct Object_Rope {
+  Object object;
+  int length;
+  Object* left;
+  Object* right;
+};
+
+// Keys the string hash (see object.c). Every isolate must see the same seed,
+// so set it once, before the first one is made.
+void set_hash_seed(uint64_t seed);
+// A seed from the system’s random source, or failing that, from the time.
+uint64_t random_hash_seed(void);
+// The hash a string with these characters is interned under.
+uint32_t hash_string(const char* key, int length);
+
+Object_String* copy_string(VM* vm, const char* chars, int length);
+// Returns `left` followed by `right`, either of which may be a flat string or
+// a rope. Both must stay reachable from the roots until it returns, since it
+// allocates.
+Object* concatenate_strings(VM* vm, Object* left, Object* right);
+// Compares two strings, flat or rope, by their characters.
+bool strings_equal(Object* a, Object* b);
 void print_object(Value value);
-Object_String* take_string(char* chars, int length);
 
 static inline bool is_object(Value value, Object_Type type) {
   return IS_OBJECT(value) && AS_OBJECT(value)->type == type;
 }
 
+static inline int string_length(Object* string) {
+  if (string->type == OBJECT_ROPE) return ((Object_Rope*) string)->length;
+  return ((Object_String*) string)->length;
+}
+
 #endif
@@ -0,0 +1,437 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "optimize.h"
+#include "value.h"
+
+// The chunk is straight-line code, so the optimizer makes one pass over it
+// from start to finish. It copies the instructions into a list as it goes,
+// and keeps a model of the stack alongside: for each value on the real
+// stack, which instruction in the list pushed it. When an instruction comes
+// along whose operands were pushed by the very last instructions in the
+// list, and those just push a constant, it can be done right away: the
+// pushes are taken off the end of the list and the result is pushed
+// instead. Nothing in between can have seen the values, because there is
+// nothing in between.
+//
+// The list is never longer than the code it came from, so at the end it is
+// written back over the chunk’s own code.
+
+// An instruction as the optimizer works on it. Constants are kept as values
+// rather than indexes, since folding makes new ones and the pool is rebuilt
+// at the end.
+typedef struct {
+  uint8_t op;
+  // The local or global slot, for the instructions that have one.
+  uint16_t slot;
+  // For OP_CONSTANT and OP_GET_LOCAL_ADD_CONST.
+  Value constant;
+  // The line of each of the instruction’s bytes.
+  int lines[3];
+  // Which instructions pushed the values this one took off the stack, so
+  // taking it back out of the list can put them back.
+  int inputs[2];
+  int input_count;
+} Instruction;
+
+typedef struct {
+  Instruction* code;
+  int count;
+  int capacity;
+
+  // What pushed each value on the stack: an index into `code`, or -1 for
+  // values the optimizer knows nothing about.
+  int* stack;
+  int stack_count;
+  int stack_capacity;
+} Optimizer;
+
+// How many bytes an instruction takes up, operands included.
+static int instruction_length(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+      return 2;
+    case OP_GET_LOCAL_ADD_CONST:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+      return 3;
+    default:
+      return 1;
+  }
+}
+
+// How many values an instruction takes off the stack, and how many it
+// pushes.
+static int stack_inputs(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_ADD_CONST:
+    case OP_RETURN:
+      return 0;
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      return 2;
+    default:
+      return 1;
+  }
+}
+
+static int stack_outputs(uint8_t op) {
+  switch (op) {
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_PRINT:
+    case OP_SET_LOCAL_POP:
+    case OP_SET_GLOBAL_POP:
+    case OP_RETURN:
+      return 0;
+    default:
+      return 1;
+  }
+}
+
+// Instructions that can’t fail and do nothing but push a value. Nobody
+// misses one if the value is popped unseen.
+static bool is_pure(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_NOT:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool pushes_constant(Instruction* instruction) {
+  switch (instruction->op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static Value constant_value(Instruction* instruction) {
+  switch (instruction->op) {
+    case OP_NIL:  return NIL_VAL;
+    case OP_TRUE: return BOOL_VAL(true);
+    case OP_FALSE: return BOOL_VAL(false);
+    default: return instruction->constant;
+  }
+}
+
+static void push_entry(Optimizer* optimizer, int entry) {
+  if (optimizer->stack_capacity < optimizer->stack_count + 1) {
+    int old_capacity = optimizer->stack_capacity;
+    optimizer->stack_capacity = GROW_CAPACITY(old_capacity);
+    optimizer->stack = GROW_ARRAY(int, optimizer->stack, old_capacity,
+                                  optimizer->stack_capacity);
+  }
+  optimizer->stack[optimizer->stack_count++] = entry;
+}
+
+static int pop_entry(Optimizer* optimizer) {
+  return optimizer->stack[--optimizer->stack_count];
+}
+
+// Adds an instruction to the end of the list, taking its inputs off the
+// stack model and pushing its result.
+static void append(Optimizer* optimizer, Instruction instruction) {
+  if (optimizer->capacity < optimizer->count + 1) {
+    int old_capacity = optimizer->capacity;
+    optimizer->capacity = GROW_CAPACITY(old_capacity);
+    optimizer->code = GROW_ARRAY(Instruction, optimizer->code, old_capacity,
+                                 optimizer->capacity);
+  }
+
+  instruction.input_count = stack_inputs(instruction.op);
+  for (int i = instruction.input_count - 1; i >= 0; i--) {
+    instruction.inputs[i] = pop_entry(optimizer);
+  }
+  int index = optimizer->count++;
+  optimizer->code[index] = instruction;
+  if (stack_outputs(instruction.op) == 1) push_entry(optimizer, index);
+}
+
+// Takes the last instruction back out of the list, and puts the values it
+// took off the stack back.
+static void remove_last(Optimizer* optimizer) {
+  Instruction* instruction = &optimizer->code[--optimizer->count];
+  if (stack_outputs(instruction->op) == 1) pop_entry(optimizer);
+  for (int i = 0; i < instruction->input_count; i++) {
+    push_entry(optimizer, instruction->inputs[i]);
+  }
+}
+
+// Returns the instruction that pushed the value `distance` down from the top
+// of the stack, if it is a constant push that is `distance` instructions from
+// the end of the list. Otherwise returns NULL.
+static Instruction* constant_operand(Optimizer* optimizer, int distance) {
+  if (optimizer->stack_count <= distance) return NULL;
+  int pushed_by = optimizer->stack[optimizer->stack_count - 1 - distance];
+  if (pushed_by == -1 || pushed_by != optimizer->count - 1 - distance) {
+    return NULL;
+  }
+  Instruction* instruction = &optimizer->code[pushed_by];
+  return pushes_constant(instruction) ? instruction : NULL;
+}
+
+// Replaces the last `operands` instructions, which push constants, with a
+// push of the result. All of its bytes get the line of the instruction that
+// was folded.
+static void replace_with_constant(Optimizer* optimizer, int operands,
+                                  Value value, int line) {
+  for (int i = 0; i < operands; i++) remove_last(optimizer);
+
+  Instruction push;
+  push.slot = 0;
+  push.constant = NIL_VAL;
+  if (IS_NIL(value)) {
+    push.op = OP_NIL;
+  } else if (IS_BOOL(value)) {
+    push.op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+  } else {
+    push.op = OP_CONSTANT;
+    push.constant = value;
+  }
+  for (int i = 0; i < 3; i++) push.lines[i] = line;
+  append(optimizer, push);
+}
+
+// Joins two string constants into a new one. It is added to the chunk’s
+// constants straight away, which keeps it alive if the next fold collects.
+static Value concatenate_constants(VM* vm, Chunk* chunk, Value a, Value b) {
+  Object_String* left = AS_STRING(a);
+  Object_String* right = AS_STRING(b);
+  int length = left->length + right->length;
+  char* chars = ALLOCATE(char, length + 1);
+  memcpy(chars, left->chars, left->length);
+  memcpy(chars + left->length, right->chars, right->length);
+  Value result = OBJECT_VAL(copy_string(vm, chars, length));
+  FREE_ARRAY(char, chars, length + 1);
+  add_constant(chunk, result);
+  return result;
+}
+
+bool fold_operator(VM* vm, Chunk* chunk, uint8_t op, Value* operands,
+                   Value* result) {
+  Value a = operands[0];
+  if (op == OP_NOT) {
+    *result = BOOL_VAL(is_falsey(a));
+    return true;
+  }
+  if (op == OP_NEGATE) {
+    if (!IS_NUMBER(a)) return false;
+    *result = NUMBER_VAL(-AS_NUMBER(a));
+    return true;
+  }
+  if (stack_inputs(op) != 2 || stack_outputs(op) != 1) return false;
+
+  Value b = operands[1];
+  if (op == OP_EQUAL) {
+    *result = BOOL_VAL(values_equal(a, b));
+    return true;
+  }
+  if (op == OP_NOT_EQUAL) {
+    *result = BOOL_VAL(!values_equal(a, b));
+    return true;
+  }
+  if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+    *result = concatenate_constants(vm, chunk, a, b);
+    return true;
+  }
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  switch (op) {
+    case OP_ADD:           *result = NUMBER_VAL(x + y); return true;
+    case OP_SUBTRACT:      *result = NUMBER_VAL(x - y); return true;
+    case OP_MULTIPLY:      *result = NUMBER_VAL(x * y); return true;
+    case OP_DIVIDE:        *result = NUMBER_VAL(x / y); return true;
+    case OP_GREATER:       *result = BOOL_VAL(x > y); return true;
+    case OP_LESS:          *result = BOOL_VAL(x < y); return true;
+    // As in run(), these keep the meaning of !(x < y) and !(x > y) for NaN.
+    case OP_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+    case OP_LESS_EQUAL:    *result = BOOL_VAL(!(x > y)); return true;
+    default: return false;
+  }
+}
+
+static bool try_fold(VM* vm, Chunk* chunk, Optimizer* optimizer,
+                     Instruction* instruction) {
+  uint8_t op = instruction->op;
+  int operand_count;
+  if (op == OP_NOT || op == OP_NEGATE) {
+    operand_count = 1;
+  } else if (stack_inputs(op) == 2 && stack_outputs(op) == 1) {
+    operand_count = 2;
+  } else {
+    return false;
+  }
+
+  Value operands[2];
+  for (int i = 0; i < operand_count; i++) {
+    Instruction* operand = constant_operand(optimizer, operand_count - 1 - i);
+    if (operand == NULL) return false;
+    operands[i] = constant_value(operand);
+  }
+
+  Value result;
+  if (!fold_operator(vm, chunk, op, operands, &result)) return false;
+  replace_with_constant(optimizer, operand_count, result,
+                        instruction->lines[0]);
+  return true;
+}
+
+// A pop of a value that was pushed by the last instruction, where that
+// instruction can’t fail and has no other effect, cancels it out. If that
+// instruction had operands of its own, they now need popping instead, and
+// may cancel out in turn.
+static void pop_value(Optimizer* optimizer, Instruction* instruction) {
+  int pops = 1;
+  while (pops > 0 && optimizer->stack_count > 0 &&
+         optimizer->stack[optimizer->stack_count - 1] == optimizer->count - 1 &&
+         is_pure(optimizer->code[optimizer->count - 1].op)) {
+    pops += optimizer->code[optimizer->count - 1].input_count - 1;
+    remove_last(optimizer);
+  }
+  for (; pops > 0; pops--) append(optimizer, *instruction);
+}
+
+bool same_constant(Value a, Value b) {
+  // Compare numbers by their bits, so 0 and -0 stay apart.
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+  if (IS_OBJECT(a) && IS_OBJECT(b)) return AS_OBJECT(a) == AS_OBJECT(b);
+  if (IS_BOOL(a) && IS_BOOL(b)) return AS_BOOL(a) == AS_BOOL(b);
+  return IS_NIL(a) && IS_NIL(b);
+}
+
+int pool_constant(ValueArray* pool, Value value) {
+  for (int i = 0; i < pool->count; i++) {
+    if (same_constant(pool->values[i], value)) return i;
+  }
+  write_value_array(pool, value);
+  return pool->count - 1;
+}
+
+// Writes the list back over the chunk’s code, with a new constant pool.
+// Every constant instruction in the list came from one in the chunk, which
+// had a pool entry of its own, so the new pool is never bigger than the old
+// one.
+static void write_back(Optimizer* optimizer, Chunk* chunk) {
+  ValueArray pool;
+  init_value_array(&pool);
+
+  int offset = 0;
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    uint8_t bytes[3] = {instruction->op, (uint8_t)instruction->slot, 0};
+    if (instruction->op == OP_CONSTANT) {
+      bytes[1] = (uint8_t)pool_constant(&pool, instruction->constant);
+    } else if (instruction->op == OP_GET_LOCAL_ADD_CONST) {
+      bytes[2] = (uint8_t)pool_constant(&pool, instruction->constant);
+    } else if (instruction_length(instruction->op) == 3) {
+      bytes[1] = (uint8_t)(instruction->slot >> 8);
+      bytes[2] = (uint8_t)(instruction->slot & 0xff);
+    }
+
+    int length = instruction_length(instruction->op);
+    for (int j = 0; j < length; j++) {
+      chunk->code[offset + j] = bytes[j];
+      chunk->lines[offset + j] = instruction->lines[j];
+    }
+    offset += length;
+  }
+  chunk->count = offset;
+
+  // The values in the old pool are all still in the new one or dead, and
+  // nothing is allocated here, so the collector can’t see them go.
+  if (pool.count > 0) {
+    memcpy(chunk->constants.values, pool.values, sizeof(Value) * pool.count);
+  }
+  chunk->constants.count = pool.count;
+  free_value_array(&pool);
+}
+
+void optimize_chunk(VM* vm, Chunk* chunk) {
+  Optimizer optimizer;
+  optimizer.code = NULL;
+  optimizer.count = 0;
+  optimizer.capacity = 0;
+  optimizer.stack = NULL;
+  optimizer.stack_count = 0;
+  optimizer.stack_capacity = 0;
+
+  for (int offset = 0; offset < chunk->count;) {
+    Instruction instruction;
+    instruction.op = chunk->code[offset];
+    instruction.slot = 0;
+    instruction.constant = NIL_VAL;
+    int length = instruction_length(instruction.op);
+    for (int i = 0; i < 3; i++) {
+      instruction.lines[i] = chunk->lines[offset + (i < length ? i : 0)];
+    }
+
+    switch (instruction.op) {
+      case OP_CONSTANT:
+        instruction.constant = chunk->constants.values[chunk->code[offset + 1]];
+        break;
+      case OP_GET_LOCAL_ADD_CONST:
+        instruction.slot = chunk->code[offset + 1];
+        instruction.constant = chunk->constants.values[chunk->code[offset + 2]];
+        break;
+      default:
+        if (length == 2) {
+          instruction.slot = chunk->code[offset + 1];
+        } else if (length == 3) {
+          instruction.slot = GLOBAL_SLOT(&chunk->code[offset + 1]);
+        }
+        break;
+    }
+    offset += length;
+
+    if (instruction.op == OP_POP) {
+      pop_value(&optimizer, &instruction);
+    } else if (!try_fold(vm, chunk, &optimizer, &instruction)) {
+      append(&optimizer, instruction);
+    }
+  }
+
+  write_back(&optimizer, chunk);
+  FREE_ARRAY(Instruction, optimizer.code, optimizer.capacity);
+  FREE_ARRAY(int, optimizer.stack, optimizer.stack_capacity);
+}
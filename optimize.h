@@ -0,0 +1,40 @@
+#ifndef clox_optimize_h
+#define clox_optimize_h
+
+#include "chunk.h"
+#include "vm.h"
+
+// The optimizer behind -O. It runs over a finished chunk, after the compiler
+// has emitted and fused its instructions, and rewrites it in place:
+//
+// - Arithmetic, comparisons, negation and ! on constants are done at compile
+//   time, and so is + on two string literals. Anything that would be a
+//   runtime error is left alone, so the error still happens, on its line.
+// - A value that is pushed only to be popped again, without anything seeing
+//   it, is never pushed.
+//
+// Every instruction left keeps the lines it had, so runtime errors report
+// the same lines as without -O. The constant pool is rebuilt with only the
+// constants the optimized code uses.
+//
+// Folding strings interns new ones in the isolate, which may collect. The
+// chunk must be the isolate’s compiling_chunk so its constants stay roots.
+void optimize_chunk(VM* vm, Chunk* chunk);
+
+// Works out an operator on constant operands the way run() would: the
+// binary operators, negation and !. Returns false, leaving it for run(), if
+// that would be an error. A string it makes is added to the chunk’s
+// constants, under the same rule as above.
+bool fold_operator(VM* vm, Chunk* chunk, uint8_t op, Value* operands,
+                   Value* result);
+
+// Whether two constants really are the same: numbers are matched by their
+// bits, so 0 and -0 stay apart, and objects by identity. The compiler’s
+// strings are all interned, so that is the same as matching characters.
+bool same_constant(Value a, Value b);
+
+// Returns the index of a constant in a pool being built, adding it if it
+// isn’t there yet.
+int pool_constant(ValueArray* pool, Value value);
+
+#endif
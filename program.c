@@ -0,0 +1,63 @@
+#include <stdlib.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "program.h"
+#include "vm.h"
+
+// The program keeps everything the compiler allocated for good. The
+// collectors of the isolates that run it never touch these objects, so they
+// can be shared by all of them at once.
+static void make_permanent(Heap* heap) {
+  for (Page* page = heap->pages; page != NULL; page = page->next) {
+    for (int slot = 0; slot < page->bump; slot++) {
+      Object* object = page_object(page, slot);
+      if (object != NULL) object->generation = GENERATION_PERMANENT;
+    }
+  }
+}
+
+Program* compile_program(const char* source, bool jit, int optimize) {
+  Program* program = ALLOCATE(Program, 1);
+  init_chunk(&program->chunk);
+  program->has_jit = false;
+
+  // The compiler interns strings and hands out global slots through an
+  // isolate, so compile in a scratch one and then take over everything it
+  // allocated.
+  VM scratch;
+  init_vm(&scratch);
+  scratch.optimize = optimize;
+  bool compiled = compile(&scratch, source, &program->chunk);
+
+  program->heap = scratch.heap;
+  make_permanent(&program->heap);
+  program->strings = scratch.strings;
+  intern_finish_growing(&program->strings);
+  program->global_slots = scratch.global_slots;
+  program->global_names = scratch.global_names;
+
+  // All that is left in the scratch isolate is its (empty) global values
+  // and the collector’s gray stack. free_vm() would also report on it in
+  // debug builds, so free them by hand.
+  free_value_array(&scratch.global_values);
+  FREE_ARRAY(Object*, scratch.gray_stack, scratch.gray_capacity);
+
+  if (!compiled) {
+    free_program(program);
+    return NULL;
+  }
+
+  if (jit) program->has_jit = jit_compile(&program->chunk, &program->jit);
+  return program;
+}
+
+void free_program(Program* program) {
+  if (program->has_jit) jit_free(&program->jit);
+  free_chunk(&program->chunk);
+  free_intern_set(&program->strings);
+  free_table(&program->global_slots);
+  free_value_array(&program->global_names);
+  free_heap(&program->heap);
+  FREE(Program, program);
+}
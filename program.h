@@ -0,0 +1,43 @@
+#ifndef clox_program_h
+#define clox_program_h
+
+#include "chunk.h"
+#include "intern.h"
+#include "jit.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+// A compiled script that can be run any number of times, on any isolate,
+// from any number of threads at once.
+//
+// Nothing in a Program changes after compile_program() returns. The strings
+// in its constant pool and its global names belong to the program rather than
+// to an isolate, and every execution gets its own stack, globals, heap and
+// private copy of the bytecode to quicken.
+struct Program {
+  Chunk chunk;
+
+  // The strings the compiler created, already interned. An execution seeds
+  // its isolate’s string table from this so strings built at runtime are
+  // interned to the very same objects.
+  InternSet strings;
+  Heap heap;
+
+  // Global variable names and the slots the compiler gave them.
+  Table global_slots;
+  ValueArray global_names;
+
+  // Native code for the chunk, if it was compiled with the JIT.
+  bool has_jit;
+  JitCode jit;
+};
+
+// Returns NULL after reporting errors if the source doesn’t compile. If `jit`
+// is true and the platform has a JIT, the program is also compiled to native
+// code once, up front, so executions on isolates with jit_enabled use it.
+// `optimize` is the isolate setting of the same name it is compiled with.
+Program* compile_program(const char* source, bool jit, int optimize);
+void free_program(Program* program);
+
+#endif
@@ -30,7 +30,15 @@ typedef struct {
  int line;
 } Token;
 
-void init_scanner(const char* source);
-Token scan_token();
+// The scanner’s position in the source. Each compile() call has its own, so
+// several scripts can be scanned at once on different threads.
+typedef struct {
+  const char* start;
+  const char* current;
+  int line;
+} Scanner;
+
+void init_scanner(Scanner* scanner, const char* source);
+Token scan_token(Scanner* scanner);
 
 #endif
@@ -0,0 +1,793 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "loxheap1"
+#define SNAPSHOT_MAGIC_LENGTH 8
+
+static const char* type_names[OBJECT_TYPE_COUNT] = {
+  [OBJECT_STRING] = "string",
+  [OBJECT_ROPE]   = "rope",
+};
+
+// Fills in the objects an object refers to and returns how many there are.
+static int object_references(Object* object, Object* references[2]) {
+  switch (object->type) {
+    case OBJECT_STRING:
+      return 0;
+    case OBJECT_ROPE: {
+      Object_Rope* rope = (Object_Rope*) object;
+      references[0] = rope->left;
+      references[1] = rope->right;
+      return 2;
+    }
+  }
+  return 0;
+}
+
+// WRITING A SNAPSHOT
+//
+// Objects are numbered in the order they are found: the heap’s own objects
+// first, then any objects of a shared Program the isolate refers to. A hash
+// map from addresses to numbers turns pointers into numbers.
+
+typedef struct {
+  Object** objects;
+  int count;
+  int capacity;
+
+  // The map. Its capacity is a power of two, so probing can mask.
+  Object** keys;
+  int* numbers;
+  int map_capacity;
+} Numbering;
+
+typedef struct {
+  uint8_t* kinds;
+  int* numbers;
+  int count;
+  int capacity;
+} Roots;
+
+static uint32_t hash_pointer(Object* object) {
+  uint64_t bits = (uint64_t)(uintptr_t)object;
+  return (uint32_t)(((bits >> 4) * 0x9E3779B97F4A7C15u) >> 32);
+}
+
+// Returns where the object is in the map, or where it would go.
+static int find_number(Object** keys, int capacity, Object* object) {
+  int index = (int)(hash_pointer(object) & (uint32_t)(capacity - 1));
+  while (keys[index] != NULL && keys[index] != object) {
+    index = (index + 1) & (capacity - 1);
+  }
+  return index;
+}
+
+static void grow_numbering_map(Numbering* numbering) {
+  int capacity = numbering->map_capacity < 64 ? 64
+                                              : numbering->map_capacity * 2;
+  Object** keys = ALLOCATE(Object*, capacity);
+  int* numbers = ALLOCATE(int, capacity);
+  for (int i = 0; i < capacity; i++) keys[i] = NULL;
+
+  for (int i = 0; i < numbering->map_capacity; i++) {
+    if (numbering->keys[i] == NULL) continue;
+    int index = find_number(keys, capacity, numbering->keys[i]);
+    keys[index] = numbering->keys[i];
+    numbers[index] = numbering->numbers[i];
+  }
+
+  FREE_ARRAY(Object*, numbering->keys, numbering->map_capacity);
+  FREE_ARRAY(int, numbering->numbers, numbering->map_capacity);
+  numbering->keys = keys;
+  numbering->numbers = numbers;
+  numbering->map_capacity = capacity;
+}
+
+// Returns the object’s number, giving it the next one if it hasn’t got one
+// yet.
+static int number_object(Numbering* numbering, Object* object) {
+  if ((numbering->count + 1) * 2 > numbering->map_capacity) {
+    grow_numbering_map(numbering);
+  }
+
+  int index = find_number(numbering->keys, numbering->map_capacity, object);
+  if (numbering->keys[index] != NULL) return numbering->numbers[index];
+
+  if (numbering->capacity < numbering->count + 1) {
+    int old_capacity = numbering->capacity;
+    numbering->capacity = GROW_CAPACITY(old_capacity);
+    numbering->objects = GROW_ARRAY(Object*, numbering->objects,
+                                    old_capacity, numbering->capacity);
+  }
+  numbering->objects[numbering->count++] = object;
+  numbering->keys[index] = object;
+  numbering->numbers[index] = numbering->count;
+  return numbering->count;
+}
+
+static void add_root(Numbering* numbering, Roots* roots, Snapshot_Root kind,
+                     Object* object) {
+  if (roots->capacity < roots->count + 1) {
+    int old_capacity = roots->capacity;
+    roots->capacity = GROW_CAPACITY(old_capacity);
+    roots->kinds = GROW_ARRAY(uint8_t, roots->kinds, old_capacity,
+                              roots->capacity);
+    roots->numbers = GROW_ARRAY(int, roots->numbers, old_capacity,
+                                roots->capacity);
+  }
+  roots->kinds[roots->count] = (uint8_t)kind;
+  roots->numbers[roots->count] = number_object(numbering, object);
+  roots->count++;
+}
+
+static void add_root_values(Numbering* numbering, Roots* roots,
+                            Snapshot_Root kind, Value* values, int count) {
+  for (int i = 0; i < count; i++) {
+    if (IS_OBJECT(values[i])) {
+      add_root(numbering, roots, kind, AS_OBJECT(values[i]));
+    }
+  }
+}
+
+static void write_u8(FILE* out, uint8_t value) {
+  fputc(value, out);
+}
+
+static void write_u32(FILE* out, uint32_t value) {
+  for (int i = 0; i < 4; i++) fputc((int)((value >> (8 * i)) & 0xff), out);
+}
+
+bool write_heap_snapshot(VM* vm, FILE* out) {
+  Numbering numbering = {NULL, 0, 0, NULL, NULL, 0};
+  Roots roots = {NULL, NULL, 0, 0};
+
+  for (Page* page = vm->heap.pages; page != NULL; page = page->next) {
+    for (int slot = 0; slot < page->bump; slot++) {
+      Object* object = page_object(page, slot);
+      if (object != NULL) number_object(&numbering, object);
+    }
+  }
+
+  // The same roots the collector marks from (see mark_roots()), and then
+  // the string set.
+  add_root_values(&numbering, &roots, ROOT_STACK, vm->stack,
+                  (int)(vm->stack_top - vm->stack));
+  add_root_values(&numbering, &roots, ROOT_GLOBAL, vm->global_values.values,
+                  vm->global_values.count);
+  add_root_values(&numbering, &roots, ROOT_GLOBAL_NAME,
+                  vm->global_names.values, vm->global_names.count);
+  if (vm->chunk != NULL) {
+    add_root_values(&numbering, &roots, ROOT_CONSTANT,
+                    vm->chunk->constants.values, vm->chunk->constants.count);
+  }
+  if (vm->compiling_chunk != NULL) {
+    add_root_values(&numbering, &roots, ROOT_CONSTANT,
+                    vm->compiling_chunk->constants.values,
+                    vm->compiling_chunk->constants.count);
+  }
+  for (int i = 0; i < intern_slot_count(&vm->strings); i++) {
+    Object_String* string = intern_slot(&vm->strings, i);
+    if (string != NULL) {
+      add_root(&numbering, &roots, ROOT_INTERNED, (Object*) string);
+    }
+  }
+
+  // Number whatever outside the heap the objects numbered so far refer to,
+  // and whatever that refers to in turn.
+  for (int i = 0; i < numbering.count; i++) {
+    Object* references[2];
+    int count = object_references(numbering.objects[i], references);
+    for (int j = 0; j < count; j++) number_object(&numbering, references[j]);
+  }
+
+  fwrite(SNAPSHOT_MAGIC, 1, SNAPSHOT_MAGIC_LENGTH, out);
+  write_u32(out, (uint32_t)numbering.count);
+  for (int i = 0; i < numbering.count; i++) {
+    Object* object = numbering.objects[i];
+    Object* references[2];
+    int count = object_references(object, references);
+
+    write_u8(out, (uint8_t)object->type);
+    write_u8(out, object->generation);
+    write_u32(out, (uint32_t)page_of(object)->slot_size);
+    write_u32(out, (uint32_t)string_length(object));
+    write_u32(out, (uint32_t)count);
+    for (int j = 0; j < count; j++) {
+      write_u32(out, (uint32_t)number_object(&numbering, references[j]));
+    }
+    if (object->type == OBJECT_STRING) {
+      Object_String* string = (Object_String*) object;
+      fwrite(string->chars, 1, string->length, out);
+    }
+  }
+
+  write_u32(out, (uint32_t)roots.count);
+  for (int i = 0; i < roots.count; i++) {
+    write_u8(out, roots.kinds[i]);
+    write_u32(out, (uint32_t)roots.numbers[i]);
+  }
+
+  FREE_ARRAY(Object*, numbering.objects, numbering.capacity);
+  FREE_ARRAY(Object*, numbering.keys, numbering.map_capacity);
+  FREE_ARRAY(int, numbering.numbers, numbering.map_capacity);
+  FREE_ARRAY(uint8_t, roots.kinds, roots.capacity);
+  FREE_ARRAY(int, roots.numbers, roots.capacity);
+  return !ferror(out);
+}
+
+// READING A SNAPSHOT
+//
+// The analysis treats the heap as a graph with one extra node, numbered 0,
+// that has an edge to every strong root. An object’s retained size is what
+// freeing it would free: its own size plus that of every object only
+// reachable through it. Those are the objects it dominates, so the report
+// works out the dominator tree, using the iterative algorithm from Cooper,
+// Harvey and Kennedy’s “A Simple, Fast Dominance Algorithm”. Interned
+// strings are roots only weakly, so they don’t count.
+
+typedef struct {
+  uint8_t type;
+  uint8_t generation;
+  uint32_t size;
+  uint32_t length;
+  // Where the object’s references start in Snapshot.references.
+  int first_reference;
+  int reference_count;
+  // A string’s characters, or NULL.
+  char* chars;
+} Snapshot_Object;
+
+typedef struct {
+  // Numbered from 1, so objects[0] is unused.
+  Snapshot_Object* objects;
+  int object_count;
+  int* references;
+  int reference_count;
+  int reference_capacity;
+  // The objects the strong roots refer to. The interned strings are only
+  // counted.
+  int* roots;
+  int root_count;
+  int root_capacity;
+  int interned_count;
+
+  FILE* in;
+  // Bytes left in the file, so that a corrupt count is caught before
+  // anything that size is allocated.
+  long remaining;
+  bool failed;
+} Snapshot;
+
+static bool read_bytes(Snapshot* snapshot, void* bytes, uint32_t count) {
+  if (snapshot->failed || count > (uint64_t)snapshot->remaining ||
+      fread(bytes, 1, count, snapshot->in) != count) {
+    snapshot->failed = true;
+    return false;
+  }
+  snapshot->remaining -= count;
+  return true;
+}
+
+static uint8_t read_u8(Snapshot* snapshot) {
+  uint8_t byte = 0;
+  read_bytes(snapshot, &byte, 1);
+  return byte;
+}
+
+static uint32_t read_u32(Snapshot* snapshot) {
+  uint8_t bytes[4] = {0};
+  read_bytes(snapshot, bytes, 4);
+  return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+         (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+// Reads how many of something are to follow, each taking up at least
+// `size` bytes.
+static int read_count(Snapshot* snapshot, int size) {
+  uint32_t count = read_u32(snapshot);
+  if ((uint64_t)count * size > (uint64_t)snapshot->remaining) {
+    snapshot->failed = true;
+    return 0;
+  }
+  return (int)count;
+}
+
+static void free_snapshot(Snapshot* snapshot) {
+  for (int i = 1; i <= snapshot->object_count; i++) {
+    Snapshot_Object* object = &snapshot->objects[i];
+    FREE_ARRAY(char, object->chars, object->length);
+  }
+  FREE_ARRAY(Snapshot_Object, snapshot->objects, snapshot->object_count + 1);
+  FREE_ARRAY(int, snapshot->references, snapshot->reference_capacity);
+  FREE_ARRAY(int, snapshot->roots, snapshot->root_capacity);
+}
+
+// Fails on a number that isn’t one of the snapshot’s objects.
+static int read_number(Snapshot* snapshot, int object_count) {
+  uint32_t number = read_u32(snapshot);
+  if (number == 0 || number > (uint32_t)object_count) {
+    snapshot->failed = true;
+    return 0;
+  }
+  return (int)number;
+}
+
+static void read_object(Snapshot* snapshot, int object_count,
+                        Snapshot_Object* object) {
+  object->type = read_u8(snapshot);
+  object->generation = read_u8(snapshot);
+  object->size = read_u32(snapshot);
+  object->length = read_u32(snapshot);
+  object->reference_count = read_count(snapshot, 4);
+  object->first_reference = snapshot->reference_count;
+  object->chars = NULL;
+  if (object->type >= OBJECT_TYPE_COUNT ||
+      object->reference_count != (object->type == OBJECT_ROPE ? 2 : 0)) {
+    snapshot->failed = true;
+  }
+  if (snapshot->failed) return;
+
+  if (snapshot->reference_capacity <
+      snapshot->reference_count + object->reference_count) {
+    int old_capacity = snapshot->reference_capacity;
+    snapshot->reference_capacity = GROW_CAPACITY(old_capacity);
+    if (snapshot->reference_capacity <
+        snapshot->reference_count + object->reference_count) {
+      snapshot->reference_capacity =
+          snapshot->reference_count + object->reference_count;
+    }
+    snapshot->references = GROW_ARRAY(int, snapshot->references,
+                                      old_capacity,
+                                      snapshot->reference_capacity);
+  }
+  for (int i = 0; i < object->reference_count; i++) {
+    snapshot->references[snapshot->reference_count++] =
+        read_number(snapshot, object_count);
+  }
+
+  if (object->type == OBJECT_STRING && object->length > 0) {
+    if (object->length > (uint64_t)snapshot->remaining) {
+      snapshot->failed = true;
+      return;
+    }
+    object->chars = ALLOCATE(char, object->length);
+    read_bytes(snapshot, object->chars, object->length);
+  }
+}
+
+static bool read_snapshot(Snapshot* snapshot, FILE* in) {
+  *snapshot = (Snapshot){NULL, 0, NULL, 0, 0, NULL, 0, 0, 0, in, 0, false};
+  if (fseek(in, 0, SEEK_END) != 0) return false;
+  snapshot->remaining = ftell(in);
+  if (snapshot->remaining < 0 || fseek(in, 0, SEEK_SET) != 0) return false;
+
+  char magic[SNAPSHOT_MAGIC_LENGTH];
+  if (!read_bytes(snapshot, magic, SNAPSHOT_MAGIC_LENGTH) ||
+      memcmp(magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH) != 0) {
+    return false;
+  }
+
+  // Objects take up at least 14 bytes each.
+  int object_count = read_count(snapshot, 14);
+  if (snapshot->failed) return false;
+  snapshot->objects = ALLOCATE(Snapshot_Object, object_count + 1);
+  for (int i = 1; i <= object_count && !snapshot->failed; i++) {
+    snapshot->object_count = i;
+    read_object(snapshot, object_count, &snapshot->objects[i]);
+  }
+
+  int root_count = read_count(snapshot, 5);
+  if (snapshot->failed) return false;
+  snapshot->roots = ALLOCATE(int, root_count);
+  snapshot->root_capacity = root_count;
+  for (int i = 0; i < root_count; i++) {
+    uint8_t kind = read_u8(snapshot);
+    int number = read_number(snapshot, object_count);
+    if (kind > ROOT_INTERNED) snapshot->failed = true;
+    if (snapshot->failed) return false;
+
+    if (kind == ROOT_INTERNED) {
+      snapshot->interned_count++;
+    } else {
+      snapshot->roots[snapshot->root_count++] = number;
+    }
+  }
+  return true;
+}
+
+// The successors of a node: the strong roots for node 0, and an object’s
+// references otherwise.
+static int* successors(Snapshot* snapshot, int node, int* count) {
+  if (node == 0) {
+    *count = snapshot->root_count;
+    return snapshot->roots;
+  }
+  Snapshot_Object* object = &snapshot->objects[node];
+  *count = object->reference_count;
+  return &snapshot->references[object->first_reference];
+}
+
+typedef struct {
+  int node_count;
+  // The nodes reachable from node 0 in reverse postorder, and each node’s
+  // place in it, or -1 if the node isn’t reachable.
+  int* order;
+  int order_count;
+  int* order_index;
+  int* dominators;
+  uint64_t* retained;
+} Dominators;
+
+// A depth-first search from node 0 with an explicit stack, since ropes can
+// nest far deeper than the C stack would like.
+static void order_nodes(Snapshot* snapshot, Dominators* tree) {
+  int* stack = ALLOCATE(int, tree->node_count);
+  int* next_edge = ALLOCATE(int, tree->node_count);
+  int* postorder = ALLOCATE(int, tree->node_count);
+  int postorder_count = 0;
+  for (int i = 0; i < tree->node_count; i++) tree->order_index[i] = -1;
+
+  int depth = 0;
+  stack[depth++] = 0;
+  next_edge[0] = 0;
+  tree->order_index[0] = 0;
+  while (depth > 0) {
+    int node = stack[depth - 1];
+    int count;
+    int* edges = successors(snapshot, node, &count);
+    if (next_edge[node] < count) {
+      int next = edges[next_edge[node]++];
+      if (tree->order_index[next] == -1) {
+        // Seen, for now. The real index comes once the search is done.
+        tree->order_index[next] = 0;
+        next_edge[next] = 0;
+        stack[depth++] = next;
+      }
+    } else {
+      postorder[postorder_count++] = node;
+      depth--;
+    }
+  }
+
+  tree->order_count = postorder_count;
+  for (int i = 0; i < postorder_count; i++) {
+    int node = postorder[postorder_count - 1 - i];
+    tree->order[i] = node;
+    tree->order_index[node] = i;
+  }
+
+  FREE_ARRAY(int, stack, tree->node_count);
+  FREE_ARRAY(int, next_edge, tree->node_count);
+  FREE_ARRAY(int, postorder, tree->node_count);
+}
+
+static int intersect(Dominators* tree, int a, int b) {
+  while (a != b) {
+    while (tree->order_index[a] > tree->order_index[b]) {
+      a = tree->dominators[a];
+    }
+    while (tree->order_index[b] > tree->order_index[a]) {
+      b = tree->dominators[b];
+    }
+  }
+  return a;
+}
+
+static void find_dominators(Snapshot* snapshot, Dominators* tree) {
+  int node_count = snapshot->object_count + 1;
+  tree->node_count = node_count;
+  tree->order = ALLOCATE(int, node_count);
+  tree->order_index = ALLOCATE(int, node_count);
+  tree->dominators = ALLOCATE(int, node_count);
+  tree->retained = ALLOCATE(uint64_t, node_count);
+  order_nodes(snapshot, tree);
+
+  // The algorithm walks each node’s predecessors, so gather those from the
+  // edges of the reachable nodes.
+  int* first_predecessor = ALLOCATE(int, node_count + 1);
+  for (int i = 0; i <= node_count; i++) first_predecessor[i] = 0;
+  int edge_count = 0;
+  for (int i = 0; i < tree->order_count; i++) {
+    int count;
+    int* edges = successors(snapshot, tree->order[i], &count);
+    for (int j = 0; j < count; j++) first_predecessor[edges[j] + 1]++;
+    edge_count += count;
+  }
+  for (int i = 0; i < node_count; i++) {
+    first_predecessor[i + 1] += first_predecessor[i];
+  }
+  int* predecessors = ALLOCATE(int, edge_count);
+  int* filled = ALLOCATE(int, node_count);
+  for (int i = 0; i < node_count; i++) filled[i] = first_predecessor[i];
+  for (int i = 0; i < tree->order_count; i++) {
+    int node = tree->order[i];
+    int count;
+    int* edges = successors(snapshot, node, &count);
+    for (int j = 0; j < count; j++) predecessors[filled[edges[j]]++] = node;
+  }
+
+  for (int i = 0; i < node_count; i++) tree->dominators[i] = -1;
+  tree->dominators[0] = 0;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 1; i < tree->order_count; i++) {
+      int node = tree->order[i];
+      int dominator = -1;
+      for (int j = first_predecessor[node]; j < first_predecessor[node + 1];
+           j++) {
+        int predecessor = predecessors[j];
+        if (tree->dominators[predecessor] == -1) continue;
+        dominator = dominator == -1
+            ? predecessor : intersect(tree, predecessor, dominator);
+      }
+      if (tree->dominators[node] != dominator) {
+        tree->dominators[node] = dominator;
+        changed = true;
+      }
+    }
+  }
+
+  // Children come after their dominators in reverse postorder, so walking it
+  // backwards adds up each subtree before its root needs it.
+  tree->retained[0] = 0;
+  for (int i = 1; i < node_count; i++) {
+    tree->retained[i] = snapshot->objects[i].size;
+  }
+  for (int i = tree->order_count - 1; i > 0; i--) {
+    int node = tree->order[i];
+    tree->retained[tree->dominators[node]] += tree->retained[node];
+  }
+
+  FREE_ARRAY(int, first_predecessor, node_count + 1);
+  FREE_ARRAY(int, predecessors, edge_count);
+  FREE_ARRAY(int, filled, node_count);
+}
+
+static void free_dominators(Dominators* tree) {
+  FREE_ARRAY(int, tree->order, tree->node_count);
+  FREE_ARRAY(int, tree->order_index, tree->node_count);
+  FREE_ARRAY(int, tree->dominators, tree->node_count);
+  FREE_ARRAY(uint64_t, tree->retained, tree->node_count);
+}
+
+#define PREVIEW_LENGTH 40
+
+// Writes the start of a string or rope as a quoted literal, walking a rope’s
+// pieces left to right with an explicit stack.
+static void write_preview(Snapshot* snapshot, int number, FILE* out) {
+  int* stack = NULL;
+  int count = 0;
+  int capacity = 0;
+  int written = 0;
+
+  fputc('"', out);
+  int current = number;
+  while (written < PREVIEW_LENGTH) {
+    Snapshot_Object* object = &snapshot->objects[current];
+    if (object->type == OBJECT_ROPE) {
+      // Only a corrupt snapshot can have a rope that contains itself.
+      if (count == snapshot->object_count) break;
+
+      int* pieces = &snapshot->references[object->first_reference];
+      if (capacity < count + 1) {
+        int old_capacity = capacity;
+        capacity = GROW_CAPACITY(old_capacity);
+        stack = GROW_ARRAY(int, stack, old_capacity, capacity);
+      }
+      stack[count++] = pieces[1];
+      current = pieces[0];
+      continue;
+    }
+
+    for (uint32_t i = 0; i < object->length && written < PREVIEW_LENGTH;
+         i++, written++) {
+      unsigned char c = (unsigned char)object->chars[i];
+      if (c == '"' || c == '\\') {
+        fprintf(out, "\\%c", c);
+      } else if (c == '\n') {
+        fprintf(out, "\\n");
+      } else if (c < 0x20 || c >= 0x7f) {
+        fprintf(out, "\\x%02x", c);
+      } else {
+        fputc(c, out);
+      }
+    }
+    if (count == 0) break;
+    current = stack[--count];
+  }
+  fputc('"', out);
+  if (snapshot->objects[number].length > PREVIEW_LENGTH) fprintf(out, "...");
+
+  FREE_ARRAY(int, stack, capacity);
+}
+
+#define REPORT_LIMIT 10
+
+static int compare_contents(const void* a, const void* b) {
+  const Snapshot_Object* left = *(const Snapshot_Object* const*)a;
+  const Snapshot_Object* right = *(const Snapshot_Object* const*)b;
+  if (left->length != right->length) {
+    return left->length < right->length ? -1 : 1;
+  }
+  int order = left->length == 0
+      ? 0 : memcmp(left->chars, right->chars, left->length);
+  if (order != 0) return order;
+  // Keep the copies in snapshot order.
+  return left < right ? -1 : left > right;
+}
+
+typedef struct {
+  // The first copy.
+  Snapshot_Object* object;
+  int copies;
+  uint64_t wasted;
+} Duplicate;
+
+static int compare_duplicates(const void* a, const void* b) {
+  const Duplicate* left = (const Duplicate*)a;
+  const Duplicate* right = (const Duplicate*)b;
+  if (left->wasted != right->wasted) {
+    return left->wasted > right->wasted ? -1 : 1;
+  }
+  return left->object < right->object ? -1 : left->object > right->object;
+}
+
+static int compare_lengths(const void* a, const void* b) {
+  const Snapshot_Object* left = *(const Snapshot_Object* const*)a;
+  const Snapshot_Object* right = *(const Snapshot_Object* const*)b;
+  if (left->length != right->length) {
+    return left->length > right->length ? -1 : 1;
+  }
+  return left < right ? -1 : left > right;
+}
+
+// Only reachable flat strings are compared. A rope would have to be
+// flattened first, and its pieces are already counted as strings in their
+// own right.
+static void report_duplicates(Snapshot* snapshot, Dominators* tree,
+                              FILE* out) {
+  int count = 0;
+  Snapshot_Object** strings = ALLOCATE(Snapshot_Object*,
+                                       snapshot->object_count);
+  for (int i = 1; i <= snapshot->object_count; i++) {
+    if (snapshot->objects[i].type == OBJECT_STRING &&
+        tree->order_index[i] != -1) {
+      strings[count++] = &snapshot->objects[i];
+    }
+  }
+  qsort(strings, count, sizeof(Snapshot_Object*), compare_contents);
+
+  Duplicate* duplicates = ALLOCATE(Duplicate, count);
+  int duplicate_count = 0;
+  for (int start = 0; start < count;) {
+    int end = start + 1;
+    while (end < count && strings[end]->length == strings[start]->length &&
+           (strings[start]->length == 0 ||
+            memcmp(strings[end]->chars, strings[start]->chars,
+                   strings[start]->length) == 0)) {
+      end++;
+    }
+    if (end - start > 1) {
+      Duplicate* duplicate = &duplicates[duplicate_count++];
+      duplicate->object = strings[start];
+      duplicate->copies = end - start;
+      duplicate->wasted = 0;
+      for (int i = start + 1; i < end; i++) {
+        duplicate->wasted += strings[i]->size;
+      }
+    }
+    start = end;
+  }
+  qsort(duplicates, duplicate_count, sizeof(Duplicate), compare_duplicates);
+
+  uint64_t wasted = 0;
+  for (int i = 0; i < duplicate_count; i++) wasted += duplicates[i].wasted;
+  fprintf(out, "\nDuplicate strings: %d, wasting %llu bytes\n",
+          duplicate_count, (unsigned long long)wasted);
+  if (duplicate_count > 0) fprintf(out, "  %8s %10s\n", "Copies", "Wasted");
+  for (int i = 0; i < duplicate_count && i < REPORT_LIMIT; i++) {
+    fprintf(out, "  %8d %10llu  ", duplicates[i].copies,
+            (unsigned long long)duplicates[i].wasted);
+    write_preview(snapshot, (int)(duplicates[i].object - snapshot->objects),
+                  out);
+    fputc('\n', out);
+  }
+
+  FREE_ARRAY(Snapshot_Object*, strings, snapshot->object_count);
+  FREE_ARRAY(Duplicate, duplicates, count);
+}
+
+// Every object is a string of one kind or another.
+static void report_largest(Snapshot* snapshot, Dominators* tree, FILE* out) {
+  int count = 0;
+  Snapshot_Object** strings = ALLOCATE(Snapshot_Object*,
+                                       snapshot->object_count);
+  for (int i = 1; i <= snapshot->object_count; i++) {
+    if (tree->order_index[i] != -1) strings[count++] = &snapshot->objects[i];
+  }
+  qsort(strings, count, sizeof(Snapshot_Object*), compare_lengths);
+
+  fprintf(out, "\nLargest strings\n");
+  fprintf(out, "  %8s %10s %10s  Type\n", "Length", "Bytes", "Retained");
+  for (int i = 0; i < count && i < REPORT_LIMIT; i++) {
+    int number = (int)(strings[i] - snapshot->objects);
+    fprintf(out, "  %8lu %10lu %10llu  %-6s ",
+            (unsigned long)strings[i]->length,
+            (unsigned long)strings[i]->size,
+            (unsigned long long)tree->retained[number],
+            type_names[strings[i]->type]);
+    write_preview(snapshot, number, out);
+    fputc('\n', out);
+  }
+
+  FREE_ARRAY(Snapshot_Object*, strings, snapshot->object_count);
+}
+
+bool analyze_heap_snapshot(FILE* in, FILE* out) {
+  Snapshot snapshot;
+  if (!read_snapshot(&snapshot, in)) {
+    free_snapshot(&snapshot);
+    return false;
+  }
+
+  Dominators tree;
+  find_dominators(&snapshot, &tree);
+
+  // A type’s retained size counts the objects of that type that no other
+  // object of the type dominates, so nothing is counted twice.
+  uint64_t objects[OBJECT_TYPE_COUNT] = {0};
+  uint64_t bytes[OBJECT_TYPE_COUNT] = {0};
+  uint64_t retained[OBJECT_TYPE_COUNT] = {0};
+  uint64_t unreachable_objects = 0;
+  uint64_t unreachable_bytes = 0;
+  uint64_t total_bytes = 0;
+  for (int i = 1; i <= snapshot.object_count; i++) {
+    Snapshot_Object* object = &snapshot.objects[i];
+    total_bytes += object->size;
+    if (tree.order_index[i] == -1) {
+      unreachable_objects++;
+      unreachable_bytes += object->size;
+      continue;
+    }
+    objects[object->type]++;
+    bytes[object->type] += object->size;
+
+    int dominator = tree.dominators[i];
+    while (dominator != 0 &&
+           snapshot.objects[dominator].type != object->type) {
+      dominator = tree.dominators[dominator];
+    }
+    if (dominator == 0) retained[object->type] += tree.retained[i];
+  }
+
+  fprintf(out, "Heap snapshot: %d objects, %llu bytes, %d roots "
+          "(%d of them interned strings)\n", snapshot.object_count,
+          (unsigned long long)total_bytes,
+          snapshot.root_count + snapshot.interned_count,
+          snapshot.interned_count);
+
+  fprintf(out, "\nReachable objects by type\n");
+  fprintf(out, "  %-12s %10s %10s %10s\n",
+          "Type", "Objects", "Bytes", "Retained");
+  for (int type = 0; type < OBJECT_TYPE_COUNT; type++) {
+    fprintf(out, "  %-12s %10llu %10llu %10llu\n", type_names[type],
+            (unsigned long long)objects[type],
+            (unsigned long long)bytes[type],
+            (unsigned long long)retained[type]);
+  }
+  fprintf(out, "  %-12s %10llu %10llu\n", "unreachable",
+          (unsigned long long)unreachable_objects,
+          (unsigned long long)unreachable_bytes);
+
+  report_duplicates(&snapshot, &tree, out);
+  report_largest(&snapshot, &tree, out);
+
+  free_dominators(&tree);
+  free_snapshot(&snapshot);
+  return true;
+}
@@ -0,0 +1,46 @@
+#ifndef clox_snapshot_h
+#define clox_snapshot_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "vm.h"
+
+// Heap snapshots, for finding out what is taking up an isolate’s memory
+// after the fact.
+//
+// A snapshot is every object on the heap, and every object outside it that
+// something refers to, with its type, generation, slot size and the objects
+// it refers to, followed by the roots. Strings include their characters so
+// duplicates can be found. All numbers are little-endian:
+//
+//   "loxheap1"
+//   u32 object count, then for each object (numbered from 1):
+//     u8 type, u8 generation, u32 size, u32 length,
+//     u32 reference count, u32 object number for each reference,
+//     and for a string, `length` bytes of characters
+//   u32 root count, then for each root:
+//     u8 Snapshot_Root kind, u32 object number
+//
+// Nothing is collected first, so objects the collector hasn’t got to yet
+// are in there too, unreachable.
+
+typedef enum {
+  ROOT_STACK,
+  ROOT_GLOBAL,
+  ROOT_GLOBAL_NAME,
+  ROOT_CONSTANT,
+  // The string set is weak: these don’t keep anything alive.
+  ROOT_INTERNED,
+} Snapshot_Root;
+
+// Writes a snapshot of the isolate’s heap. Returns false if writing failed.
+// Nothing is allocated on the heap, so the collector never runs.
+bool write_heap_snapshot(VM* vm, FILE* out);
+
+// Reads a snapshot and writes a report on it: the retained size of each
+// type, duplicated strings and the largest strings. Returns false if the
+// snapshot couldn’t be read.
+bool analyze_heap_snapshot(FILE* in, FILE* out);
+
+#endif
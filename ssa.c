@@ -0,0 +1,1117 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "optimize.h"
+#include "ssa.h"
+#include "value.h"
+
+// The IR is a list of instructions, each of which makes at most one value.
+// An instruction’s index in the list is the value’s name, and its operands
+// are the names of the values it uses. Ops are the OpCodes they came from:
+//
+// - OP_CONSTANT makes a constant, nil and the Booleans included.
+// - OP_GET_LOCAL is a copy of its operand, left by reading a local.
+// - OP_SET_GLOBAL makes the value it stored, as the bytecode leaves it on
+//   the stack, which is what lowering wants it for.
+// - The rest take their operands in the order the bytecode pushes them.
+//
+// Instructions are grouped into basic blocks. A chunk has no jumps, so today
+// it is always one block, but the passes only ever look within a block.
+//
+// Passes don’t move instructions. They mark the ones they do away with as
+// removed, and say which value, made earlier, stands in for them.
+
+typedef struct {
+  uint8_t op;
+  // The global slot, for the instructions that have one.
+  uint16_t slot;
+  // For OP_CONSTANT.
+  Value constant;
+  int operands[2];
+  int operand_count;
+  // The line runtime errors report for it: that of the bytecode
+  // instruction’s last byte.
+  int line;
+  bool removed;
+  // The value that stands in for this one once it is removed, or -1.
+  int replacement;
+  // Set on the global loads lowering adds, which aren’t in any block. See
+  // reload_globals().
+  bool reload;
+} IrInstruction;
+
+typedef struct {
+  // Indexes into the instruction list, in the order they run.
+  int* instructions;
+  int count;
+  int capacity;
+} IrBlock;
+
+typedef struct {
+  IrInstruction* instructions;
+  int count;
+  int capacity;
+
+  IrBlock* blocks;
+  int block_count;
+  int block_capacity;
+
+  // One more than the highest global slot any instruction uses.
+  int global_count;
+} Ir;
+
+static void init_ir(Ir* ir) {
+  ir->instructions = NULL;
+  ir->count = 0;
+  ir->capacity = 0;
+  ir->blocks = NULL;
+  ir->block_count = 0;
+  ir->block_capacity = 0;
+  ir->global_count = 0;
+}
+
+static void free_ir(Ir* ir) {
+  for (int i = 0; i < ir->block_count; i++) {
+    IrBlock* block = &ir->blocks[i];
+    FREE_ARRAY(int, block->instructions, block->capacity);
+  }
+  FREE_ARRAY(IrBlock, ir->blocks, ir->block_capacity);
+  FREE_ARRAY(IrInstruction, ir->instructions, ir->capacity);
+}
+
+static IrBlock* new_block(Ir* ir) {
+  if (ir->block_capacity < ir->block_count + 1) {
+    int old_capacity = ir->block_capacity;
+    ir->block_capacity = GROW_CAPACITY(old_capacity);
+    ir->blocks = GROW_ARRAY(IrBlock, ir->blocks, old_capacity,
+                            ir->block_capacity);
+  }
+  IrBlock* block = &ir->blocks[ir->block_count++];
+  block->instructions = NULL;
+  block->count = 0;
+  block->capacity = 0;
+  return block;
+}
+
+// Adds an instruction with no operands to the end of a block, or to no
+// block if `block` is NULL, and returns its value.
+static int add_instruction(Ir* ir, IrBlock* block, uint8_t op, int line) {
+  if (ir->capacity < ir->count + 1) {
+    int old_capacity = ir->capacity;
+    ir->capacity = GROW_CAPACITY(old_capacity);
+    ir->instructions = GROW_ARRAY(IrInstruction, ir->instructions,
+                                  old_capacity, ir->capacity);
+  }
+  if (block != NULL && block->capacity < block->count + 1) {
+    int old_capacity = block->capacity;
+    block->capacity = GROW_CAPACITY(old_capacity);
+    block->instructions = GROW_ARRAY(int, block->instructions, old_capacity,
+                                     block->capacity);
+  }
+
+  int value = ir->count++;
+  IrInstruction* instruction = &ir->instructions[value];
+  instruction->op = op;
+  instruction->slot = 0;
+  instruction->constant = NIL_VAL;
+  instruction->operand_count = 0;
+  instruction->line = line;
+  instruction->removed = false;
+  instruction->replacement = -1;
+  instruction->reload = false;
+  if (block != NULL) block->instructions[block->count++] = value;
+  return value;
+}
+
+static int add_constant_instruction(Ir* ir, IrBlock* block, Value constant,
+                                    int line) {
+  int value = add_instruction(ir, block, OP_CONSTANT, line);
+  ir->instructions[value].constant = constant;
+  return value;
+}
+
+static void add_operand(Ir* ir, int value, int operand) {
+  IrInstruction* instruction = &ir->instructions[value];
+  instruction->operands[instruction->operand_count++] = operand;
+}
+
+// The binary operators, negation and !. They make a value from their
+// operands and nothing else, so the same operands always make the same
+// value, or the same error.
+static bool is_operator(uint8_t op) {
+  switch (op) {
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT:
+    case OP_NEGATE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Instructions that can’t fail and do nothing but make a value. Nobody
+// misses one if the value isn’t used.
+static bool is_pure(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_NOT:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool makes_value(uint8_t op) {
+  switch (op) {
+    case OP_DEFINE_GLOBAL:
+    case OP_PRINT:
+    case OP_RETURN:
+      return false;
+    default:
+      return true;
+  }
+}
+
+// Reads the chunk into a single block. Locals live on the stack, so a model
+// of the stack, holding the value in each slot, is all it takes to turn
+// them into SSA form: storing to a local puts a new value in its slot, and
+// reading one copies whatever is there. Returns false if the chunk has an
+// instruction the IR doesn’t know, which only happens to code that has
+// already been quickened.
+// Reads a global instruction’s slot, keeping count of the globals used.
+static uint16_t global_operand(Ir* ir, Chunk* chunk, int offset) {
+  uint16_t slot = GLOBAL_SLOT(&chunk->code[offset + 1]);
+  if (slot >= ir->global_count) ir->global_count = slot + 1;
+  return slot;
+}
+
+static bool build_ir(Ir* ir, Chunk* chunk) {
+  IrBlock* block = new_block(ir);
+  int stack[STACK_MAX];
+  int stack_count = 0;
+
+#define PUSH(value)                                                            \
+  do {                                                                         \
+    if (stack_count == STACK_MAX) return false;                                \
+    stack[stack_count++] = (value);                                            \
+  } while (false)
+#define POP() stack[--stack_count]
+#define LINE(length) chunk->lines[offset + (length) - 1]
+#define GLOBAL(offset) global_operand(ir, chunk, offset)
+
+  for (int offset = 0; offset < chunk->count;) {
+    uint8_t op = chunk->code[offset];
+    switch (op) {
+      case OP_CONSTANT: {
+        Value constant = chunk->constants.values[chunk->code[offset + 1]];
+        PUSH(add_constant_instruction(ir, block, constant, LINE(2)));
+        offset += 2;
+        break;
+      }
+      case OP_NIL:
+        PUSH(add_constant_instruction(ir, block, NIL_VAL, LINE(1)));
+        offset++;
+        break;
+      case OP_TRUE:
+        PUSH(add_constant_instruction(ir, block, BOOL_VAL(true), LINE(1)));
+        offset++;
+        break;
+      case OP_FALSE:
+        PUSH(add_constant_instruction(ir, block, BOOL_VAL(false), LINE(1)));
+        offset++;
+        break;
+      case OP_POP:
+        stack_count--;
+        offset++;
+        break;
+      case OP_GET_GLOBAL: {
+        int value = add_instruction(ir, block, op, LINE(3));
+        ir->instructions[value].slot = GLOBAL(offset);
+        PUSH(value);
+        offset += 3;
+        break;
+      }
+      case OP_SET_GLOBAL:
+      case OP_SET_GLOBAL_POP:
+      case OP_DEFINE_GLOBAL: {
+        uint8_t ir_op = op == OP_DEFINE_GLOBAL ? op : OP_SET_GLOBAL;
+        int value = add_instruction(ir, block, ir_op, LINE(3));
+        ir->instructions[value].slot = GLOBAL(offset);
+        add_operand(ir, value, POP());
+        if (op == OP_SET_GLOBAL) PUSH(value);
+        offset += 3;
+        break;
+      }
+      case OP_GET_LOCAL: {
+        uint8_t slot = chunk->code[offset + 1];
+        if (slot >= stack_count) return false;
+        int value = add_instruction(ir, block, op, LINE(2));
+        add_operand(ir, value, stack[slot]);
+        PUSH(value);
+        offset += 2;
+        break;
+      }
+      case OP_SET_LOCAL:
+      case OP_SET_LOCAL_POP: {
+        uint8_t slot = chunk->code[offset + 1];
+        if (slot >= stack_count - 1) return false;
+        stack[slot] = stack[stack_count - 1];
+        if (op == OP_SET_LOCAL_POP) stack_count--;
+        offset += 2;
+        break;
+      }
+      case OP_GET_LOCAL_ADD_CONST: {
+        uint8_t slot = chunk->code[offset + 1];
+        if (slot >= stack_count) return false;
+        Value constant = chunk->constants.values[chunk->code[offset + 2]];
+        int local = add_instruction(ir, block, OP_GET_LOCAL, LINE(3));
+        add_operand(ir, local, stack[slot]);
+        int right = add_constant_instruction(ir, block, constant, LINE(3));
+        int value = add_instruction(ir, block, OP_ADD, LINE(3));
+        add_operand(ir, value, local);
+        add_operand(ir, value, right);
+        PUSH(value);
+        offset += 3;
+        break;
+      }
+      case OP_NOT:
+      case OP_NEGATE:
+      case OP_PRINT: {
+        int value = add_instruction(ir, block, op, LINE(1));
+        add_operand(ir, value, POP());
+        if (op != OP_PRINT) PUSH(value);
+        offset++;
+        break;
+      }
+      case OP_RETURN:
+        add_instruction(ir, block, op, LINE(1));
+        offset++;
+        break;
+      default: {
+        if (!is_operator(op)) return false;
+        int right = POP();
+        int left = POP();
+        int value = add_instruction(ir, block, op, LINE(1));
+        add_operand(ir, value, left);
+        add_operand(ir, value, right);
+        PUSH(value);
+        offset++;
+        break;
+      }
+    }
+  }
+  return true;
+
+#undef PUSH
+#undef POP
+#undef LINE
+#undef GLOBAL
+}
+
+// Follows replacements to the value that stands in for `value`.
+static int resolve(Ir* ir, int value) {
+  while (ir->instructions[value].replacement != -1) {
+    value = ir->instructions[value].replacement;
+  }
+  return value;
+}
+
+// Points an instruction’s operands at the values that stand in for them.
+// Every pass does this before it looks at an instruction, so it sees the
+// work of the passes before it, and its own on earlier instructions.
+static IrInstruction* visit(Ir* ir, int value) {
+  IrInstruction* instruction = &ir->instructions[value];
+  for (int i = 0; i < instruction->operand_count; i++) {
+    instruction->operands[i] = resolve(ir, instruction->operands[i]);
+  }
+  return instruction;
+}
+
+static void replace(Ir* ir, int value, int replacement) {
+  ir->instructions[value].removed = true;
+  ir->instructions[value].replacement = replacement;
+}
+
+#define FOR_EACH_INSTRUCTION(ir, value)                                        \
+  for (int block_ = 0; block_ < (ir)->block_count; block_++)                   \
+    for (int index_ = 0, value;                                                \
+         index_ < (ir)->blocks[block_].count &&                                \
+         ((value) = (ir)->blocks[block_].instructions[index_], true);          \
+         index_++)                                                             \
+      if (!(ir)->instructions[value].removed)
+
+static void propagate_copies(Ir* ir) {
+  FOR_EACH_INSTRUCTION(ir, value) {
+    IrInstruction* instruction = visit(ir, value);
+    if (instruction->op == OP_GET_LOCAL) {
+      replace(ir, value, instruction->operands[0]);
+    }
+  }
+}
+
+static void fold_constants(VM* vm, Chunk* chunk, Ir* ir) {
+  FOR_EACH_INSTRUCTION(ir, value) {
+    IrInstruction* instruction = visit(ir, value);
+    if (!is_operator(instruction->op)) continue;
+
+    Value operands[2];
+    bool constant = true;
+    for (int i = 0; i < instruction->operand_count; i++) {
+      IrInstruction* operand = &ir->instructions[instruction->operands[i]];
+      if (operand->op != OP_CONSTANT) {
+        constant = false;
+        break;
+      }
+      operands[i] = operand->constant;
+    }
+
+    Value result;
+    if (constant &&
+        fold_operator(vm, chunk, instruction->op, operands, &result)) {
+      instruction->op = OP_CONSTANT;
+      instruction->constant = result;
+      instruction->operand_count = 0;
+    }
+  }
+}
+
+// Within a block, nothing but the block’s own instructions touches a
+// global. Once one has been read or stored, the next read finds that value,
+// and can’t fail: if the global weren’t defined, the first one would have.
+static void eliminate_global_loads(Ir* ir) {
+  int* known = ALLOCATE(int, ir->global_count);
+  for (int i = 0; i < ir->block_count; i++) {
+    IrBlock* block = &ir->blocks[i];
+    for (int j = 0; j < ir->global_count; j++) known[j] = -1;
+
+    for (int j = 0; j < block->count; j++) {
+      int value = block->instructions[j];
+      if (ir->instructions[value].removed) continue;
+      IrInstruction* instruction = visit(ir, value);
+
+      switch (instruction->op) {
+        case OP_GET_GLOBAL:
+          if (known[instruction->slot] != -1) {
+            replace(ir, value, known[instruction->slot]);
+          } else {
+            known[instruction->slot] = value;
+          }
+          break;
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+          known[instruction->slot] = instruction->operands[0];
+          break;
+        default:
+          break;
+      }
+    }
+  }  FREE_ARRAY(int, known, ir->global_count);
+}
+
+static uint32_t hash_operation(IrInstruction* instruction) {
+  uint32_t hash = instruction->op;
+  if (instruction->op == OP_CONSTANT) {
+    Value constant = instruction->constant;
+    uint64_t bits = 0;
+    if (IS_NUMBER(constant)) {
+      double number = AS_NUMBER(constant);
+      memcpy(&bits, &number, sizeof(double));
+    } else if (IS_OBJECT(constant)) {
+      bits = (uint64_t)(uintptr_t)AS_OBJECT(constant);
+    } else if (IS_BOOL(constant)) {
+      bits = AS_BOOL(constant) ? 2 : 1;
+    }
+    hash = (uint32_t)(bits ^ (bits >> 32)) * 16777619u;
+  }
+  for (int i = 0; i < instruction->operand_count; i++) {
+    hash = (hash ^ (uint32_t)instruction->operands[i]) * 16777619u;
+  }
+  return hash ^ (hash >> 15);
+}
+
+static bool same_operation(IrInstruction* a, IrInstruction* b) {
+  if (a->op != b->op || a->operand_count != b->operand_count) return false;
+  if (a->op == OP_CONSTANT) return same_constant(a->constant, b->constant);
+  for (int i = 0; i < a->operand_count; i++) {
+    if (a->operands[i] != b->operands[i]) return false;
+  }
+  return true;
+}
+
+// An operator applied to the same values as one before it in the block is
+// the value that one made. If the first would have been a runtime error,
+// execution never gets to the second. Constants are numbered the same way,
+// so that operators on equal ones match.
+static void eliminate_common_subexpressions(Ir* ir) {
+  for (int i = 0; i < ir->block_count; i++) {
+    IrBlock* block = &ir->blocks[i];
+
+    // An open-addressed set of the operators seen so far in the block.
+    int capacity = 8;
+    while (capacity < block->count * 2) capacity *= 2;
+    int* seen = ALLOCATE(int, capacity);
+    for (int j = 0; j < capacity; j++) seen[j] = -1;
+
+    for (int j = 0; j < block->count; j++) {
+      int value = block->instructions[j];
+      if (ir->instructions[value].removed) continue;
+      IrInstruction* instruction = visit(ir, value);
+      if (!is_operator(instruction->op) && instruction->op != OP_CONSTANT) {
+        continue;
+      }
+
+      uint32_t index = hash_operation(instruction) & (capacity - 1);
+      for (;;) {
+        if (seen[index] == -1) {
+          seen[index] = value;
+          break;
+        }
+        if (same_operation(&ir->instructions[seen[index]], instruction)) {
+          replace(ir, value, seen[index]);
+          break;
+        }
+        index = (index + 1) & (capacity - 1);
+      }
+    }
+
+    FREE_ARRAY(int, seen, capacity);
+  }
+}
+
+// Removes pure instructions whose values nothing uses, going backwards so
+// that removing one can leave its operands unused in turn. A local that is
+// stored and never read, or stored again first, is one of these: its value
+// had no user but the local.
+static void eliminate_dead_code(Ir* ir) {
+  bool* used = ALLOCATE(bool, ir->count);
+  memset(used, 0, sizeof(bool) * ir->count);
+
+  for (int i = ir->block_count - 1; i >= 0; i--) {
+    IrBlock* block = &ir->blocks[i];
+    for (int j = block->count - 1; j >= 0; j--) {
+      int value = block->instructions[j];
+      if (ir->instructions[value].removed) continue;
+      IrInstruction* instruction = visit(ir, value);
+      if (!used[value] && is_pure(instruction->op)) {
+        instruction->removed = true;
+        continue;
+      }
+      for (int k = 0; k < instruction->operand_count; k++) {
+        used[instruction->operands[k]] = true;
+      }
+    }
+  }
+
+  FREE_ARRAY(bool, used, ir->count);
+}
+
+// A value that was loaded from a global, or stored in one, is still there
+// until the global is next stored to. A slot would have to be set up to
+// hold it, but reading the global again costs no more than reading a slot,
+// and can’t fail, since the global is known to be defined. So each use of a
+// value after its first, where the value is still in a global, is given a
+// load of its own, which lowering pushes right where it is used.
+static void reload_globals(Ir* ir) {
+  int count = ir->count;
+  bool* seen = ALLOCATE(bool, count);
+  int* holders = ALLOCATE(int, count);
+  int* versions = ALLOCATE(int, count);
+  // How many times each global has been stored to. A value is still in its
+  // holder if that hasn’t changed since it was put there.
+  int* stores = ALLOCATE(int, ir->global_count);
+
+  for (int i = 0; i < ir->block_count; i++) {
+    IrBlock* block = &ir->blocks[i];
+    for (int j = 0; j < count; j++) {
+      seen[j] = false;
+      holders[j] = -1;
+    }
+    for (int j = 0; j < ir->global_count; j++) stores[j] = 0;
+
+    for (int j = 0; j < block->count; j++) {
+      int value = block->instructions[j];
+      if (ir->instructions[value].removed) continue;
+
+      // Stores below need the value stored, not a load of it.
+      int stored = ir->instructions[value].operand_count > 0
+                       ? ir->instructions[value].operands[0]
+                       : -1;
+      for (int k = 0; k < ir->instructions[value].operand_count; k++) {
+        int operand = ir->instructions[value].operands[k];
+        int holder = holders[operand];
+        if (!seen[operand] || holder == -1 ||
+            versions[operand] != stores[holder]) {
+          seen[operand] = true;
+          continue;
+        }
+        int reload = add_instruction(ir, NULL, OP_GET_GLOBAL,
+                                     ir->instructions[value].line);
+        ir->instructions[reload].slot = (uint16_t)holder;
+        ir->instructions[reload].reload = true;
+        ir->instructions[value].operands[k] = reload;
+      }
+
+      IrInstruction* instruction = &ir->instructions[value];
+      int held = -1;
+      switch (instruction->op) {
+        case OP_GET_GLOBAL:
+          held = value;
+          break;
+        case OP_SET_GLOBAL:
+          // Both the value stored and the one left on the stack are it.
+          stores[instruction->slot]++;
+          holders[value] = instruction->slot;
+          versions[value] = stores[instruction->slot];
+          held = stored;
+          break;
+        case OP_DEFINE_GLOBAL:
+          stores[instruction->slot]++;
+          held = stored;
+          break;
+        default:
+          break;
+      }
+      if (held != -1 && ir->instructions[held].op != OP_CONSTANT) {
+        holders[held] = instruction->slot;
+        versions[held] = stores[instruction->slot];
+      }
+    }
+  }
+
+  FREE_ARRAY(int, stores, ir->global_count);
+  FREE_ARRAY(int, versions, count);
+  FREE_ARRAY(int, holders, count);
+  FREE_ARRAY(bool, seen, count);
+}
+
+// Lowering turns the instructions left back into bytecode, in the order they
+// are in, so effects and errors keep theirs. Where each value lives is
+// decided first:
+//
+// - Constants are pushed again wherever they are used.
+// - A value used once is left on the stack for its user, as long as it will
+//   be right on top, under nothing but the user’s other operands, when the
+//   user comes along. That is how all of the bytecode’s own temporaries
+//   were used, so it is true of most values.
+// - Other values get a slot low down in the stack, like a local, and are
+//   pushed with OP_GET_LOCAL when they are used. A slot is given to another
+//   value once the last use of the one in it is behind.
+// - A value nothing uses, which wasn’t removed because making it can fail,
+//   is popped as soon as it is made.
+//
+// Before any of that, uses that can read a value back out of a global are
+// made to.
+typedef enum {
+  LOWER_NOTHING,
+  LOWER_CONSTANT,
+  LOWER_RELOAD,
+  LOWER_TEMPORARY,
+  LOWER_SLOT,
+  LOWER_DROPPED,
+} LowerKind;
+
+typedef struct {
+  Ir* ir;
+  // The instructions left, in order.
+  int* order;
+  int count;
+
+  // Indexed by value.
+  LowerKind* kinds;
+  int* uses;
+  int* last_use;
+  int* slots;
+  // Whether a value’s slot is the top of the stack when it is made, so it
+  // only needs leaving there.
+  bool* in_place;
+
+  // Where each value is in `order`.
+  int* positions;
+
+  // Indexed by position in `order`. How many of the instruction’s operands
+  // are already on the stack when it comes along, which are the first ones,
+  // and how many values other than slots are left under its result.
+  int* on_stack;
+  int* depth;
+  // For an instruction whose first operand is hoisted, the position it is
+  // pushed at, or else -1, or -2 if it mustn’t be. Each position has a
+  // list of the instructions whose operands are pushed there, from the last
+  // to be hoisted, which goes underneath, to the first.
+  int* hoist_start;
+  int* hoisted;
+  int* next_hoisted;
+
+  // Slots pushed by the prologue, and slots in all.
+  int reserved;
+  int height;
+
+  // The new code.
+  uint8_t* code;
+  int* lines;
+  int code_count;
+  int code_capacity;
+  int last_instruction;
+  ValueArray pool;
+  int stack_count;
+  int max_stack;
+} Lowering;
+
+// Whether `value`, a first operand that isn’t a temporary, can be pushed
+// early, at `position`, to go under a second operand that is. Constants can
+// go anywhere; a value in a slot needs to be in it by then.
+static bool can_hoist(Lowering* lowering, int value, int position) {
+  switch (lowering->kinds[value]) {
+    case LOWER_CONSTANT: return true;
+    case LOWER_SLOT:     return lowering->positions[value] < position;
+    default:             return false;
+  }
+}
+
+// Takes back the hoisting of an instruction’s first operand, for good.
+static void cancel_hoist(Lowering* lowering, int user) {
+  int* link = &lowering->hoisted[lowering->hoist_start[user]];
+  while (*link != user) link = &lowering->next_hoisted[*link];
+  *link = lowering->next_hoisted[user];
+  lowering->hoist_start[user] = -2;
+}
+
+// Works out which values can be left on the stack for their user. It
+// starts out hoping they all can and simulates the stack. When a user finds
+// a temporary operand somewhere other than on top, the operand is given a
+// slot. When its first operand isn’t a temporary but its second is, the
+// first is hoisted: pushed before the second starts being worked out, so it
+// ends up underneath, the way the bytecode had it. If a hoisted operand
+// gets in the way, that is taken back. Each time, the simulation starts
+// over. Each round gives a value a slot, hoists an operand, or takes a
+// hoist back for good, and none of those are undone, so this ends.
+static void place_temporaries(Lowering* lowering) {
+  Ir* ir = lowering->ir;
+  // The stack: temporaries by value, and hoisted operands as -1 - the
+  // position of their user. Each entry has the position where the work of
+  // putting it there starts.
+  int* entries = ALLOCATE(int, lowering->count * 2 + 1);
+  int* starts = ALLOCATE(int, lowering->count * 2 + 1);
+  bool changed;
+  do {
+    changed = false;
+    int entry_count = 0;
+    for (int i = 0; i < lowering->count && !changed; i++) {
+      for (int user = lowering->hoisted[i]; user != -1;
+           user = lowering->next_hoisted[user]) {
+        entries[entry_count] = -1 - user;
+        starts[entry_count++] = i;
+      }
+
+      int value = lowering->order[i];
+      IrInstruction* instruction = &ir->instructions[value];
+      int operands = instruction->operand_count;
+      int on_stack = 0;
+      if (lowering->hoist_start[i] >= 0) {
+        // The first operand was hoisted, so it is on the stack. If the
+        // second is a temporary, it should be right above. Anything else
+        // above them is in the way.
+        int second = instruction->operands[1];
+        on_stack = lowering->kinds[second] == LOWER_TEMPORARY ? 2 : 1;
+        int marker = entry_count - 1;
+        while (marker >= 0 && entries[marker] != -1 - i) marker--;
+        if (marker != entry_count - on_stack ||
+            (on_stack == 2 && entries[marker + 1] != second)) {
+          bool moved = false;
+          for (int j = marker + 1; marker >= 0 && j < entry_count; j++) {
+            if (j == marker + 1 && entries[j] == second) continue;
+            if (entries[j] >= 0) {
+              lowering->kinds[entries[j]] = LOWER_SLOT;
+            } else {
+              cancel_hoist(lowering, -1 - entries[j]);
+            }
+            moved = true;
+          }
+          if (!moved) cancel_hoist(lowering, i);
+          changed = true;
+        }
+      } else {
+        while (on_stack < operands &&
+               lowering->kinds[instruction->operands[on_stack]] ==
+                   LOWER_TEMPORARY) {
+          on_stack++;
+        }
+
+        if (on_stack == 0 && operands == 2 &&
+            lowering->hoist_start[i] == -1 &&
+            lowering->kinds[instruction->operands[1]] == LOWER_TEMPORARY &&
+            entry_count > 0 &&
+            entries[entry_count - 1] == instruction->operands[1] &&
+            can_hoist(lowering, instruction->operands[0],
+                      starts[entry_count - 1])) {
+          int start = starts[entry_count - 1];
+          lowering->hoist_start[i] = start;
+          lowering->next_hoisted[i] = lowering->hoisted[start];
+          lowering->hoisted[start] = i;
+          changed = true;
+        }
+
+        // A temporary after an operand that is pushed at the last moment
+        // would be under it.
+        for (int j = on_stack; j < operands && !changed; j++) {
+          int operand = instruction->operands[j];
+          if (lowering->kinds[operand] == LOWER_TEMPORARY) {
+            lowering->kinds[operand] = LOWER_SLOT;
+            changed = true;
+          }
+        }
+
+        bool on_top = entry_count >= on_stack;
+        for (int j = 0; on_top && j < on_stack; j++) {
+          on_top = entries[entry_count - on_stack + j] ==
+                   instruction->operands[j];
+        }
+        if (!on_top && !changed) {
+          for (int j = 0; j < on_stack; j++) {
+            lowering->kinds[instruction->operands[j]] = LOWER_SLOT;
+          }
+          changed = true;
+        }
+      }
+      if (changed) break;
+
+      entry_count -= on_stack;
+      int start = on_stack > 0 ? starts[entry_count] : i;
+      lowering->on_stack[i] = on_stack;
+      lowering->depth[i] = entry_count;
+      if (lowering->kinds[value] == LOWER_TEMPORARY) {
+        entries[entry_count] = value;
+        starts[entry_count++] = start;
+      }
+    }
+  } while (changed);
+  FREE_ARRAY(int, starts, lowering->count * 2 + 1);
+  FREE_ARRAY(int, entries, lowering->count * 2 + 1);
+}
+
+// Gives each value that needs one a slot, with `reserved` slots pushed by a
+// prologue to start with. A value that is made with temporaries on the
+// stack can’t push a slot of its own, and needs a free one. Returns false
+// if there isn’t one, so the caller can try again with more reserved.
+static bool assign_slots(Lowering* lowering, int reserved) {
+  Ir* ir = lowering->ir;
+  int free_slots[UINT8_COUNT];
+  int free_count = 0;
+  for (int slot = reserved - 1; slot >= 0; slot--) {
+    free_slots[free_count++] = slot;
+  }
+  int height = reserved;
+
+  for (int i = 0; i < lowering->count; i++) {
+    int value = lowering->order[i];
+    IrInstruction* instruction = &ir->instructions[value];
+
+    // The operands are pushed before the result is stored, so a slot whose
+    // last use is this instruction can take its result.
+    for (int j = 0; j < instruction->operand_count; j++) {
+      int operand = instruction->operands[j];
+      if (lowering->kinds[operand] != LOWER_SLOT ||
+          lowering->last_use[operand] != i) {
+        continue;
+      }
+      if (j == 1 && instruction->operands[0] == operand) continue;
+      free_slots[free_count++] = lowering->slots[operand];
+    }
+
+    if (lowering->kinds[value] != LOWER_SLOT) continue;
+    if (free_count > 0) {
+      lowering->slots[value] = free_slots[--free_count];
+      lowering->in_place[value] = false;
+    } else if (lowering->depth[i] == 0 && height < UINT8_COUNT) {
+      lowering->slots[value] = height++;
+      lowering->in_place[value] = true;
+    } else {
+      return false;
+    }
+  }
+
+  lowering->reserved = reserved;
+  lowering->height = height;
+  return true;
+}
+
+static void emit_byte(Lowering* lowering, uint8_t byte, int line) {
+  if (lowering->code_capacity < lowering->code_count + 1) {
+    int old_capacity = lowering->code_capacity;
+    lowering->code_capacity = GROW_CAPACITY(old_capacity);
+    lowering->code = GROW_ARRAY(uint8_t, lowering->code, old_capacity,
+                                lowering->code_capacity);
+    lowering->lines = GROW_ARRAY(int, lowering->lines, old_capacity,
+                                 lowering->code_capacity);
+  }
+  lowering->code[lowering->code_count] = byte;
+  lowering->lines[lowering->code_count] = line;
+  lowering->code_count++;
+}
+
+// Emits an instruction that leaves the stack `effect` values higher.
+static void emit_instruction(Lowering* lowering, uint8_t op, int operand,
+                             int line, int effect) {
+  lowering->last_instruction = lowering->code_count;
+  emit_byte(lowering, op, line);
+  if (operand != -1) emit_byte(lowering, (uint8_t)operand, line);
+
+  lowering->stack_count += effect;
+  if (lowering->stack_count > lowering->max_stack) {
+    lowering->max_stack = lowering->stack_count;
+  }
+}
+
+static void emit_global(Lowering* lowering, uint8_t op, uint16_t slot,
+                        int line, int effect) {
+  emit_instruction(lowering, op, slot >> 8, line, effect);
+  emit_byte(lowering, (uint8_t)(slot & 0xff), line);
+}
+
+static int pool_index(Lowering* lowering, Value value) {
+  int index = pool_constant(&lowering->pool, value);
+  // Too many for a byte is caught once lowering is done.
+  return index < UINT8_COUNT ? index : 0;
+}
+
+static void push_operand(Lowering* lowering, int value, int line) {
+  IrInstruction* instruction = &lowering->ir->instructions[value];
+  if (lowering->kinds[value] == LOWER_RELOAD) {
+    emit_global(lowering, OP_GET_GLOBAL, instruction->slot, line, 1);
+    return;
+  }
+  if (lowering->kinds[value] == LOWER_CONSTANT) {
+    Value constant = instruction->constant;
+    if (IS_NIL(constant)) {
+      emit_instruction(lowering, OP_NIL, -1, line, 1);
+    } else if (IS_BOOL(constant)) {
+      emit_instruction(lowering, AS_BOOL(constant) ? OP_TRUE : OP_FALSE, -1,
+                       line, 1);
+    } else {
+      emit_instruction(lowering, OP_CONSTANT, pool_index(lowering, constant),
+                       line, 1);
+    }
+    return;
+  }
+
+  // Storing a value and reading it straight back is the same as storing it
+  // without the pop.
+  int slot = lowering->slots[value];
+  if (lowering->code_count > 0 &&
+      lowering->code[lowering->last_instruction] == OP_SET_LOCAL_POP &&
+      lowering->code[lowering->last_instruction + 1] == slot) {
+    lowering->code[lowering->last_instruction] = OP_SET_LOCAL;
+    lowering->stack_count++;
+    return;
+  }
+  emit_instruction(lowering, OP_GET_LOCAL, slot, line, 1);
+}
+
+static void lower_instruction(Lowering* lowering, int position) {
+  Ir* ir = lowering->ir;
+  int value = lowering->order[position];
+  IrInstruction* instruction = &ir->instructions[value];
+  int line = instruction->line;
+  LowerKind kind = lowering->kinds[value];
+  int on_stack = lowering->on_stack[position];
+  int operands = instruction->operand_count;
+  // Constants are pushed where they are used.
+  if (kind == LOWER_CONSTANT) return;
+
+  if (instruction->op == OP_ADD && on_stack == 0 &&
+      lowering->kinds[instruction->operands[0]] == LOWER_SLOT &&
+      lowering->kinds[instruction->operands[1]] == LOWER_CONSTANT) {
+    Value constant = ir->instructions[instruction->operands[1]].constant;
+    emit_instruction(lowering, OP_GET_LOCAL_ADD_CONST,
+                     lowering->slots[instruction->operands[0]], line, 1);
+    emit_byte(lowering, (uint8_t)pool_index(lowering, constant), line);
+  } else {
+    for (int i = on_stack; i < operands; i++) {
+      push_operand(lowering, instruction->operands[i], line);
+    }
+
+    switch (instruction->op) {
+      case OP_GET_GLOBAL:
+        emit_global(lowering, OP_GET_GLOBAL, instruction->slot, line, 1);
+        break;
+      case OP_SET_GLOBAL:
+        if (kind == LOWER_DROPPED) {
+          emit_global(lowering, OP_SET_GLOBAL_POP, instruction->slot, line,
+                      -1);
+          return;
+        }
+        emit_global(lowering, OP_SET_GLOBAL, instruction->slot, line, 0);
+        break;
+      case OP_DEFINE_GLOBAL:
+        emit_global(lowering, OP_DEFINE_GLOBAL, instruction->slot, line, -1);
+        break;
+      case OP_RETURN:
+        // Leave the stack as empty as the compiler does.
+        for (int i = 0; i < lowering->height; i++) {
+          emit_instruction(lowering, OP_POP, -1, line, -1);
+        }
+        emit_instruction(lowering, OP_RETURN, -1, line, 0);
+        break;
+      default:
+        emit_instruction(lowering, instruction->op, -1, line,
+                         makes_value(instruction->op) ? 1 - operands
+                                                      : -operands);
+        break;
+    }
+  }
+
+  if (kind == LOWER_DROPPED) {
+    emit_instruction(lowering, OP_POP, -1, line, -1);
+  } else if (kind == LOWER_SLOT && !lowering->in_place[value]) {
+    emit_instruction(lowering, OP_SET_LOCAL_POP, lowering->slots[value], line,
+                     -1);
+  }
+}
+
+// Lowers the IR into new code and a new pool, and writes them over the
+// chunk’s. Returns false, leaving the chunk alone, if they wouldn’t fit.
+static bool lower(Ir* ir, Chunk* chunk) {
+  reload_globals(ir);
+
+  Lowering lowering;
+  lowering.ir = ir;
+  lowering.order = ALLOCATE(int, ir->count);
+  lowering.count = 0;
+  FOR_EACH_INSTRUCTION(ir, value) {
+    lowering.order[lowering.count++] = value;
+  }
+
+  lowering.kinds = ALLOCATE(LowerKind, ir->count);
+  lowering.uses = ALLOCATE(int, ir->count);
+  lowering.last_use = ALLOCATE(int, ir->count);
+  lowering.slots = ALLOCATE(int, ir->count);
+  lowering.in_place = ALLOCATE(bool, ir->count);
+  lowering.positions = ALLOCATE(int, ir->count);
+  lowering.on_stack = ALLOCATE(int, lowering.count);
+  lowering.depth = ALLOCATE(int, lowering.count);
+  lowering.hoist_start = ALLOCATE(int, lowering.count);
+  lowering.hoisted = ALLOCATE(int, lowering.count);
+  lowering.next_hoisted = ALLOCATE(int, lowering.count);
+  for (int i = 0; i < ir->count; i++) {
+    lowering.uses[i] = 0;
+    if (ir->instructions[i].reload) lowering.kinds[i] = LOWER_RELOAD;
+  }
+  for (int i = 0; i < lowering.count; i++) {
+    lowering.positions[lowering.order[i]] = i;
+    lowering.hoist_start[i] = -1;
+    lowering.hoisted[i] = -1;
+    IrInstruction* instruction = &ir->instructions[lowering.order[i]];
+    for (int j = 0; j < instruction->operand_count; j++) {
+      lowering.uses[instruction->operands[j]]++;
+      lowering.last_use[instruction->operands[j]] = i;
+    }
+  }
+  for (int i = 0; i < lowering.count; i++) {
+    int value = lowering.order[i];
+    IrInstruction* instruction = &ir->instructions[value];
+    if (!makes_value(instruction->op)) {
+      lowering.kinds[value] = LOWER_NOTHING;
+    } else if (instruction->op == OP_CONSTANT) {
+      lowering.kinds[value] = LOWER_CONSTANT;
+    } else if (lowering.uses[value] == 0) {
+      lowering.kinds[value] = LOWER_DROPPED;
+    } else if (lowering.uses[value] == 1) {
+      lowering.kinds[value] = LOWER_TEMPORARY;
+    } else {
+      lowering.kinds[value] = LOWER_SLOT;
+    }
+  }
+
+  place_temporaries(&lowering);
+  bool fits = false;
+  for (int reserved = 0; reserved <= UINT8_COUNT; reserved++) {
+    if (assign_slots(&lowering, reserved)) {
+      fits = true;
+      break;
+    }
+  }
+
+  lowering.code = NULL;
+  lowering.lines = NULL;
+  lowering.code_count = 0;
+  lowering.code_capacity = 0;
+  lowering.last_instruction = 0;
+  init_value_array(&lowering.pool);
+  lowering.stack_count = 0;
+  lowering.max_stack = 0;
+
+  if (fits) {
+    int line = ir->instructions[lowering.order[0]].line;
+    for (int i = 0; i < lowering.reserved; i++) {
+      emit_instruction(&lowering, OP_NIL, -1, line, 1);
+    }
+    for (int i = 0; i < lowering.count; i++) {
+      for (int user = lowering.hoisted[i]; user != -1;
+           user = lowering.next_hoisted[user]) {
+        IrInstruction* instruction = &ir->instructions[lowering.order[user]];
+        push_operand(&lowering, instruction->operands[0], instruction->line);
+      }
+      lower_instruction(&lowering, i);
+    }
+    fits = lowering.max_stack <= STACK_MAX &&
+           lowering.pool.count <= UINT8_COUNT;
+  }
+
+  if (fits) {
+    chunk->count = 0;
+    for (int i = 0; i < lowering.code_count; i++) {
+      write_chunk(chunk, lowering.code[i], lowering.lines[i]);
+    }
+    // Every constant the new code pushes is in the old pool, which folding
+    // added its results to, so the new pool is never the bigger one. Nothing
+    // is allocated here, so the collector can’t see the others go.
+    if (lowering.pool.count > 0) {
+      memcpy(chunk->constants.values, lowering.pool.values,
+             sizeof(Value) * lowering.pool.count);
+    }
+    chunk->constants.count = lowering.pool.count;
+  }
+
+  free_value_array(&lowering.pool);
+  FREE_ARRAY(uint8_t, lowering.code, lowering.code_capacity);
+  FREE_ARRAY(int, lowering.lines, lowering.code_capacity);
+  FREE_ARRAY(int, lowering.depth, lowering.count);
+  FREE_ARRAY(int, lowering.next_hoisted, lowering.count);
+  FREE_ARRAY(int, lowering.hoisted, lowering.count);
+  FREE_ARRAY(int, lowering.hoist_start, lowering.count);
+  FREE_ARRAY(int, lowering.on_stack, lowering.count);
+  FREE_ARRAY(bool, lowering.in_place, ir->count);
+  FREE_ARRAY(int, lowering.positions, ir->count);
+  FREE_ARRAY(int, lowering.slots, ir->count);
+  FREE_ARRAY(int, lowering.last_use, ir->count);
+  FREE_ARRAY(int, lowering.uses, ir->count);
+  FREE_ARRAY(LowerKind, lowering.kinds, ir->count);
+  FREE_ARRAY(int, lowering.order, ir->count);
+  return fits;
+}
+
+void ssa_optimize_chunk(VM* vm, Chunk* chunk) {
+  Ir ir;
+  init_ir(&ir);
+  if (build_ir(&ir, chunk)) {
+    propagate_copies(&ir);
+    eliminate_global_loads(&ir);
+    fold_constants(vm, chunk, &ir);
+    eliminate_common_subexpressions(&ir);
+    eliminate_dead_code(&ir);
+    lower(&ir, chunk);
+  }
+  free_ir(&ir);
+}
@@ -0,0 +1,32 @@
+#ifndef clox_ssa_h
+#define clox_ssa_h
+
+#include "chunk.h"
+#include "vm.h"
+
+// The middle end behind -O2. It reads a finished chunk into a small SSA
+// form, where every value is made by exactly one instruction and locals are
+// just names for values, runs these passes over it and lowers what is left
+// back to bytecode:
+//
+// - Copy propagation: reading a local is the value last stored in it.
+// - Constant folding, as in optimize.c.
+// - Redundant global-load elimination: a global read again before anything
+//   stores to it is the value read or stored last.
+// - Common-subexpression elimination: an operator applied again to the same
+//   values is the value it made the first time.
+// - Dead-store elimination: a value stored in a local that nobody reads is
+//   never made, unless making it could be a runtime error.
+//
+// Locals don’t survive lowering. Values used more than once get stack slots
+// of their own, or are read from their global again if it still holds them,
+// and the rest are left on the stack for their one user.
+// Runtime errors happen in the same order, with the same messages and lines,
+// as without -O2.
+//
+// If the result wouldn’t fit the VM’s stack or a chunk’s constant pool, the
+// chunk is left as it was. Folding strings interns new ones in the isolate,
+// which may collect, so the chunk must be the isolate’s compiling_chunk.
+void ssa_optimize_chunk(VM* vm, Chunk* chunk);
+
+#endif
@@ -0,0 +1,99 @@
+// flockfile() is POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+
+#include "debug.h"
+#include "stats.h"
+#include "vm.h"
+
+#ifdef STATS
+
+static const char* object_type_names[OBJECT_TYPE_COUNT] = {
+  [OBJECT_STRING] = "string",
+  [OBJECT_ROPE]   = "rope",
+};
+
+static const char* probe_bucket_names[PROBE_BUCKETS] = {
+  "1", "2", "3-4", "5-8", "9-16", "17-32", "33-64", "65+",
+};
+
+void init_stats(Stats* stats) {
+  *stats = (Stats){0};
+}
+
+void enable_stats(VM* vm) {
+  vm->stats_enabled = true;
+  vm->strings.stats = &vm->stats.strings;
+  vm->global_slots.stats = &vm->stats.globals;
+}
+
+// Writes a string as a JSON string literal.
+static void write_json_string(const char* string, FILE* out) {
+  fputc('"', out);
+  for (const char* c = string; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(out, "\\%c", *c);
+    } else if ((unsigned char)*c < 0x20) {
+      fprintf(out, "\\u%04x", *c);
+    } else {
+      fputc(*c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static void write_table_json(const char* name, TableStats* table, FILE* out) {
+  fprintf(out, "\"%s\": {\"lookups\": %" PRIu64 ", \"resizes\": %" PRIu64
+          ", \"probe_lengths\": {", name, table->lookups, table->resizes);
+  for (int i = 0; i < PROBE_BUCKETS; i++) {
+    fprintf(out, "%s\"%s\": %" PRIu64, i == 0 ? "" : ", ",
+            probe_bucket_names[i], table->probes[i]);
+  }
+  fprintf(out, "}}");
+}
+
+void write_stats_json(VM* vm, const char* script, FILE* out) {
+  Stats* stats = &vm->stats;
+  flockfile(out);
+  fputc('{', out);
+  if (script != NULL) {
+    fprintf(out, "\"script\": ");
+    write_json_string(script, out);
+    fprintf(out, ", ");
+  }
+
+  fprintf(out, "\"objects\": {");
+  for (int type = 0; type < OBJECT_TYPE_COUNT; type++) {
+    uint64_t allocated = stats->objects_allocated[type];
+    uint64_t freed = stats->objects_freed[type];
+    uint64_t bytes_allocated = stats->bytes_allocated[type];
+    uint64_t bytes_freed = stats->bytes_freed[type];
+    fprintf(out, "%s\"%s\": {\"allocated\": %" PRIu64 ", \"freed\": %" PRIu64
+            ", \"live\": %" PRIu64 ", \"bytes_allocated\": %" PRIu64
+            ", \"bytes_freed\": %" PRIu64 ", \"live_bytes\": %" PRIu64 "}",
+            type == 0 ? "" : ", ", object_type_names[type], allocated, freed,
+            allocated - freed, bytes_allocated, bytes_freed,
+            bytes_allocated - bytes_freed);
+  }
+
+  fprintf(out, "}, \"interning\": {\"hits\": %" PRIu64 ", \"misses\": %"
+          PRIu64 "}, \"tables\": {", stats->intern_hits, stats->intern_misses);
+  write_table_json("strings", &stats->strings, out);
+  fprintf(out, ", ");
+  write_table_json("globals", &stats->globals, out);
+
+  fprintf(out, "}, \"instructions\": %" PRIu64 ", \"peak_stack_depth\": %d"
+          ", \"quickening\": {", stats->instructions, stats->peak_stack_depth);
+  // Builds without QUICKENING (see common.h) report zeros.
+  for (int i = 0; i < quickened_opcode_count; i++) {
+    uint8_t opcode = quickened_opcodes[i].opcode;
+    fprintf(out, "%s\"%s\": {\"quickened\": %d, \"deoptimized\": %d}",
+            i == 0 ? "" : ", ", quickened_opcodes[i].name,
+            vm->quickenings[opcode], vm->deoptimizations[opcode]);
+  }
+  fprintf(out, "}}\n");
+  funlockfile(out);
+}
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef clox_stats_h
+#define clox_stats_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// Counters for what an isolate has been doing, for hosts that want to watch
+// a VM in production. They are compiled in unless NO_STATS is defined (see
+// common.h), and even then they only count for isolates that turned them on
+// with enable_stats(). Everywhere a counter is bumped, that costs one test of
+// a flag the isolate already has in cache.
+
+#define OBJECT_TYPE_COUNT (OBJECT_ROPE + 1)
+
+// Probe lengths are bucketed by powers of two: 1, 2, 3-4, 5-8, ... and
+// everything from 65 up in the last bucket. A Table built as a Swiss table
+// (see table.c) counts a probe per group of sixteen entries it looks at.
+#define PROBE_BUCKETS 8
+
+typedef struct {
+  uint64_t lookups;
+  uint64_t probes[PROBE_BUCKETS];
+  uint64_t resizes;
+} TableStats;
+
+typedef struct {
+  // By Object_Type. Bytes are whole heap slots, so the bytes still
+  // allocated are the heap space live objects take up.
+  uint64_t objects_allocated[OBJECT_TYPE_COUNT];
+  uint64_t objects_freed[OBJECT_TYPE_COUNT];
+  uint64_t bytes_allocated[OBJECT_TYPE_COUNT];
+  uint64_t bytes_freed[OBJECT_TYPE_COUNT];
+
+  // copy_string() calls that found the string already interned, and those
+  // that had to make it.
+  uint64_t intern_hits;
+  uint64_t intern_misses;
+
+  TableStats strings;
+  TableStats globals;
+
+  // Instructions the interpreter dispatched, and the most values it had on
+  // the stack at once. Code the JIT runs doesn’t count.
+  uint64_t instructions;
+  int peak_stack_depth;
+} Stats;
+
+#ifdef STATS
+
+#define COUNT_STAT(vm, counter, amount)                                        \
+  do {                                                                         \
+    if ((vm)->stats_enabled) (vm)->stats.counter += (amount);                  \
+  } while (false)
+
+static inline void count_probes(TableStats* stats, int probes) {
+  int bucket = 0;
+  while (bucket < PROBE_BUCKETS - 1 && probes > (1 << bucket)) bucket++;
+  stats->lookups++;
+  stats->probes[bucket]++;
+}
+
+void init_stats(Stats* stats);
+// Starts counting for an isolate.
+void enable_stats(VM* vm);
+// Writes the isolate’s counters so far as one line of JSON. If `script` isn’t
+// NULL it is included, to tell apart the reports of a batch.
+void write_stats_json(VM* vm, const char* script, FILE* out);
+
+#else
+
+#define COUNT_STAT(vm, counter, amount) do { } while (false)
+
+#endif
+
+#endif
@@ -5,85 +5,376 @@
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef SWISS_TABLE_SSE2
+#include <emmintrin.h>
+#endif
 
 void init_table(Table* table) {
   table->count = 0;
   table->capacity = 0;
+#ifdef SWISS_TABLE
+  table->control = NULL;
+#endif
   table->entries = NULL;
+  table->values = NULL;
+#ifdef STATS
+  table->stats = NULL;
+#endif
 }
 
-Object_String* table_find_string(Table* table, const char* chars, int length, uint32_t hash) {
-  if (table->count == 0) return NULL;
-  uint32_t index = hash % table->capacity;
+// Counts a lookup that looked at `probes` entries, if the table is being
+// watched.
+#ifdef STATS
+#define COUNT_PROBES(stats, probes)                                            \
+  do {                                                                         \
+    if ((stats) != NULL) count_probes((stats), (probes));                      \
+  } while (false)
+#else
+#define COUNT_PROBES(stats, probes) ((void)(stats), (void)(probes))
+#endif
 
-  for (;;) {
-    Entry* entry = &table->entries[index];
-    if (entry->key == NULL) {
-      // Stop if we find an empty non-tombstone entry
-      if (IS_NIL(entry->value)) return NULL;
-    } else if(entry->key->length == length && entry->key->hash == hash &&
-        memcmp(entry->key->chars, chars, length) == 0) {
-      // We found it
-      return entry->key;
+// The stats a lookup in the table counts towards.
+#ifdef STATS
+#define TABLE_STATS(table) ((table)->stats)
+#else
+#define TABLE_STATS(table) NULL
+#endif
+
+#ifdef SWISS_TABLE
+
+// A Swiss table, after the ones in Google’s Abseil library.
+//
+// Every entry has a control byte that says whether it is empty, deleted or
+// full, and for a full entry holds the top seven bits of the key’s hash. The
+// entries are split into groups of sixteen. A key’s hash picks the group its
+// probe starts in, and a probe compares the key’s seven bits with all sixteen
+// control bytes of a group at once. Only the entries that match are looked
+// at, and a group with an empty entry in it ends the probe. With seven bits
+// to match on, a lookup rarely looks at an entry other than its own, and one
+// group absorbs most collisions, so the table can run much fuller than a
+// linearly probed one before probes get long.
+//
+// When the groups a probe walks through are full it moves on to the next by
+// ever larger steps (1, 2, 3, ...). With a power-of-two number of groups,
+// that visits every group before coming back to the first.
+
+#define GROUP_WIDTH 16
+
+// Full entries have the top bit clear.
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+
+#define TABLE_MAX_LOAD 0.875
+
+// The hash bits kept in a full entry’s control byte. The low bits pick the
+// group, so these come from the other end.
+static inline uint8_t control_tag(uint32_t hash) {
+  return (uint8_t)(hash >> 25);
+}
+
+// Matching a group gives a mask with bit i set for each of its entries i
+// that match.
+typedef uint32_t GroupMask;
+
+static inline int lowest_bit(GroupMask mask) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctz(mask);
+#else
+  int index = 0;
+  while ((mask & 1) == 0) {
+    mask >>= 1;
+    index++;
+  }
+  return index;
+#endif
+}
+
+#ifdef SWISS_TABLE_SSE2
+
+static inline GroupMask match_tag(const uint8_t* group, uint8_t tag) {
+  __m128i control = _mm_loadu_si128((const __m128i*)group);
+  __m128i tags = _mm_set1_epi8((char)tag);
+  return (GroupMask)_mm_movemask_epi8(_mm_cmpeq_epi8(control, tags));
+}
+
+static inline GroupMask match_empty(const uint8_t* group) {
+  return match_tag(group, CONTROL_EMPTY);
+}
+
+// Empty and deleted are the control bytes with the top bit set, which is
+// just what movemask collects.
+static inline GroupMask match_free(const uint8_t* group) {
+  __m128i control = _mm_loadu_si128((const __m128i*)group);
+  return (GroupMask)_mm_movemask_epi8(control);
+}
+
+#else
+
+// The portable version works on the group as two 64-bit words, eight control
+// bytes in each, with the usual bit tricks for testing every byte at once.
+// Byte i of the group has to be the ith lowest byte of its word. On a
+// little-endian machine a plain load does that; elsewhere the bytes are put
+// together by hand.
+
+#define LOW_BITS 0x0101010101010101u
+#define HIGH_BITS 0x8080808080808080u
+
+static inline uint64_t load_word(const uint8_t* bytes) {
+  uint64_t word;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(&word, bytes, sizeof(word));
+#else
+  word = 0;
+  for (int i = 0; i < 8; i++) word |= (uint64_t)bytes[i] << (8 * i);
+#endif
+  return word;
+}
+
+// Gathers the top bit of each byte (and only those may be set) into the low
+// eight bits.
+static inline GroupMask pack_bytes(uint64_t high_bits) {
+  return (GroupMask)(((high_bits >> 7) * 0x0102040810204080u) >> 56);
+}
+
+// Sets the top bit of each zero byte. A byte just above a zero byte can be
+// flagged too, if it is 0x01. That can only cost an extra key comparison.
+static inline uint64_t zero_bytes(uint64_t word) {
+  return (word - LOW_BITS) & ~word & HIGH_BITS;
+}
+
+static inline GroupMask match_tag(const uint8_t* group, uint8_t tag) {
+  uint64_t tags = LOW_BITS * tag;
+  return pack_bytes(zero_bytes(load_word(group) ^ tags)) |
+         pack_bytes(zero_bytes(load_word(group + 8) ^ tags)) << 8;
+}
+
+// Of the bytes with the top bit set, empty is the only one with bit 1 clear.
+static inline GroupMask match_empty_word(uint64_t word) {
+  return pack_bytes(word & (~word << 6) & HIGH_BITS);
+}
+
+static inline GroupMask match_empty(const uint8_t* group) {
+  return match_empty_word(load_word(group)) |
+         match_empty_word(load_word(group + 8)) << 8;
+}
+
+static inline GroupMask match_free(const uint8_t* group) {
+  return pack_bytes(load_word(group) & HIGH_BITS) |
+         pack_bytes(load_word(group + 8) & HIGH_BITS) << 8;
+}
+
+#endif
+
+// Returns the index of the key’s entry or, if it isn’t there, of the first
+// free entry on its probe. That is where the key belongs. A probe counts as
+// one per group it looks at.
+static int find_entry(Table* table, Object_String* key, TableStats* stats) {
+  uint32_t group_mask = (uint32_t)(table->capacity / GROUP_WIDTH) - 1;
+  uint32_t group = key->hash & group_mask;
+  uint8_t tag = control_tag(key->hash);
+  int free_entry = -1;
+  int probes = 1;
+
+  for (uint32_t step = 1;; step++) {
+    const uint8_t* control = &table->control[group * GROUP_WIDTH];
+    GroupMask matches = match_tag(control, tag);
+    while (matches != 0) {
+      int index = (int)(group * GROUP_WIDTH) + lowest_bit(matches);
+      if (table->entries[index].key == key) {
+        COUNT_PROBES(stats, probes);
+        return index;
+      }
+      matches &= matches - 1;
+    }
+
+    if (free_entry == -1) {
+      GroupMask free = match_free(control);
+      if (free != 0) free_entry = (int)(group * GROUP_WIDTH) + lowest_bit(free);
+    }
+    // The key would have gone in the empty entry if it were in the table.
+    if (match_empty(control) != 0) {
+      COUNT_PROBES(stats, probes);
+      return free_entry;
+    }
+
+    group = (group + step) & group_mask;
+    probes++;
+  }
+}
+
+// Puts an entry that isn’t in the table yet into the first free entry on its
+// probe.
+static void place_entry(Table* table, int index, Entry entry) {
+  table->control[index] = control_tag(entry.hash);
+  table->entries[index] = entry;
+}
+
+// Rebuilds the table at a new capacity, leaving the deleted entries behind.
+static void adjust_capacity(Table* table, int capacity) {
+  Table old = *table;
+  table->control = ALLOCATE(uint8_t, capacity);
+  table->entries = ALLOCATE(Entry, capacity);
+  table->values = ALLOCATE(Value, capacity);
+  table->capacity = capacity;
+  for (int i = 0; i < capacity; i++) {
+    table->control[i] = CONTROL_EMPTY;
+    table->entries[i].key = NULL;
+  }
+
+  // The new table has no keys yet, so an entry goes where its probe first
+  // finds room, and the key itself never has to be looked at.
+  uint32_t group_mask = (uint32_t)(capacity / GROUP_WIDTH) - 1;
+  table->count = 0;
+  for (int i = 0; i < old.capacity; i++) {
+    if (old.entries[i].key == NULL) continue;
+
+    uint32_t group = old.entries[i].hash & group_mask;
+    GroupMask free = match_free(&table->control[group * GROUP_WIDTH]);
+    for (uint32_t step = 1; free == 0; step++) {
+      group = (group + step) & group_mask;
+      free = match_free(&table->control[group * GROUP_WIDTH]);
     }
+    int index = (int)(group * GROUP_WIDTH) + lowest_bit(free);
+    place_entry(table, index, old.entries[i]);
+    table->values[index] = old.values[i];
+    table->count++;
+  }
+
+  FREE_ARRAY(uint8_t, old.control, old.capacity);
+  FREE_ARRAY(Entry, old.entries, old.capacity);
+  FREE_ARRAY(Value, old.values, old.capacity);
+#ifdef STATS
+  if (table->stats != NULL) table->stats->resizes++;
+#endif
+}
+
+bool table_set(Table* table, Object_String* key, Value value) {
+  // Even at the maximum load, a group of sixteen always has an empty entry
+  // to end probes.
+  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+    int capacity = table->capacity < GROUP_WIDTH ? GROUP_WIDTH
+                                                 : table->capacity * 2;
+    adjust_capacity(table, capacity);
+  }
+
+  int index = find_entry(table, key, TABLE_STATS(table));
+  bool is_new_key = table->entries[index].key != key;
+  if (is_new_key) {
+    if (table->control[index] == CONTROL_EMPTY) table->count++;
+    place_entry(table, index, (Entry){key, key->hash});
+  }
+  table->values[index] = value;
+  return is_new_key;
+}
+
+bool table_get(Table* table, Object_String* key, Value* value) {
+  if (table->count == 0) return false;
+
+  int index = find_entry(table, key, TABLE_STATS(table));
+  if (table->entries[index].key != key) return false;
+
+  *value = table->values[index];
+  return true;
+}
 
-    index = (index + 1) % table->capacity;
+bool table_delete(Table* table, Object_String* key) {
+  if (table->count == 0) return false;
+
+  int index = find_entry(table, key, TABLE_STATS(table));
+  if (table->entries[index].key != key) return false;
+
+  // A probe only ever moves past a group with no empty entries. If this
+  // group still has one, no probe has gone through it, so nothing needs a
+  // tombstone here and the entry can simply be empty again.
+  int group = index - index % GROUP_WIDTH;
+  if (match_empty(&table->control[group]) != 0) {
+    table->control[index] = CONTROL_EMPTY;
+    table->count--;
+  } else {
+    table->control[index] = CONTROL_DELETED;
   }
+  table->entries[index].key = NULL;
+  return true;
 }
 
-static Entry* find_entry(Entry* entries, int capacity, Object_String* key) {
-  uint32_t index = key->hash % capacity;
-  Entry* tombstone = NULL;
+#else
+
+// Plain linear probing: a probe walks the entries one at a time from where
+// the key’s hash lands until it finds the key or an empty entry.
+
+#define TABLE_MAX_LOAD 0.75
+
+// Returns the index of the key’s entry, or of the entry it belongs in if it
+// isn’t there.
+static int find_entry(Entry* entries, int capacity, Object_String* key,
+                      TableStats* stats) {
+  uint32_t mask = (uint32_t)capacity - 1;
+  uint32_t index = key->hash & mask;
+  int tombstone = -1;
+  int probes = 1;
 
   for (;;) {
     Entry* entry = &entries[index];
+    if (entry->key == key) {
+      // We found the key
+      COUNT_PROBES(stats, probes);
+      return (int)index;
+    }
     if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
+      if (entry->hash == TABLE_EMPTY) {
         // Empty entry
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        // We found a tombstone
-        if (tombstone == NULL) tombstone = entry;
+        COUNT_PROBES(stats, probes);
+        return tombstone != -1 ? tombstone : (int)index;
       }
-    } else if (entry->key == key) {
-      // We found the key
-      return entry;
+      // We found a tombstone
+      if (tombstone == -1) tombstone = (int)index;
     }
 
-    index = (index + 1) % capacity;
+    index = (index + 1) & mask;
+    probes++;
   }
 }
 
-// To choose the bucket for each entry, we take its hash key modulo
-// the array size. That means that when the array size changes, entries may end up
+// To choose the bucket for each entry, we mask its hash key with the array
+// size. That means that when the array size changes, entries may end up
 // in different buckets
 //
 // Those new buckets may have new collisions that we need to deal with. So the
 // simplest way to get every entry where it belongs is to rebuild the table from
-// scratch by re-inserting every entry into the new empty array.
+// scratch by re-inserting every entry into the new empty array. The hashes
+// are right there in the entries, and the new array has neither tombstones
+// nor duplicate keys, so re-inserting is just a walk to the next empty
+// entry.
 static void adjust_capacity(Table* table, int capacity) {
   Entry* entries = ALLOCATE(Entry, capacity);
+  Value* values = ALLOCATE(Value, capacity);
   for (int i = 0; i < capacity; i++) {
     entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
+    entries[i].hash = TABLE_EMPTY;
   }
 
+  uint32_t mask = (uint32_t)capacity - 1;
   table->count = 0;
   for (int i = 0; i < table->capacity; i++) {
     Entry* entry = &table->entries[i];
     if (entry->key == NULL) continue;
 
-    Entry* dest = find_entry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
+    uint32_t index = entry->hash & mask;
+    while (entries[index].key != NULL) index = (index + 1) & mask;
+    entries[index] = *entry;
+    values[index] = table->values[i];
     table->count++;
   }
 
   FREE_ARRAY(Entry, table->entries, table->capacity);
+  FREE_ARRAY(Value, table->values, table->capacity);
 
-  table ->entries = entries;
+  table->entries = entries;
+  table->values = values;
   table->capacity = capacity;
+#ifdef STATS
+  if (table->stats != NULL) table->stats->resizes++;
+#endif
 }
 
 // This function adds the given key/value pair to the given hash table. If an entry
@@ -93,43 +384,36 @@ bool table_set(Table* table, Object_String* key, Value value) {
 
   // This is how we manage the table’s load factor. We don’t
   // grow when the capacity is completely full. Instead, we grow the array before
-  // then, when the array becomes at least 75% full.
+  // then, when the array becomes at least 75% full. GROW_CAPACITY() keeps
+  // doubling from 8, so the capacity stays a power of two.
   if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
     int capacity = GROW_CAPACITY(table->capacity);
     adjust_capacity(table, capacity);
   }
 
-  Entry* entry = find_entry(table->entries, table->capacity, key);
+  int index = find_entry(table->entries, table->capacity, key,
+                         TABLE_STATS(table));
+  Entry* entry = &table->entries[index];
   bool is_new_key = entry->key == NULL;
-  if (is_new_key && IS_NIL(entry->value)) table->count++;
+  if (is_new_key && entry->hash == TABLE_EMPTY) table->count++;
 
   entry->key = key;
-  entry->value = value;
+  entry->hash = key->hash;
+  table->values[index] = value;
   return is_new_key;
 }
 
-// It walks the bucket array of the source hash table.
-// Whenever it finds a non-empty bucket, it adds the entry to the
-// destination hash table using the table_set() function. (@SEE_FUNCTION :: table_set)
-void table_add_all(Table* from, Table* to) {
-  for (int i = 0; i < from->capacity; i++) {
-    Entry* entry = &from->entries[i];
-    if (entry->key != NULL) {
-      table_set(to, entry->key, entry->value) ;
-    }
-  }
-}
-
 // You pass in a table and a key. If it finds an entry with that key, it returns
 // true, otherwise it returns false. If the entry exists, the value output
 // parameter points to the resulting value.
 bool table_get(Table* table, Object_String* key, Value* value) {
   if (table->count == 0) return false;
 
-  Entry* entry = find_entry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  int index = find_entry(table->entries, table->capacity, key,
+                         TABLE_STATS(table));
+  if (table->entries[index].key == NULL) return false;
 
-  *value = entry->value;
+  *value = table->values[index];
   return true;
 }
 
@@ -137,16 +421,40 @@ bool table_delete(Table* table, Object_String* key) {
   if (table->count == 0) return false;
 
   // Find the entry
-  Entry* entry = find_entry(table->entries, table->capacity, key);
+  int index = find_entry(table->entries, table->capacity, key,
+                         TABLE_STATS(table));
+  Entry* entry = &table->entries[index];
   if (entry->key == NULL) return false;
 
   // Place a tombstone in the entry
   entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  entry->hash = TABLE_TOMBSTONE;
   return true;
 }
 
+#endif
+
+// It walks the bucket array of the source hash table.
+// Whenever it finds a non-empty bucket, it adds the entry to the
+// destination hash table using the table_set() function. (@SEE_FUNCTION :: table_set)
+void table_add_all(Table* from, Table* to) {
+  for (int i = 0; i < from->capacity; i++) {
+    Entry* entry = &from->entries[i];
+    if (entry->key != NULL) {
+      table_set(to, entry->key, from->values[i]) ;
+    }
+  }
+}
+
 void free_table(Table* table) {
+#ifdef SWISS_TABLE
+  FREE_ARRAY(uint8_t, table->control, table->capacity);
+  table->control = NULL;
+#endif
   FREE_ARRAY(Entry, table->entries, table->capacity);
-  init_table(table);
+  FREE_ARRAY(Value, table->values, table->capacity);
+  table->count = 0;
+  table->capacity = 0;
+  table->entries = NULL;
+  table->values = NULL;
 }
@@ -2,17 +2,41 @@
 #define lox_table_h
 
 #include "common.h"
+#include "stats.h"
 #include "value.h"
 
+// The keys and their hashes are kept together, and the values in an array of
+// their own alongside. A probe only walks the entries, so the values don’t
+// dilute the cache lines it touches, and growing the table never has to
+// follow a key pointer to find its hash.
+//
+// With SWISS_TABLE (see common.h), a third array holds a control byte for
+// every entry, and probes look at the control bytes sixteen at a time (see
+// table.c). Otherwise an entry with no key is empty or, if its hash is
+// TABLE_TOMBSTONE, a tombstone left behind by a deletion.
 typedef struct {
   Object_String* key;
-  Value value;
+  uint32_t hash;
 } Entry;
 
+#define TABLE_EMPTY 0
+#define TABLE_TOMBSTONE 1
+
+// The capacity is always a power of two, so a hash is turned into an index
+// with a mask rather than a division.
 typedef struct {
+  // Keys plus tombstones, which both count against the load factor.
   int count;
   int capacity;
+#ifdef SWISS_TABLE
+  uint8_t* control;
+#endif
   Entry* entries;
+  Value* values;
+#ifdef STATS
+  // Where to count lookups, or NULL. Freeing the table keeps it.
+  TableStats* stats;
+#endif
 } Table;
 
 void init_table(Table* table);
@@ -21,6 +45,5 @@ bool table_set(Table* table, Object_String* key, Value value);
 void table_add_all(Table* from, Table* to);
 bool table_get(Table* table, Object_String* key, Value* value);
 bool table_delete(Table* table, Object_String* key);
-Object_String* table_find_string(Table* table, const char* chars, int length, uint32_t hash);
 
 #endif
@@ -20,6 +20,19 @@ void write_value_array(ValueArray* array, Value value) {
 }
 
 void print_value(Value value) {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value)) {
+    printf(AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    printf("nil");
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_OBJECT(value)) {
+    print_object(value);
+  } else if (IS_UNDEFINED(value)) {
+    printf("<undefined>");
+  }
+#else
   switch (value.type) {
     case VAL_OBJECT:
       print_object(value); break;
@@ -28,18 +41,35 @@ void print_value(Value value) {
       break;
     case VAL_NIL: printf("nil"); break;
     case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+    case VAL_UNDEFINED: printf("<undefined>"); break;
   }
+#endif
 }
 
 bool values_equal(Value a, Value b) {
+#ifdef NAN_BOXING
+  // Comparing the bits is enough for everything except numbers, where IEEE
+  // says NaN != NaN even when the bits match.
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+  if (a == b) return true;
+  // Only the compiler’s strings are interned. Ropes and strings made at
+  // runtime can equal a different object with the same characters.
+  return IS_ANY_STRING(a) && IS_ANY_STRING(b) &&
+         strings_equal(AS_OBJECT(a), AS_OBJECT(b));
+#else
   if (a.type != b.type) return false;
   switch (a.type) {
-    case VAL_OBJECT:  return AS_OBJECT(a) == AS_OBJECT(b);
+    // Every object is a string of some kind.
+    case VAL_OBJECT:  return strings_equal(AS_OBJECT(a), AS_OBJECT(b));
     case VAL_BOOL:    return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL:     return true;
     case VAL_NUMBER:  return AS_NUMBER(a) == AS_NUMBER(b);
+    case VAL_UNDEFINED: return true;
     default:          return false; // Unreachable
   }
+#endif
 }
 
 void free_value_array(ValueArray* array) {
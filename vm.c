@@ -1,10 +1,15 @@
+// flockfile() is POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
 #include "vm.h"
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
+#include "program.h"
 #include "table.h"
 #include "value.h"
 
@@ -13,63 +18,108 @@
 #include <stdarg.h>
 #include <string.h>
 
-VM vm;
+static void reset_stack(VM* vm) { vm->stack_top = vm->stack; }
+
+void init_vm(VM* vm) { 
+  reset_stack(vm);
+  vm->chunk = NULL;
+  vm->compiling_chunk = NULL;
 
-static void reset_stack() { vm.stack_top = vm.stack; }
+  init_heap(&vm->heap);
+  vm->gray_stack = NULL;
+  vm->gray_capacity = 0;
+  vm->gc_white = 0;
+  vm->gc_nursery_size = GC_NURSERY_SIZE;
+  vm->gc_min_heap_size = GC_MIN_HEAP_SIZE;
+  vm->gc_heap_growth = GC_HEAP_GROWTH;
+  vm->gc_threads = 1;
+  vm->gc_stress = false;
+  vm->gc_enabled = true;
+#ifdef STATS
+  vm->stats_enabled = false;
+  init_stats(&vm->stats);
+#endif
+  // Sets up the rest of the collector’s state.
+  free_objects(vm);
+
+  init_table(&vm->global_slots);
+  init_value_array(&vm->global_values);
+  init_value_array(&vm->global_names);
+  init_intern_set(&vm->strings);
+  memset(vm->quickenings, 0, sizeof(vm->quickenings));
+  memset(vm->deoptimizations, 0, sizeof(vm->deoptimizations));
+  vm->jit_enabled = false;
+  vm->optimize = 0;
+  init_chunk(&vm->program_chunk);
+}
 
-void init_vm() { 
-  reset_stack();
-  vm.objects = NULL;
-  init_table(&vm.globals);
-  init_table(&vm.strings);
+void free_vm(VM* vm) {
+#ifdef DEBUG_PRINT_QUICKENING
+  print_quickening_stats(vm);
+#endif
+  free_table(&vm->global_slots);
+  free_value_array(&vm->global_values);
+  free_value_array(&vm->global_names);
+  free_intern_set(&vm->strings);
+  free_objects(vm);
+  FREE_ARRAY(Object*, vm->gray_stack, vm->gray_capacity);
+  // Only the code is the isolate’s own; the rest belongs to the program.
+  FREE_ARRAY(uint8_t, vm->program_chunk.code, vm->program_chunk.capacity);
 }
 
-void free_vm() {
-  free_table(&vm.globals);
-  free_table(&vm.strings);
-  free_objects();
+void push(VM* vm, Value value) {
+  *vm->stack_top = value;
+  vm->stack_top++;
 }
 
-void push(Value value) {
-  *vm.stack_top = value;
-  vm.stack_top++;
+Value pop(VM* vm) {
+  vm->stack_top--;
+  return *vm->stack_top;
 }
 
-Value pop() {
-  vm.stack_top--;
-  return *vm.stack_top;
+// The operands stay on the stack until the result is made, so the collector
+// can’t free them in the meantime.
+void concatenate(VM* vm) {
+  Object* result = concatenate_strings(vm, AS_OBJECT(vm->stack_top[-2]),
+                                       AS_OBJECT(vm->stack_top[-1]));
+  vm->stack_top -= 2;
+  push(vm, OBJECT_VAL(result));
 }
 
-static Value peek(int distance) {
-  return vm.stack_top[-1 - distance];
+// Returns the slot of the global variable with the given name, handing out a
+// fresh undefined slot the first time a name is seen.
+int global_slot(VM* vm, Object_String* name) {
+  Value slot;
+  if (table_get(&vm->global_slots, name, &slot)) {
+    return (int)AS_NUMBER(slot);
+  }
+
+  int index = vm->global_values.count;
+  write_value_array(&vm->global_values, UNDEFINED_VAL);
+  write_value_array(&vm->global_names, OBJECT_VAL(name));
+  table_set(&vm->global_slots, name, NUMBER_VAL((double)index));
+  return index;
 }
 
-// First, we calculate the length of the result string based on
-// the lengths of the operands. We allocate a character array for
-// the result and then copy the two halves in.
-static void concatenate() {
-  Object_String* b = AS_STRING(pop());
-  Object_String* a = AS_STRING(pop());
-
-  int length = a->length + b->length;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-
-  Object_String* object = take_string(chars, length);
-  push(OBJECT_VAL(object));
+// Prints a value for a print statement. Isolates on other threads may be
+// printing at the same time, so the value and its newline are written under
+// one lock on stdout to keep each line in one piece.
+void print_line(Value value) {
+  flockfile(stdout);
+  print_value(value);
+  putchar('\n');
+  funlockfile(stdout);
 }
 
 //  nil and false are falsey and every other value behaves like true.
-static bool is_falsey(Value value) {
+bool is_falsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
 // the ... and va_list stuff let us pass an arbitrary number of arguments
 // to runtimeError(). It forwards those on to vfprintf(), which is the
 // flavor of printf() that takes an explicit va_list.
-static void runtime_error(const char* format, ...) {
+void runtime_error(VM* vm, const char* format, ...) {
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
@@ -81,106 +131,238 @@ static void runtime_error(const char* format, ...) {
   // instruction index minus one. That’s because the interpreter advances
   // past each instruction before executing it. So, at the point that we
   // call runtimeError(), the failed instruction is the previous one.
-  size_t instruction = vm.ip - vm.chunk->code - 1;
-  int line = vm.chunk->lines[instruction];
+  size_t instruction = vm->ip - vm->chunk->code - 1;
+  int line = vm->chunk->lines[instruction];
   fprintf(stderr, "[line %d] in script\n", line);
-  reset_stack();
+  reset_stack(vm);
 }
 
 // We have an outer loop that goes and goes.
 // Each turn through that loop, we read and execute a single bytecode
 // instruction.
 //
-// we have a single giant switch statement with a case for each opcode.
-// The body of each case implements that opcode’s behavior.
-static InterpretResult run() {
+// The portable engine is a single giant switch statement with a case for each
+// opcode. The body of each case implements that opcode’s behavior. Every
+// opcode funnels back through the same indirect jump at the top of the switch,
+// so the CPU’s branch predictor only ever sees one branch site.
+//
+// When THREADED_DISPATCH is defined (see common.h) we instead use the
+// labels-as-values extension of GCC and Clang: each handler ends by jumping
+// straight to the handler of the next instruction through dispatch_table. That
+// gives every opcode its own indirect branch, which predicts far better.
+//
+// ip and stack_top are cached in locals so the compiler can keep them in
+// registers. Anything that reads them through the global vm (push(), pop(),
+// concatenate(), runtime_error()) must be bracketed by STORE_FRAME() and
+// LOAD_FRAME().
+static InterpretResult run(VM* vm) {
+  uint8_t* ip = vm->ip;
+  Value* stack_top = vm->stack_top;
+#ifdef STATS
+  bool stats_enabled = vm->stats_enabled;
+#endif
 
 // Note that ip advances as soon as we read the opcode, before we’ve actually
 // started executing the instruction. So, again, ip points to the next
 // byte of code to be used.
-#define READ_BYTE() (*vm.ip++)
+#define READ_BYTE() (*ip++)
+
+// reads the next byte from the bytecode, treats the resulting number as an
+// index, and looks up the corresponding Value in the chunk’s constant table.
+#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
+// Reads a global’s two-byte slot, high byte first.
+#define READ_SHORT() (ip += 2, GLOBAL_SLOT(ip - 2))
+#define GLOBAL_NAME(slot) AS_STRING(vm->global_names.values[slot])
+
+#define PUSH(value) (*stack_top++ = (value))
+#define POP() (*--stack_top)
+#define PEEK(distance) (stack_top[-1 - (distance)])
+
+#define STORE_FRAME() (vm->ip = ip, vm->stack_top = stack_top)
+#define LOAD_FRAME() (ip = vm->ip, stack_top = vm->stack_top)
+
+// Quickening rewrites the instruction being executed (the byte just behind
+// ip) into a form specialized for the operand types we just saw. If a
+// specialized instruction later meets operands it can’t handle, it puts the
+// generic opcode back and backs ip up so that the generic handler runs next.
+// Without QUICKENING (see common.h), nothing ever gets specialized.
+#ifdef QUICKENING
+#define QUICKEN(op) (ip[-1] = (op), vm->quickenings[op]++)
+#else
+#define QUICKEN(op) do { } while (false)
+#endif
+#define DEOPTIMIZE(op) (vm->deoptimizations[ip[-1]]++, ip[-1] = (op), ip--)
+
+#define BOTH_NUMBERS() (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+
+#define NUMBER_OP(value_type, op)                                              \
+  do {                                                                         \
+    double b = AS_NUMBER(POP());                                               \
+    double a = AS_NUMBER(POP());                                               \
+    PUSH(value_type(a op b));                                                  \
+  } while (false)
 
-#define BINARY_OP(value_type, op)                                                          \
+#define CHECK_NUMBERS()                                                        \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      runtime_error("Operands must be numbers.");                              \
+    if (!BOTH_NUMBERS()) {                                                     \
+      STORE_FRAME();                                                           \
+      runtime_error(vm, "Operands must be numbers.");                          \
       return INTERPRET_RUNTIME_ERROR;                                          \
     }                                                                          \
-    double b = AS_NUMBER(pop());                                                          \
-    double a = AS_NUMBER(pop());                                                          \
-    push(value_type(a op b));                                                              \
   } while (false)
 
-// reads the next byte from the bytecode, treats the resulting number as an
-// index, and looks up the corresponding Value in the chunk’s constant table.
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-
-  for (;;) {
+#define BINARY_OP(value_type, op)                                              \
+  do {                                                                         \
+    CHECK_NUMBERS();                                                           \
+    NUMBER_OP(value_type, op);                                                 \
+  } while (false)
 
 #ifdef DEBUG_TRACE_EXECUTION
-    //  show the current contents of the stack before we interpret each
-    //  instruction.
-    printf(" ");
-    for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
-      printf("[");
-      print_value(*slot);
-      printf("]");
-    }
-    printf("\n");
-    // Since disassemble_instruction() takes an integer byte offset and we store
-    // the current instruction reference as a direct pointer, we first do a
-    // little pointer math to convert ip back to a relative offset from the
-    // beginning of the bytecode.
-    disassemble_instruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+//  show the current contents of the stack before we interpret each
+//  instruction.
+//
+// Since disassemble_instruction() takes an integer byte offset and we store
+// the current instruction reference as a direct pointer, we first do a
+// little pointer math to convert ip back to a relative offset from the
+// beginning of the bytecode.
+#define TRACE_INSTRUCTION()                                                    \
+  do {                                                                         \
+    printf(" ");                                                               \
+    for (Value* slot = vm->stack; slot < stack_top; slot++) {                  \
+      printf("[");                                                             \
+      print_value(*slot);                                                      \
+      printf("]");                                                             \
+    }                                                                          \
+    printf("\n");                                                              \
+    disassemble_instruction(vm, vm->chunk, (int)(ip - vm->chunk->code));       \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
+
+// Counts every dispatch, a deoptimized instruction’s second go included,
+// and the deepest the stack has been at the start of one.
+#ifdef STATS
+#define COUNT_INSTRUCTION()                                                    \
+  do {                                                                         \
+    if (stats_enabled) {                                                       \
+      int depth = (int)(stack_top - vm->stack);                                \
+      vm->stats.instructions++;                                                \
+      if (depth > vm->stats.peak_stack_depth) {                                \
+        vm->stats.peak_stack_depth = depth;                                    \
+      }                                                                        \
+    }                                                                          \
+  } while (false)
+#else
+#define COUNT_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef THREADED_DISPATCH
+  static void* dispatch_table[] = {
+    [OP_CONSTANT]      = &&label_OP_CONSTANT,
+    [OP_NIL]           = &&label_OP_NIL,
+    [OP_TRUE]          = &&label_OP_TRUE,
+    [OP_FALSE]         = &&label_OP_FALSE,
+    [OP_POP]           = &&label_OP_POP,
+    [OP_GET_GLOBAL]    = &&label_OP_GET_GLOBAL,
+    [OP_SET_GLOBAL]    = &&label_OP_SET_GLOBAL,
+    [OP_GET_LOCAL]     = &&label_OP_GET_LOCAL,
+    [OP_SET_LOCAL]     = &&label_OP_SET_LOCAL,
+    [OP_DEFINE_GLOBAL] = &&label_OP_DEFINE_GLOBAL,
+    [OP_EQUAL]         = &&label_OP_EQUAL,
+    [OP_GREATER]       = &&label_OP_GREATER,
+    [OP_LESS]          = &&label_OP_LESS,
+    [OP_ADD]           = &&label_OP_ADD,
+    [OP_SUBTRACT]      = &&label_OP_SUBTRACT,
+    [OP_MULTIPLY]      = &&label_OP_MULTIPLY,
+    [OP_DIVIDE]        = &&label_OP_DIVIDE,
+    [OP_NOT]           = &&label_OP_NOT,
+    [OP_NEGATE]        = &&label_OP_NEGATE,
+    [OP_PRINT]         = &&label_OP_PRINT,
+    [OP_RETURN]        = &&label_OP_RETURN,
+    [OP_NOT_EQUAL]     = &&label_OP_NOT_EQUAL,
+    [OP_GREATER_EQUAL] = &&label_OP_GREATER_EQUAL,
+    [OP_LESS_EQUAL]    = &&label_OP_LESS_EQUAL,
+    [OP_GET_LOCAL_ADD_CONST] = &&label_OP_GET_LOCAL_ADD_CONST,
+    [OP_SET_LOCAL_POP]  = &&label_OP_SET_LOCAL_POP,
+    [OP_SET_GLOBAL_POP] = &&label_OP_SET_GLOBAL_POP,
+    [OP_ADD_NUM]       = &&label_OP_ADD_NUM,
+    [OP_ADD_STR]       = &&label_OP_ADD_STR,
+    [OP_SUBTRACT_NUM]  = &&label_OP_SUBTRACT_NUM,
+    [OP_MULTIPLY_NUM]  = &&label_OP_MULTIPLY_NUM,
+    [OP_DIVIDE_NUM]    = &&label_OP_DIVIDE_NUM,
+    [OP_GREATER_NUM]   = &&label_OP_GREATER_NUM,
+    [OP_LESS_NUM]      = &&label_OP_LESS_NUM,
+  };
+
+#define OPCODE(name) label_##name:
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_INSTRUCTION();                                                       \
+    COUNT_INSTRUCTION();                                                       \
+    goto *dispatch_table[READ_BYTE()];                                         \
+  } while (false)
+
+  DISPATCH();
+#else
+#define OPCODE(name) case name:
+#define DISPATCH() break
+
+  for (;;) {
+    TRACE_INSTRUCTION();
+    COUNT_INSTRUCTION();
+    switch (READ_BYTE()) {
 #endif
 
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-      case OP_ADD: {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-          concatenate();
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          double b = AS_NUMBER(pop());
-          double a = AS_NUMBER(pop());
-          push(NUMBER_VAL(a + b));
+      OPCODE(OP_ADD) {
+        if (IS_ANY_STRING(PEEK(0)) && IS_ANY_STRING(PEEK(1))) {
+          QUICKEN(OP_ADD_STR);
+          STORE_FRAME();
+          concatenate(vm);
+          LOAD_FRAME();
+        } else if (BOTH_NUMBERS()) {
+          QUICKEN(OP_ADD_NUM);
+          NUMBER_OP(NUMBER_VAL, +);
         } else {
-          runtime_error("Operands must be two numbers or two strings.");
+          STORE_FRAME();
+          runtime_error(vm, "Operands must be two numbers or two strings.");
           return INTERPRET_RUNTIME_ERROR;
         }
-        break;
+        DISPATCH();
       }
-      case OP_CONSTANT: {
+      OPCODE(OP_CONSTANT) {
         Value constant = READ_CONSTANT();
-        push(constant);
-        print_value(constant);
-        printf("\n");
-        break;
+        PUSH(constant);
+        DISPATCH();
       }
-      case OP_NIL:      push(NIL_VAL); break;
-      case OP_TRUE:     push(BOOL_VAL(true)); break;
-      case OP_FALSE:    push(BOOL_VAL(false)); break;
-      case OP_POP:      pop(); break;
-      case OP_SET_GLOBAL: {
-        Object_String* name = READ_STRING();
-        if (table_set(&vm.globals, name, peek(0))) {
-          table_delete(&vm.globals, name);
-          runtime_error("undefined variable '%s'.");
+      OPCODE(OP_NIL)      { PUSH(NIL_VAL); DISPATCH(); }
+      OPCODE(OP_TRUE)     { PUSH(BOOL_VAL(true)); DISPATCH(); }
+      OPCODE(OP_FALSE)    { PUSH(BOOL_VAL(false)); DISPATCH(); }
+      OPCODE(OP_POP)      { stack_top--; DISPATCH(); }
+      OPCODE(OP_SET_GLOBAL) {
+        uint16_t slot = READ_SHORT();
+        if (IS_UNDEFINED(vm->global_values.values[slot])) {
+          STORE_FRAME();
+          runtime_error(vm, "Undefined variable '%s'.",
+                        GLOBAL_NAME(slot)->chars);
           return INTERPRET_RUNTIME_ERROR;
-          break;
         }
+        vm->global_values.values[slot] = PEEK(0);
+        DISPATCH();
       }
-      case OP_GET_GLOBAL: {
-        Object_String* name = READ_STRING();
-        Value value;
-        if (!table_get(&vm.globals, name, &value)) {
-          runtime_error("Undefined variable '%s'.", name->chars);
+      OPCODE(OP_GET_GLOBAL) {
+        uint16_t slot = READ_SHORT();
+        Value value = vm->global_values.values[slot];
+        if (IS_UNDEFINED(value)) {
+          STORE_FRAME();
+          runtime_error(vm, "Undefined variable '%s'.",
+                        GLOBAL_NAME(slot)->chars);
           return INTERPRET_RUNTIME_ERROR;
         }
-        push(value);
-        break;
+        PUSH(value);
+        DISPATCH();
       }
-      case OP_GET_LOCAL: {
+      OPCODE(OP_GET_LOCAL) {
         // It seems redundant to push the local’s value onto the stack since it’s already
         // on the stack lower down somewhere. The problem is that the other bytecode
         // instructions only look for data at the top of the stack. This is the core
@@ -188,62 +370,177 @@ static InterpretResult run() {
         // Register-based bytecode instruction sets avoid this stack juggling at the
         // cost of having larger instructions with more operands.
         uint8_t slot = READ_BYTE();
-        push(vm.stack[slot]);
-        break;
+        PUSH(vm->stack[slot]);
+        DISPATCH();
       }
-      case OP_SET_LOCAL: {
+      OPCODE(OP_SET_LOCAL) {
         // It takes the assigned value from the top of the stack and stores it in the stack
         // slot corresponding to the local variable. Note that it doesn’t pop the value
         // from the stack. Remember, assignment is an expression, and every expression
         // produces a value. The value of an assignment expression is the assigned value
         // itself, so the VM just leaves the value on the stack.
         uint8_t slot = READ_BYTE();
-        vm.stack[slot] = peek(0);
-        break;
+        vm->stack[slot] = PEEK(0);
+        DISPATCH();
       }
-      case OP_DEFINE_GLOBAL: {
-        Object_String* name = READ_STRING();
-        table_set(&vm.globals, name, peek(0));
-        pop();
-        break;
+      OPCODE(OP_DEFINE_GLOBAL) {
+        uint16_t slot = READ_SHORT();
+        vm->global_values.values[slot] = PEEK(0);
+        stack_top--;
+        DISPATCH();
       }
-      case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-      case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-      case OP_NOT:      push(BOOL_VAL(is_falsey(pop()))); break;
-      case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-      case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
-      case OP_EQUAL: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(values_equal(a, b)));
-        break;
+      OPCODE(OP_SUBTRACT) { BINARY_OP(NUMBER_VAL, -); QUICKEN(OP_SUBTRACT_NUM); DISPATCH(); }
+      OPCODE(OP_MULTIPLY) { BINARY_OP(NUMBER_VAL, *); QUICKEN(OP_MULTIPLY_NUM); DISPATCH(); }
+      OPCODE(OP_DIVIDE)   { BINARY_OP(NUMBER_VAL, /); QUICKEN(OP_DIVIDE_NUM); DISPATCH(); }
+      OPCODE(OP_NOT)      { PEEK(0) = BOOL_VAL(is_falsey(PEEK(0))); DISPATCH(); }
+      OPCODE(OP_GREATER)  { BINARY_OP(BOOL_VAL, >); QUICKEN(OP_GREATER_NUM); DISPATCH(); }
+      OPCODE(OP_LESS)     { BINARY_OP(BOOL_VAL, <); QUICKEN(OP_LESS_NUM); DISPATCH(); }
+      OPCODE(OP_EQUAL) {
+        Value b = POP();
+        Value a = POP();
+        PUSH(BOOL_VAL(values_equal(a, b)));
+        DISPATCH();
       }
-      case OP_NEGATE: {
-        if (!IS_NUMBER(peek(0))) {
-          runtime_error("Operand must be a number");
+      OPCODE(OP_NEGATE) {
+        if (!IS_NUMBER(PEEK(0))) {
+          STORE_FRAME();
+          runtime_error(vm, "Operand must be a number");
           return INTERPRET_RUNTIME_ERROR;
         }
 
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
-        break;
+        PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+        DISPATCH();
       }
-      case OP_PRINT: {
-        print_value(pop());
-        printf("\n");
-        break;
+      OPCODE(OP_PRINT) {
+        print_line(POP());
+        DISPATCH();
       }
-      case OP_RETURN: {
+      OPCODE(OP_RETURN) {
         // Exit interpreter
+        STORE_FRAME();
         return INTERPRET_OK;
       }
+      OPCODE(OP_NOT_EQUAL) {
+        Value b = POP();
+        Value a = POP();
+        PUSH(BOOL_VAL(!values_equal(a, b)));
+        DISPATCH();
+      }
+      // a >= b and a <= b are compiled as !(a < b) and !(a > b), so they
+      // keep that meaning when a NaN is involved.
+      OPCODE(OP_GREATER_EQUAL) {
+        CHECK_NUMBERS();
+        double b = AS_NUMBER(POP());
+        double a = AS_NUMBER(POP());
+        PUSH(BOOL_VAL(!(a < b)));
+        DISPATCH();
+      }
+      OPCODE(OP_LESS_EQUAL) {
+        CHECK_NUMBERS();
+        double b = AS_NUMBER(POP());
+        double a = AS_NUMBER(POP());
+        PUSH(BOOL_VAL(!(a > b)));
+        DISPATCH();
+      }
+      OPCODE(OP_GET_LOCAL_ADD_CONST) {
+        Value a = vm->stack[READ_BYTE()];
+        Value b = READ_CONSTANT();
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {
+          PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+        } else if (IS_ANY_STRING(a) && IS_ANY_STRING(b)) {
+          PUSH(a);
+          PUSH(b);
+          STORE_FRAME();
+          concatenate(vm);
+          LOAD_FRAME();
+        } else {
+          STORE_FRAME();
+          runtime_error(vm, "Operands must be two numbers or two strings.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        DISPATCH();
+      }
+      OPCODE(OP_SET_LOCAL_POP) {
+        uint8_t slot = READ_BYTE();
+        vm->stack[slot] = POP();
+        DISPATCH();
+      }
+      OPCODE(OP_SET_GLOBAL_POP) {
+        uint16_t slot = READ_SHORT();
+        if (IS_UNDEFINED(vm->global_values.values[slot])) {
+          STORE_FRAME();
+          runtime_error(vm, "Undefined variable '%s'.",
+                        GLOBAL_NAME(slot)->chars);
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        vm->global_values.values[slot] = POP();
+        DISPATCH();
+      }
+      OPCODE(OP_ADD_NUM) {
+        if (!BOTH_NUMBERS()) { DEOPTIMIZE(OP_ADD); DISPATCH(); }
+        NUMBER_OP(NUMBER_VAL, +);
+        DISPATCH();
+      }
+      OPCODE(OP_ADD_STR) {
+        if (!IS_ANY_STRING(PEEK(0)) || !IS_ANY_STRING(PEEK(1))) {
+          DEOPTIMIZE(OP_ADD);
+          DISPATCH();
+        }
+        STORE_FRAME();
+        concatenate(vm);
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      OPCODE(OP_SUBTRACT_NUM) {
+        if (!BOTH_NUMBERS()) { DEOPTIMIZE(OP_SUBTRACT); DISPATCH(); }
+        NUMBER_OP(NUMBER_VAL, -);
+        DISPATCH();
+      }
+      OPCODE(OP_MULTIPLY_NUM) {
+        if (!BOTH_NUMBERS()) { DEOPTIMIZE(OP_MULTIPLY); DISPATCH(); }
+        NUMBER_OP(NUMBER_VAL, *);
+        DISPATCH();
+      }
+      OPCODE(OP_DIVIDE_NUM) {
+        if (!BOTH_NUMBERS()) { DEOPTIMIZE(OP_DIVIDE); DISPATCH(); }
+        NUMBER_OP(NUMBER_VAL, /);
+        DISPATCH();
+      }
+      OPCODE(OP_GREATER_NUM) {
+        if (!BOTH_NUMBERS()) { DEOPTIMIZE(OP_GREATER); DISPATCH(); }
+        NUMBER_OP(BOOL_VAL, >);
+        DISPATCH();
+      }
+      OPCODE(OP_LESS_NUM) {
+        if (!BOTH_NUMBERS()) { DEOPTIMIZE(OP_LESS); DISPATCH(); }
+        NUMBER_OP(BOOL_VAL, <);
+        DISPATCH();
+      }
+
+#ifndef THREADED_DISPATCH
     }
   }
+#endif
 
 #undef READ_BYTE
 #undef READ_CONSTANT
+#undef READ_SHORT
+#undef GLOBAL_NAME
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef STORE_FRAME
+#undef LOAD_FRAME
 #undef BINARY_OP
-#undef READ_STRING
+#undef NUMBER_OP
+#undef BOTH_NUMBERS
+#undef CHECK_NUMBERS
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef TRACE_INSTRUCTION
+#undef COUNT_INSTRUCTION
+#undef OPCODE
+#undef DISPATCH
 }
 
 // We create a new empty chunk and pass it over to the compiler.
@@ -253,20 +550,81 @@ static InterpretResult run() {
 //
 // Otherwise, we send the completed chunk over to the VM to be executed.
 // When the VM finishes, we free the chunk and we’re done
-InterpretResult interpret(const char* source) {
+InterpretResult interpret(VM* vm, const char* source) {
   Chunk chunk;
   init_chunk(&chunk);
 
-  if (!compile(source, &chunk)) {
+  if (!compile(vm, source, &chunk)) {
     free_chunk(&chunk);
     return INTERPRET_COMPILE_ERROR;
   }
 
-  vm.chunk = &chunk;
-  vm.ip = vm.chunk->code;
+  vm->chunk = &chunk;
+  vm->ip = vm->chunk->code;
 
-  InterpretResult result = run();
+  InterpretResult result;
+  JitCode jit;
+  if (vm->jit_enabled && jit_compile(&chunk, &jit)) {
+    result = jit_execute(vm, &jit);
+    jit_free(&jit);
+  } else {
+    result = run(vm);
+  }
+  vm->chunk = NULL;
   free_chunk(&chunk);
 
   return result;
 }
+
+InterpretResult run_program(VM* vm, Program* program) {
+  // Start from a clean isolate: whatever the previous execution left on
+  // the heap and in the globals is gone.
+  free_objects(vm);
+  reset_stack(vm);
+
+  // Anything interned while the program runs must come out as the
+  // program’s own string objects, or equal interned strings would no longer
+  // be the same object.
+  free_intern_set(&vm->strings);
+  copy_intern_set(&program->strings, &vm->strings);
+
+  free_table(&vm->global_slots);
+  table_add_all(&program->global_slots, &vm->global_slots);
+  vm->global_values.count = 0;
+  vm->global_names.count = 0;
+  for (int i = 0; i < program->global_names.count; i++) {
+    write_value_array(&vm->global_values, UNDEFINED_VAL);
+    write_value_array(&vm->global_names, program->global_names.values[i]);
+  }
+
+  // The native code never rewrites the bytecode, so it can run against the
+  // shared chunk, whose addresses it was compiled against.
+  InterpretResult result;
+  if (vm->jit_enabled && program->has_jit) {
+    vm->chunk = &program->chunk;
+    vm->ip = program->chunk.code;
+    result = jit_execute(vm, &program->jit);
+    vm->chunk = NULL;
+    return result;
+  }
+
+  // The interpreter quickens instructions in place, so it gets a private
+  // copy of the code. Everything else in the chunk is only ever read.
+  Chunk* chunk = &vm->program_chunk;
+  if (chunk->capacity < program->chunk.count) {
+    int old_capacity = chunk->capacity;
+    chunk->capacity = program->chunk.count;
+    chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity,
+                             chunk->capacity);
+  }
+  memcpy(chunk->code, program->chunk.code, program->chunk.count);
+  chunk->count = program->chunk.count;
+  chunk->lines = program->chunk.lines;
+  chunk->constants = program->chunk.constants;
+
+  vm->chunk = chunk;
+  vm->ip = chunk->code;
+  result = run(vm);
+  vm->chunk = NULL;
+  return result;
+}
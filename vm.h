@@ -2,12 +2,27 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "heap.h"
+#include "intern.h"
+#include "stats.h"
 #include "value.h"
 #include "table.h"
 
 #define STACK_MAX 256
 
-typedef struct {
+typedef struct Program Program;
+
+typedef enum {
+  GC_IDLE,
+  GC_MARK,
+  GC_SWEEP,
+} GcPhase;
+
+// An isolate: the complete state of one interpreter. Isolates share nothing
+// (every object, string table and global belongs to exactly one of them), so
+// separate threads can run separate isolates at the same time. An isolate
+// itself must only be used by one thread at a time.
+struct VM {
   Chunk* chunk;
   // As the VM works its way through the bytecode,
   // it keeps track of where it is—the location of the instruction currently being executed.
@@ -38,16 +53,82 @@ typedef struct {
   //
   Value* stack_top;
 
-  // Linked list of objects for the VM to kepp track of.
-  // Used for Garbage Collection
-  Object* objects;
+  // The garbage collector’s state (see memory.c). Every object the isolate
+  // allocates lives in its heap. Objects start out young and become old if
+  // they survive a minor collection.
+  Heap heap;
+  size_t young_bytes;
+  size_t old_bytes;
+
+  // Where the major collection of the old generation is up to. The gray
+  // stack holds marked objects whose references have yet to be traced, and
+  // the sweeper is up to the given slot of the given page.
+  GcPhase gc_phase;
+  uint8_t gc_white;
+  Object** gray_stack;
+  int gray_count;
+  int gray_capacity;
+  Page* sweep_page;
+  int sweep_slot;
+
+  // The next major collection starts once the old generation grows past
+  // next_major_gc bytes.
+  size_t next_major_gc;
+
+  // Tuning knobs, set up with the defaults from memory.h by init_vm(). Hosts
+  // that keep Values where the collector can’t see them clear gc_enabled.
+  // With more than one gc_thread, major collections stop the program and
+  // run on that many threads instead of running incrementally.
+  size_t gc_nursery_size;
+  size_t gc_min_heap_size;
+  double gc_heap_growth;
+  int gc_threads;
+  bool gc_stress;
+  bool gc_enabled;
+
+  // The chunk the compiler is filling in, if any. Its constants are roots.
+  Chunk* compiling_chunk;
 
   // Internal Strings
-  Table strings;
+  InternSet strings;
 
   // Since we want them to persist as long as clox is running, we store them right in the VM
-  Table globals;
-} VM;
+  //
+  // Globals are resolved to slots at compile time. global_slots maps each
+  // name the compiler has seen to its index in global_values, so a later
+  // REPL line that defines a name lands in the same slot an earlier line
+  // read from. Slots that have not been defined yet hold UNDEFINED_VAL.
+  // global_names parallels global_values so errors can name the variable.
+  Table global_slots;
+  ValueArray global_values;
+  ValueArray global_names;
+
+  // How many times instructions were rewritten into and back out of each
+  // quickened opcode, indexed by the quickened opcode.
+  int quickenings[UINT8_COUNT];
+  int deoptimizations[UINT8_COUNT];
+
+  // Run chunks as native code from the baseline JIT (see jit.c) instead of
+  // interpreting them, where the platform supports it.
+  bool jit_enabled;
+
+  // How hard to optimize every chunk compiled for the isolate: 0 not at all,
+  // 1 with the optimizer in optimize.c, and 2 with the SSA middle end in
+  // ssa.c before it.
+  int optimize;
+
+  // What run_program() executes: a shared Program’s lines and constants
+  // with a private copy of its code, which quickening is free to rewrite.
+  // The copy’s buffer is kept from one execution to the next.
+  Chunk program_chunk;
+
+#ifdef STATS
+  // What the isolate has been doing, counted once a host calls
+  // enable_stats() (see stats.h).
+  bool stats_enabled;
+  Stats stats;
+#endif
+};
 
 typedef enum {
   INTERPRET_OK,
@@ -55,12 +136,20 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+void init_vm(VM* vm);
+void free_vm(VM* vm);
+InterpretResult interpret(VM* vm, const char* source);
+// Runs a compiled program from the top. The isolate’s heap and globals are
+// reset first, so consecutive runs on one isolate don’t see each other.
+InterpretResult run_program(VM* vm, Program* program);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
+int global_slot(VM* vm, Object_String* name);
 
-void init_vm();
-void free_vm();
-InterpretResult interpret(const char* source);
-void push(Value value);
-Value pop();
+// The pieces of the interpreter that compiled code calls back into.
+void concatenate(VM* vm);
+bool is_falsey(Value value);
+void print_line(Value value);
+void runtime_error(VM* vm, const char* format, ...);
 
 #endif